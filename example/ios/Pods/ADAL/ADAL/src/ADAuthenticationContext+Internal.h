@@ -38,6 +38,7 @@
 
 @class ADUserIdentifier;
 @class ADTokenCacheAccessor;
+@class ADCancellationToken;
 @protocol ADTokenCacheDataSource;
 
 #import "ADAuthenticationContext.h"
@@ -79,6 +80,10 @@ extern NSString* const ADRedirectUriInvalidError;
 
 + (BOOL)isForcedAuthorization:(ADPromptBehavior)prompt;
 
+/*! Keeps track of the token so -cancelOutstandingRequests can cancel it. Only a weak
+ reference is held, the token goes away with its request. */
+- (void)registerCancellationToken:(ADCancellationToken *)token;
+
 + (ADAuthenticationResult*)updateResult:(ADAuthenticationResult *)result
                                  toUser:(ADUserIdentifier *)userId;
 
@@ -35,9 +35,17 @@
 #import "ADTelemetryEventStrings.h"
 #import "ADUserIdentifier.h"
 #import "ADTokenCacheItem.h"
+#import "ADTokenCacheAccessor.h"
+#import "ADFileTokenCache.h"
+#import "ADAuthenticationResult+Internal.h"
+#import "ADCancellationToken.h"
+#import "ADAuthorityValidation.h"
 
 typedef void(^ADAuthorizationCodeCallback)(NSString*, ADAuthenticationError*);
 
+// The most silent token requests acquireTokensSilentWithResources: has in flight at a time
+#define BATCH_SILENT_MAX_CONCURRENT_REQUESTS 3
+
 // This variable is purposefully a global so that way we can more easily pull it out of the
 // symbols in a binary to detect what version of ADAL is being used without needing to
 // run the application.
@@ -131,6 +139,31 @@ NSString* ADAL_VERSION_VAR = @ADAL_VERSION_STRING;
                              error:error];
 }
 
+- (id)initWithAuthority:(NSString *)authority
+      validateAuthority:(BOOL)validateAuthority
+          cacheFilePath:(NSString *)cacheFilePath
+                  error:(ADAuthenticationError * __autoreleasing *)error
+{
+    API_ENTRY;
+    RETURN_NIL_ON_NIL_EMPTY_ARGUMENT(cacheFilePath);
+    
+    ADFileTokenCache* tokenCache = [ADFileTokenCache cacheWithPath:cacheFilePath];
+    if (!tokenCache)
+    {
+        ADAuthenticationError* adError = [ADAuthenticationError unexpectedInternalError:@"Unable to open the token cache file" correlationId:nil];
+        if (error)
+        {
+            *error = adError;
+        }
+        return nil;
+    }
+    
+    return [self initWithAuthority:authority
+                 validateAuthority:validateAuthority
+                        tokenCache:tokenCache
+                             error:error];
+}
+
 - (ADAuthenticationRequest*)requestWithRedirectString:(NSString*)redirectUri
                                              clientId:(NSString*)clientId
                                              resource:(NSString*)resource
@@ -237,6 +270,21 @@ NSString* ADAL_VERSION_VAR = @ADAL_VERSION_STRING;
     return [ADAuthenticationRequest internalHandleBrokerResponse:response];
 }
 
++ (void)prefetchAuthorityValidation:(NSArray<NSString*>*)authorities
+                             userId:(NSString*)userId
+{
+    API_ENTRY;
+    if (!authorities.count)
+    {
+        return;
+    }
+    
+    NSArray* toPrefetch = [authorities copy];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        [[ADAuthorityValidation sharedInstance] prefetchAuthorities:toPrefetch userId:userId];
+    });
+}
+
 #define REQUEST_WITH_REDIRECT_STRING(_redirect, _clientId, _resource) \
     THROW_ON_NIL_ARGUMENT(completionBlock) \
     CHECK_STRING_ARG_BLOCK(_clientId) \
@@ -346,6 +394,160 @@ NSString* ADAL_VERSION_VAR = @ADAL_VERSION_STRING;
     [request acquireToken:@"8" completionBlock:completionBlock];
 }
 
+- (void)acquireTokensSilentWithResources:(NSArray<NSString*>*)resources
+                                clientId:(NSString*)clientId
+                             redirectUri:(NSURL*)redirectUri
+                                  userId:(NSString*)userId
+                         completionBlock:(ADBatchAuthenticationCallback)completionBlock
+{
+    API_ENTRY;
+    THROW_ON_NIL_ARGUMENT(completionBlock);
+    
+    // The results are always handed back on a background queue, whether they all came out of the
+    // cache or some of them had to go to the network.
+    ADBatchAuthenticationCallback deliver = ^(NSDictionary<NSString*, ADAuthenticationResult*>* results)
+    {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            completionBlock(results);
+        });
+    };
+    
+    NSArray* uniqueResources = [[NSOrderedSet orderedSetWithArray:resources] array];
+    
+    // Pick up everything we can straight out of the cache first, with a single read.
+    ADAuthenticationRequest* request = nil;
+    if (uniqueResources.count && [self hasCacheStore] && ![NSString adIsStringNilOrBlank:clientId])
+    {
+        // If the request can't be created the single resource requests report why
+        request = [self requestWithRedirectUrl:redirectUri
+                                      clientId:clientId
+                                      resource:nil
+                               completionBlock:^(ADAuthenticationResult *result) { (void)result; }];
+    }
+    
+    if (!request)
+    {
+        [self acquireSilentTokensForResources:uniqueResources
+                                      results:[NSMutableDictionary new]
+                                     clientId:clientId
+                                  redirectUri:redirectUri
+                                       userId:userId
+                              completionBlock:deliver];
+        return;
+    }
+    
+    [request setLogComponent:_logComponent];
+    [request setUserId:userId];
+    [request setSilent:YES];
+    [request acquireTokensFromCacheForResources:uniqueResources
+                                          apiId:@"9"
+                                completionBlock:^(NSDictionary<NSString*, ADAuthenticationResult*>* results)
+     {
+         [self acquireSilentTokensForResources:uniqueResources
+                                       results:[results mutableCopy]
+                                      clientId:clientId
+                                   redirectUri:redirectUri
+                                        userId:userId
+                               completionBlock:deliver];
+     }];
+}
+
+// Gets the tokens for the resources that don't have a result yet, with a bounded number of
+// single resource silent requests in flight at any time.
+- (void)acquireSilentTokensForResources:(NSArray *)resources
+                                results:(NSMutableDictionary *)results
+                               clientId:(NSString *)clientId
+                            redirectUri:(NSURL *)redirectUri
+                                 userId:(NSString *)userId
+                        completionBlock:(ADBatchAuthenticationCallback)completionBlock
+{
+    NSMutableArray* pending = [NSMutableArray new];
+    for (NSString* resource in resources)
+    {
+        if (![results objectForKey:resource])
+        {
+            [pending addObject:resource];
+        }
+    }
+    
+    AD_LOG_INFO_F(@"Batch silent token request", _correlationId, @"resources: %lu; found in cache: %lu;", (unsigned long)resources.count, (unsigned long)results.count);
+    
+    if (pending.count == 0)
+    {
+        completionBlock(results);
+        return;
+    }
+    
+    NSUInteger expected = resources.count;
+    NSUInteger initial = MIN(pending.count, (NSUInteger)BATCH_SILENT_MAX_CONCURRENT_REQUESTS);
+    for (NSUInteger i = 0; i < initial; i++)
+    {
+        [self acquireNextSilentTokenFrom:pending
+                                 results:results
+                                expected:expected
+                                clientId:clientId
+                             redirectUri:redirectUri
+                                  userId:userId
+                         completionBlock:completionBlock];
+    }
+}
+
+// Takes the next resource off of pending and gets a token for it, then moves on to the next
+// resource, until pending runs dry. Calls the completion block once all of the results are in.
+- (void)acquireNextSilentTokenFrom:(NSMutableArray *)pending
+                           results:(NSMutableDictionary *)results
+                          expected:(NSUInteger)expected
+                          clientId:(NSString *)clientId
+                       redirectUri:(NSURL *)redirectUri
+                            userId:(NSString *)userId
+                   completionBlock:(ADBatchAuthenticationCallback)completionBlock
+{
+    NSString* resource = nil;
+    @synchronized(results)
+    {
+        resource = [pending firstObject];
+        if (!resource)
+        {
+            return;
+        }
+        [pending removeObjectAtIndex:0];
+    }
+    
+    [self acquireTokenSilentWithResource:resource
+                                clientId:clientId
+                             redirectUri:redirectUri
+                                  userId:userId
+                         completionBlock:^(ADAuthenticationResult *result)
+     {
+         if (!result)
+         {
+             ADAuthenticationError* error = [ADAuthenticationError unexpectedInternalError:@"Silent token request completed without a result" correlationId:_correlationId];
+             result = [ADAuthenticationResult resultFromError:error correlationId:_correlationId];
+         }
+         
+         BOOL done = NO;
+         @synchronized(results)
+         {
+             [results setObject:result forKey:resource];
+             done = results.count == expected;
+         }
+         
+         if (done)
+         {
+             completionBlock(results);
+             return;
+         }
+         
+         [self acquireNextSilentTokenFrom:pending
+                                  results:results
+                                 expected:expected
+                                 clientId:clientId
+                              redirectUri:redirectUri
+                                   userId:userId
+                          completionBlock:completionBlock];
+     }];
+}
+
 - (void)acquireTokenWithResource:(NSString*)resource
                         clientId:(NSString*)clientId
                      redirectUri:(NSURL*)redirectUri
@@ -380,6 +582,34 @@ NSString* ADAL_VERSION_VAR = @ADAL_VERSION_STRING;
     [request acquireToken:@"130" completionBlock:completionBlock];
 }
 
+- (void)registerCancellationToken:(ADCancellationToken *)token
+{
+    @synchronized(self)
+    {
+        if (!_cancellationTokens)
+        {
+            _cancellationTokens = [NSHashTable weakObjectsHashTable];
+        }
+        [_cancellationTokens addObject:token];
+    }
+}
+
+- (void)cancelOutstandingRequests
+{
+    NSArray* tokens = nil;
+    @synchronized(self)
+    {
+        tokens = [_cancellationTokens allObjects];
+        [_cancellationTokens removeAllObjects];
+    }
+    
+    AD_LOG_INFO_F(@"Cancelling outstanding requests", _correlationId, @"requests: %lu", (unsigned long)tokens.count);
+    for (ADCancellationToken* token in tokens)
+    {
+        [token cancel];
+    }
+}
+
 @end
 
 @implementation ADAuthenticationContext (CacheStorage)
@@ -52,4 +52,7 @@
 /*! Internal method to set the extendedLifetimeToken flag. */
 - (void)setExtendedLifeTimeToken:(BOOL)extendedLifeTimeToken;
 
+/*! Creates a copy of the result to hand to another request, carrying that request's correlation id. */
+- (ADAuthenticationResult*)resultWithCorrelationId:(NSUUID*)correlationId;
+
 @end
@@ -228,4 +228,23 @@ multiResourceRefreshToken: (BOOL) multiResourceRefreshToken
     _extendedLifeTimeToken = extendedLifeTimeToken;
 }
 
+- (ADAuthenticationResult*)resultWithCorrelationId:(NSUUID*)correlationId
+{
+    ADAuthenticationResult* result = nil;
+    if (_error)
+    {
+        result = [[ADAuthenticationResult alloc] initWithError:_error status:_status correlationId:correlationId];
+    }
+    else
+    {
+        // The item is copied so that nothing done with one request's result shows up in another's
+        result = [[ADAuthenticationResult alloc] initWithItem:[_tokenCacheItem copy]
+                                    multiResourceRefreshToken:_multiResourceRefreshToken
+                                                correlationId:correlationId];
+    }
+    result->_extendedLifeTimeToken = _extendedLifeTimeToken;
+    
+    return result;
+}
+
 @end
@@ -46,6 +46,10 @@
         //Initialize the defaults here:
         self.requestTimeOut = 300;//in seconds.
         self.expirationBuffer = 300;//in seconds, ensures catching of clock differences between the server and the device
+        self.maxRequestAttempts = 2;
+        self.retryBaseDelay = 0.5;//in seconds
+        self.retryMaxDelay = 8;//in seconds
+        self.retryDeadline = 30;//in seconds
 #if TARGET_OS_IPHONE
         self.enableFullScreen = YES;
 #endif
@@ -27,12 +27,26 @@
 /*! The completion block declaration. */
 typedef void(^ADAuthorityValidationCallback)(BOOL validated, ADAuthenticationError *error);
 
-/*! A singleton class, used to validate authorities with in-memory caching of the previously validated ones.
+/*! A singleton class, used to validate authorities with caching of the previously validated ones.
+ Validated authorities are kept in memory indexed by their scheme, host and port, and persisted in
+ NSUserDefaults for a day so that the validation round trips are skipped on later launches.
  The class is thread-safe. */
 @interface ADAuthorityValidation : NSObject
 {
+    // domain -> authority key -> expiration date
     NSMutableDictionary *_validatedAdfsAuthorities;
-    NSMutableSet *_validatedADAuthorities;
+    // authority key -> expiration date
+    NSMutableDictionary *_validatedADAuthorities;
+    BOOL _loadedPersistedAuthorities;
+    
+    // validation key -> requests waiting on the validation already in flight for it
+    NSMutableDictionary *_pendingValidations;
+    // validation key -> how long its prefetch took, until a request uses it
+    NSMutableDictionary *_prefetchDurations;
+    
+    NSUInteger _coalescedValidationCount;
+    NSUInteger _prefetchHitCount;
+    NSTimeInterval _prefetchTimeSaved;
 }
 
 + (ADAuthorityValidation *)sharedInstance;
@@ -60,4 +74,24 @@ typedef void(^ADAuthorityValidationCallback)(BOOL validated, ADAuthenticationErr
 - (void)validateAuthority:(ADRequestParameters*)requestParams
           completionBlock:(ADAuthorityValidationCallback)completionBlock;
 
+/*!
+ Validates the authorities in the background so that the first token requests against them don't
+ have to wait for it. Authorities that are already validated are skipped. Failures are only logged,
+ a token request against a failed authority validates it again.
+ 
+ @param authorities          The AAD or ADFS authorities to validate.
+ @param userId               The user the ADFS authorities will be used for, ADFS validation needs
+                             the domain of their UPN. ADFS authorities are skipped if nil.
+ */
+- (void)prefetchAuthorities:(NSArray<NSString *> *)authorities
+                     userId:(NSString *)userId;
+
+/*! Number of validations that waited on one already in flight for the same authority instead of
+    sending their own requests. */
+@property (readonly) NSUInteger coalescedValidationCount;
+/*! Number of requests that found their authority already validated by a prefetch. */
+@property (readonly) NSUInteger prefetchHitCount;
+/*! Total time those requests would otherwise have spent validating their authorities. */
+@property (readonly) NSTimeInterval prefetchTimeSaved;
+
 @end
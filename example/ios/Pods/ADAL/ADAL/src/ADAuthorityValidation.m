@@ -24,9 +24,11 @@
 
 #import "ADAuthorityValidation.h"
 #import "ADAuthorityValidationRequest.h"
+#import "ADCancellationToken.h"
 #import "ADDrsDiscoveryRequest.h"
 #import "ADHelpers.h"
 #import "ADOAuth2Constants.h"
+#import "ADRequestParameters.h"
 #import "ADUserIdentifier.h"
 #import "ADWebFingerRequest.h"
 #import "NSURL+ADExtensions.h"
@@ -51,6 +53,14 @@ static NSString* const s_kValidationServerError        = @"The authority validat
 static NSString* const s_kDrsDiscoveryError            = @"DRS discovery was invalid or failed to return PassiveAuthEndpoint";
 static NSString* const s_kWebFingerError               = @"WebFinger request was invalid or failed";
 
+// Persisted cache of validated authorities
+static NSString* const s_kValidatedAuthoritiesKey      = @"ADAL.ValidatedAuthorities";
+static NSString* const s_kValidatedAADKey              = @"aad";
+static NSString* const s_kValidatedADFSKey             = @"adfs";
+
+// How long a validated authority is trusted without validating it again, in seconds
+#define AUTHORITY_VALIDATION_CACHE_TTL (24 * 60 * 60)
+
 @implementation ADAuthorityValidation
 
 + (ADAuthorityValidation *)sharedInstance
@@ -74,129 +84,263 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
     }
     
     _validatedAdfsAuthorities = [NSMutableDictionary new];
+    _pendingValidations = [NSMutableDictionary new];
+    _prefetchDurations = [NSMutableDictionary new];
     
-    _validatedADAuthorities = [NSMutableSet new];
+    _validatedADAuthorities = [NSMutableDictionary new];
     //List of prevalidated authorities (Azure Active Directory cloud instances).
     //Only the sThrustedAuthority is used for validation of new authorities.
-    [_validatedADAuthorities addObject:[NSURL URLWithString:s_kTrustedAuthority]];
-    [_validatedADAuthorities addObject:[NSURL URLWithString:s_kTrustedAuthorityChina]]; // Microsoft Azure China
-    [_validatedADAuthorities addObject:[NSURL URLWithString:s_kTrustedAuthorityGermany]]; // Microsoft Azure Germany
-    [_validatedADAuthorities addObject:[NSURL URLWithString:s_kTrustedAuthorityWorldWide]]; // Microsoft Azure Worldwide
-    [_validatedADAuthorities addObject:[NSURL URLWithString:s_kTrustedAuthorityUSGovernment]]; // Microsoft Azure US Government
+    NSDate* never = [NSDate distantFuture];
+    [_validatedADAuthorities setObject:never forKey:[[NSURL URLWithString:s_kTrustedAuthority] adAuthorityKey]];
+    [_validatedADAuthorities setObject:never forKey:[[NSURL URLWithString:s_kTrustedAuthorityChina] adAuthorityKey]]; // Microsoft Azure China
+    [_validatedADAuthorities setObject:never forKey:[[NSURL URLWithString:s_kTrustedAuthorityGermany] adAuthorityKey]]; // Microsoft Azure Germany
+    [_validatedADAuthorities setObject:never forKey:[[NSURL URLWithString:s_kTrustedAuthorityWorldWide] adAuthorityKey]]; // Microsoft Azure Worldwide
+    [_validatedADAuthorities setObject:never forKey:[[NSURL URLWithString:s_kTrustedAuthorityUSGovernment] adAuthorityKey]]; // Microsoft Azure US Government
     
     return self;
 }
 
 
 #pragma mark - caching
+
+// Merges in the authorities validated on previous launches, dropping the expired ones. Done on
+// first use rather than at startup so apps that never validate an authority don't pay for it.
+// Must be called under @synchronized(self)
+- (void)loadPersistedAuthorities
+{
+    if (_loadedPersistedAuthorities)
+    {
+        return;
+    }
+    _loadedPersistedAuthorities = YES;
+    
+    NSDictionary* persisted = [[NSUserDefaults standardUserDefaults] dictionaryForKey:s_kValidatedAuthoritiesKey];
+    if (!persisted)
+    {
+        return;
+    }
+    
+    NSDate* now = [NSDate date];
+    NSDictionary* aad = [persisted objectForKey:s_kValidatedAADKey];
+    if ([aad isKindOfClass:[NSDictionary class]])
+    {
+        for (NSString* key in aad)
+        {
+            NSDate* expiresOn = [aad objectForKey:key];
+            if ([expiresOn isKindOfClass:[NSDate class]] && [expiresOn compare:now] == NSOrderedDescending &&
+                ![_validatedADAuthorities objectForKey:key])
+            {
+                [_validatedADAuthorities setObject:expiresOn forKey:key];
+            }
+        }
+    }
+    
+    NSDictionary* adfs = [persisted objectForKey:s_kValidatedADFSKey];
+    if ([adfs isKindOfClass:[NSDictionary class]])
+    {
+        for (NSString* domain in adfs)
+        {
+            NSDictionary* authorities = [adfs objectForKey:domain];
+            if (![authorities isKindOfClass:[NSDictionary class]])
+            {
+                continue;
+            }
+            
+            for (NSString* key in authorities)
+            {
+                NSDate* expiresOn = [authorities objectForKey:key];
+                if (![expiresOn isKindOfClass:[NSDate class]] || [expiresOn compare:now] != NSOrderedDescending)
+                {
+                    continue;
+                }
+                
+                NSMutableDictionary* domainAuthorities = [_validatedAdfsAuthorities objectForKey:domain];
+                if (!domainAuthorities)
+                {
+                    domainAuthorities = [NSMutableDictionary new];
+                    [_validatedAdfsAuthorities setObject:domainAuthorities forKey:domain];
+                }
+                [domainAuthorities setObject:expiresOn forKey:key];
+            }
+        }
+    }
+}
+
+// Must be called under @synchronized(self)
+- (void)persistAuthorities
+{
+    // The prevalidated cloud instances never expire and don't need to be saved
+    NSDate* never = [NSDate distantFuture];
+    NSMutableDictionary* aad = [NSMutableDictionary new];
+    for (NSString* key in _validatedADAuthorities)
+    {
+        NSDate* expiresOn = [_validatedADAuthorities objectForKey:key];
+        if (![expiresOn isEqualToDate:never])
+        {
+            [aad setObject:expiresOn forKey:key];
+        }
+    }
+    
+    NSMutableDictionary* adfs = [NSMutableDictionary new];
+    for (NSString* domain in _validatedAdfsAuthorities)
+    {
+        [adfs setObject:[[_validatedAdfsAuthorities objectForKey:domain] copy] forKey:domain];
+    }
+    
+    [[NSUserDefaults standardUserDefaults] setObject:@{ s_kValidatedAADKey : aad, s_kValidatedADFSKey : adfs }
+                                              forKey:s_kValidatedAuthoritiesKey];
+}
+
 - (BOOL)addValidAuthority:(NSURL *)authority domain:(NSString *)domain
 {
-    if (!domain || !authority)
+    NSString* key = [authority adAuthorityKey];
+    if (!domain || !key)
     {
         return NO;
     }
     
-    // Get authorities for domain (UPN suffix) and create one if needed
-    NSMutableSet *authorities = [_validatedAdfsAuthorities objectForKey:domain];
-    if (!authorities)
+    @synchronized(self)
     {
-        authorities = [NSMutableSet new];
-        [_validatedAdfsAuthorities setObject:authorities forKey:domain];
+        [self loadPersistedAuthorities];
+        
+        // Get authorities for domain (UPN suffix) and create one if needed
+        NSMutableDictionary *authorities = [_validatedAdfsAuthorities objectForKey:domain];
+        if (!authorities)
+        {
+            authorities = [NSMutableDictionary new];
+            [_validatedAdfsAuthorities setObject:authorities forKey:domain];
+        }
+        
+        // Add given authority to trusted set for the domain
+        [authorities setObject:[NSDate dateWithTimeIntervalSinceNow:AUTHORITY_VALIDATION_CACHE_TTL] forKey:key];
+        [self persistAuthorities];
     }
-  
-    // Add given authority to trusted set for the domain
-    [authorities addObject:authority];
     return YES;
 }
 
 - (BOOL)addValidAuthority:(NSURL *)authority
 {
-    if (!authority)
+    NSString* key = [authority adAuthorityKey];
+    if (!key)
     {
         return NO;
     }
-    [_validatedADAuthorities addObject:authority];
+    
+    @synchronized(self)
+    {
+        [self loadPersistedAuthorities];
+        
+        // Don't put an expiration on the prevalidated cloud instances
+        if (![[_validatedADAuthorities objectForKey:key] isEqualToDate:[NSDate distantFuture]])
+        {
+            [_validatedADAuthorities setObject:[NSDate dateWithTimeIntervalSinceNow:AUTHORITY_VALIDATION_CACHE_TTL] forKey:key];
+            [self persistAuthorities];
+        }
+    }
     return YES;
 }
 
++ (BOOL)isValidUntil:(NSDate *)expiresOn
+{
+    return expiresOn && [expiresOn timeIntervalSinceNow] > 0;
+}
 
 - (BOOL)isAuthorityValidated:(NSURL *)authority domain:(NSString *)domain
 {
+    NSString* key = [authority adAuthorityKey];
+    if (!domain || !key)
+    {
+        return NO;
+    }
+    
     // Check for authority
-    NSSet *authorities = [_validatedAdfsAuthorities objectForKey:domain];
-    for (NSURL *url in authorities)
+    @synchronized(self)
     {
-        if([url isEquivalentAuthority:authority])
-        {
-            return YES;
-        }
+        [self loadPersistedAuthorities];
+        return [ADAuthorityValidation isValidUntil:[[_validatedAdfsAuthorities objectForKey:domain] objectForKey:key]];
     }
-    return NO;
 }
 
 // Checks the cache for previously validated authority.
-// Note that the authority host should be normalized: no ending "/" and lowercase.
 - (BOOL)isAuthorityValidated:(NSURL *)authority
 {
-    if (!authority)
+    NSString* key = [authority adAuthorityKey];
+    if (!key)
     {
         return NO;
     }
-    for (NSURL *url in _validatedADAuthorities)
+    
+    @synchronized(self)
     {
-        if([url isEquivalentAuthority:authority])
-        {
-            return YES;
-        }
+        [self loadPersistedAuthorities];
+        return [ADAuthorityValidation isValidUntil:[_validatedADAuthorities objectForKey:key]];
     }
-    return NO;
 }
 
 
 #pragma mark - Authority validation
 
-- (void)validateAuthority:(ADRequestParameters*)requestParams
-          completionBlock:(ADAuthorityValidationCallback)completionBlock
+// Works out the URL to validate and, for ADFS, the domain to validate it for. The domain is nil for AAD.
+- (NSURL *)authorityURLForRequest:(ADRequestParameters *)requestParams
+                           domain:(NSString * __autoreleasing *)domain
+                            error:(ADAuthenticationError * __autoreleasing *)error
 {
     NSString *upn = requestParams.identifier.userId;
     NSString *authority = requestParams.authority;
     
-    ADAuthenticationError *error = [ADHelpers checkAuthority:authority correlationId:requestParams.correlationId];
-    if (error)
+    ADAuthenticationError *adError = [ADHelpers checkAuthority:authority correlationId:requestParams.correlationId];
+    if (adError)
     {
-        completionBlock(NO, error);
-        return;
+        *error = adError;
+        return nil;
     }
     
     NSURL *authorityURL = [NSURL URLWithString:authority.lowercaseString];
     
     if (!authorityURL)
     {
-        error = [ADAuthenticationError errorFromArgument:authority
-                                            argumentName:@"authority"
-                                           correlationId:requestParams.correlationId];
-        completionBlock(NO, error);
-        return;
+        *error = [ADAuthenticationError errorFromArgument:authority
+                                             argumentName:@"authority"
+                                            correlationId:requestParams.correlationId];
+        return nil;
     }
     
     // Check for AAD or ADFS
+    *domain = nil;
     if ([ADHelpers isADFSInstanceURL:authorityURL])
     {
         // Check for upn suffix
         NSString *upnSuffix = [ADHelpers getUPNSuffix:upn];
         if ([NSString adIsStringNilOrBlank:upnSuffix])
         {
-            error = [ADAuthenticationError errorFromArgument:upnSuffix
-                                                argumentName:@"user principal name"
-                                               correlationId:requestParams.correlationId];
-            completionBlock(NO, error);
-            return;
+            *error = [ADAuthenticationError errorFromArgument:upnSuffix
+                                                 argumentName:@"user principal name"
+                                                correlationId:requestParams.correlationId];
+            return nil;
         }
-        
-        // Validate ADFS authority
-        [self validateADFSAuthority:authorityURL domain:upnSuffix requestParams:requestParams completionBlock:completionBlock];
+        *domain = upnSuffix;
+    }
+    
+    return authorityURL;
+}
+
+- (void)validateAuthority:(ADRequestParameters*)requestParams
+          completionBlock:(ADAuthorityValidationCallback)completionBlock
+{
+    NSString *domain = nil;
+    ADAuthenticationError *error = nil;
+    NSURL *authorityURL = [self authorityURLForRequest:requestParams domain:&domain error:&error];
+    if (!authorityURL)
+    {
+        completionBlock(NO, error);
+        return;
     }
     
+    if (domain)
+    {
+        // Validate ADFS authority
+        [self validateADFSAuthority:authorityURL domain:domain requestParams:requestParams completionBlock:completionBlock];
+    }
     else
     {
         // Validate AAD authority
@@ -204,7 +348,165 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
     }
 }
 
+#pragma mark - Coalescing
+
+// ADFS authorities are validated per domain, so the same authority validated for two domains
+// is two separate validations.
++ (NSString *)validationKeyForAuthority:(NSURL *)authority domain:(NSString *)domain
+{
+    NSString *key = [authority adAuthorityKey];
+    if (!domain || !key)
+    {
+        return key;
+    }
+    return [NSString stringWithFormat:@"%@|%@", domain, key];
+}
+
+// Returns YES if a validation for the key is already in flight, the completion block will then be
+// called when it finishes. Otherwise the caller is now the one validating and has to call
+// finishValidation:validated:error: once done.
+- (BOOL)joinValidation:(NSString *)key
+         requestParams:(ADRequestParameters *)requestParams
+       completionBlock:(ADAuthorityValidationCallback)completionBlock
+{
+    @synchronized(self)
+    {
+        NSMutableArray *waiters = [_pendingValidations objectForKey:key];
+        if (!waiters)
+        {
+            [_pendingValidations setObject:[NSMutableArray new] forKey:key];
+            return NO;
+        }
+        
+        [waiters addObject:@[requestParams, [completionBlock copy]]];
+        ++_coalescedValidationCount;
+    }
+    
+    AD_LOG_VERBOSE(@"Waiting on authority validation already in progress", requestParams.correlationId, key);
+    return YES;
+}
+
+- (void)finishValidation:(NSString *)key
+               validated:(BOOL)validated
+                   error:(ADAuthenticationError *)error
+{
+    NSArray *waiters = nil;
+    @synchronized(self)
+    {
+        waiters = [_pendingValidations objectForKey:key];
+        [_pendingValidations removeObjectForKey:key];
+    }
+    
+    // A cancelled or timed out validation belongs to the request that started it, the requests
+    // waiting on it have their own cancellation tokens and get to try for themselves.
+    NSInteger code = error.code;
+    BOOL stopped = [error.domain isEqualToString:ADAuthenticationErrorDomain] &&
+                   (code == AD_ERROR_REQUEST_CANCELLED || code == AD_ERROR_REQUEST_DEADLINE_EXCEEDED);
+    
+    for (NSArray *waiter in waiters)
+    {
+        ADAuthorityValidationCallback waiterCompletion = waiter[1];
+        if (stopped)
+        {
+            [self validateAuthority:waiter[0] completionBlock:waiterCompletion];
+        }
+        else
+        {
+            waiterCompletion(validated, error);
+        }
+    }
+}
+
+#pragma mark - Prefetching
+
+- (void)prefetchAuthorities:(NSArray<NSString *> *)authorities
+                     userId:(NSString *)userId
+{
+    for (NSString *authority in authorities)
+    {
+        ADRequestParameters *requestParams = [ADRequestParameters new];
+        [requestParams setAuthority:authority];
+        [requestParams setIdentifier:[ADUserIdentifier identifierWithId:userId]];
+        [requestParams setCorrelationId:[NSUUID UUID]];
+        
+        NSString *domain = nil;
+        ADAuthenticationError *error = nil;
+        NSURL *authorityURL = [self authorityURLForRequest:requestParams domain:&domain error:&error];
+        if (!authorityURL)
+        {
+            AD_LOG_INFO(@"Skipping authority validation prefetch", requestParams.correlationId, error.errorDetails);
+            continue;
+        }
+        
+        if (domain ? [self isAuthorityValidated:authorityURL domain:domain] : [self isAuthorityValidated:authorityURL])
+        {
+            continue;
+        }
+        
+        NSString *key = [ADAuthorityValidation validationKeyForAuthority:authorityURL domain:domain];
+        NSDate *startTime = [NSDate date];
+        [self validateAuthority:requestParams
+                completionBlock:^(BOOL validated, ADAuthenticationError *error)
+        {
+            if (!validated)
+            {
+                AD_LOG_INFO(@"Authority validation prefetch failed", requestParams.correlationId, error.errorDetails);
+                return;
+            }
+            
+            @synchronized(self)
+            {
+                [_prefetchDurations setObject:@(-[startTime timeIntervalSinceNow]) forKey:key];
+            }
+        }];
+    }
+}
+
+// Counts the time saved the first time a request finds a prefetched authority in the cache. Later
+// requests would have found it cached from that first validation anyway.
+- (void)recordCacheHit:(NSString *)key
+         requestParams:(ADRequestParameters *)requestParams
+{
+    NSNumber *duration = nil;
+    @synchronized(self)
+    {
+        duration = [_prefetchDurations objectForKey:key];
+        if (!duration)
+        {
+            return;
+        }
+        
+        [_prefetchDurations removeObjectForKey:key];
+        ++_prefetchHitCount;
+        _prefetchTimeSaved += duration.doubleValue;
+    }
+    
+    AD_LOG_VERBOSE_F(@"Authority validated by prefetch", requestParams.correlationId, @"saved %.3f seconds", duration.doubleValue);
+}
 
+- (NSUInteger)coalescedValidationCount
+{
+    @synchronized(self)
+    {
+        return _coalescedValidationCount;
+    }
+}
+
+- (NSUInteger)prefetchHitCount
+{
+    @synchronized(self)
+    {
+        return _prefetchHitCount;
+    }
+}
+
+- (NSTimeInterval)prefetchTimeSaved
+{
+    @synchronized(self)
+    {
+        return _prefetchTimeSaved;
+    }
+}
 
 #pragma mark - AAD authority validation
 //Sends authority validation to the trustedAuthority by leveraging the instance discovery endpoint
@@ -214,13 +516,21 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
                requestParams:(ADRequestParameters *)requestParams
              completionBlock:(ADAuthorityValidationCallback)completionBlock
 {
+    NSString *key = [ADAuthorityValidation validationKeyForAuthority:authority domain:nil];
+    
     // Check cache
     if ([self isAuthorityValidated:authority])
     {
+        [self recordCacheHit:key requestParams:requestParams];
         completionBlock(YES, nil);
         return;
     }
     
+    if ([self joinValidation:key requestParams:requestParams completionBlock:completionBlock])
+    {
+        return;
+    }
+    
     [ADAuthorityValidationRequest requestAuthorityValidationForAuthority:authority.absoluteString
                                                         trustedAuthority:s_kTrustedAuthority
                                                                  context:requestParams
@@ -235,10 +545,14 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
             // Error response from the server
             errorDetails = errorDetails ? errorDetails : [NSString stringWithFormat:@"%@ - %@", s_kValidationServerError, serverOAuth2Error];
             
-            error = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_DEVELOPER_AUTHORITY_VALIDATION
-                                                           protocolCode:serverOAuth2Error
-                                                           errorDetails:errorDetails
-                                                          correlationId:requestParams.correlationId];
+            // Keep the cancellation error as is, so the requests waiting on this one can tell
+            if (!error || ![[requestParams cancellationToken] isCancelled])
+            {
+                error = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_DEVELOPER_AUTHORITY_VALIDATION
+                                                               protocolCode:serverOAuth2Error
+                                                               errorDetails:errorDetails
+                                                              correlationId:requestParams.correlationId];
+            }
         }
         else
         {
@@ -246,6 +560,7 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
         }
         
         completionBlock(verified, error);
+        [self finishValidation:key validated:verified error:error];
     }];
 }
 
@@ -257,13 +572,21 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
                 requestParams:(ADRequestParameters *)requestParams
               completionBlock:(ADAuthorityValidationCallback)completionBlock
 {
+    NSString *key = [ADAuthorityValidation validationKeyForAuthority:authority domain:domain];
+    
     // Check cache first
     if([self isAuthorityValidated:authority domain:domain])
     {
+        [self recordCacheHit:key requestParams:requestParams];
         completionBlock(YES, nil);
         return;
     }
     
+    if ([self joinValidation:key requestParams:requestParams completionBlock:completionBlock])
+    {
+        return;
+    }
+    
     // DRS discovery
     [self requestDrsDiscovery:domain
                       context:requestParams
@@ -281,6 +604,7 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
                                                               correlationId:requestParams.correlationId];
             }
             completionBlock(NO, error);
+            [self finishValidation:key validated:NO error:error];
             return;
         }
         
@@ -294,6 +618,7 @@ static NSString* const s_kWebFingerError               = @"WebFinger request was
                 [self addValidAuthority:authority domain:domain];
             }
             completionBlock(validated, error);
+            [self finishValidation:key validated:validated error:error];
         }];
     }];
 }
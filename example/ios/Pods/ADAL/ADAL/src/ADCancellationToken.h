@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+@class ADAuthenticationError;
+
+/*!
+    Carried through every stage of a request (see ADRequestParameters) to let it be cancelled,
+    or stopped once it runs past its deadline. Each stage checks the token before doing any work,
+    and in-flight web requests register a handler to cancel their task.
+ */
+@interface ADCancellationToken : NSObject
+{
+    NSDate* _deadline;
+    BOOL _cancelled;
+    BOOL _expired;
+    NSMutableDictionary* _handlers;
+    NSUInteger _nextHandlerId;
+}
+
+/*! Creates a token that expires timeout seconds from now. 0 means no deadline. */
++ (ADCancellationToken *)tokenWithTimeout:(NSTimeInterval)timeout;
+
+/*! nil if the token has no deadline. */
+@property (readonly) NSDate* deadline;
+
+/*! Cancels the token, calling all of the registered handlers. */
+- (void)cancel;
+
+/*! YES if the token was cancelled or is past its deadline. */
+- (BOOL)isCancelled;
+
+/*! The time left until the deadline, 0 if cancelled, DBL_MAX if there is no deadline. */
+- (NSTimeInterval)remainingTime;
+
+/*! The error to finish a request with, or nil if the token is not cancelled. */
+- (ADAuthenticationError *)errorWithCorrelationId:(NSUUID *)correlationId;
+
+/*! Registers a block to be called when the token is cancelled or expires. If that already
+    happened the block is called right away. Returns a handle for -removeCancellationHandler: */
+- (id)addCancellationHandler:(dispatch_block_t)handler;
+
+- (void)removeCancellationHandler:(id)handle;
+
+@end
@@ -0,0 +1,182 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import "ADCancellationToken.h"
+
+@implementation ADCancellationToken
+
+@synthesize deadline = _deadline;
+
++ (ADCancellationToken *)tokenWithTimeout:(NSTimeInterval)timeout
+{
+    ADCancellationToken* token = [ADCancellationToken new];
+    if (timeout <= 0)
+    {
+        return token;
+    }
+    
+    token->_deadline = [NSDate dateWithTimeIntervalSinceNow:timeout];
+    
+    // Fire the handlers at the deadline so that work in flight gets stopped, not just work that
+    // hasn't started yet.
+    __weak ADCancellationToken* weakToken = token;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [weakToken expire];
+    });
+    
+    return token;
+}
+
+- (id)init
+{
+    if (!(self = [super init]))
+    {
+        return nil;
+    }
+    
+    _handlers = [NSMutableDictionary new];
+    
+    return self;
+}
+
+- (void)cancel
+{
+    NSArray* handlers = nil;
+    @synchronized(self)
+    {
+        if (_cancelled || _expired)
+        {
+            return;
+        }
+        _cancelled = YES;
+        handlers = [_handlers allValues];
+        [_handlers removeAllObjects];
+    }
+    
+    for (dispatch_block_t handler in handlers)
+    {
+        handler();
+    }
+}
+
+- (void)expire
+{
+    NSArray* handlers = nil;
+    @synchronized(self)
+    {
+        if (_cancelled || _expired)
+        {
+            return;
+        }
+        _expired = YES;
+        handlers = [_handlers allValues];
+        [_handlers removeAllObjects];
+    }
+    
+    for (dispatch_block_t handler in handlers)
+    {
+        handler();
+    }
+}
+
+- (BOOL)isCancelled
+{
+    @synchronized(self)
+    {
+        if (_cancelled || _expired)
+        {
+            return YES;
+        }
+    }
+    
+    return _deadline && [_deadline timeIntervalSinceNow] <= 0;
+}
+
+- (NSTimeInterval)remainingTime
+{
+    if ([self isCancelled])
+    {
+        return 0;
+    }
+    
+    return _deadline ? [_deadline timeIntervalSinceNow] : DBL_MAX;
+}
+
+- (ADAuthenticationError *)errorWithCorrelationId:(NSUUID *)correlationId
+{
+    BOOL cancelled = NO;
+    @synchronized(self)
+    {
+        cancelled = _cancelled;
+    }
+    
+    if (cancelled)
+    {
+        return [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_REQUEST_CANCELLED
+                                                      protocolCode:nil
+                                                      errorDetails:@"The request was cancelled."
+                                                     correlationId:correlationId];
+    }
+    
+    if ([self isCancelled])
+    {
+        return [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_REQUEST_DEADLINE_EXCEEDED
+                                                      protocolCode:nil
+                                                      errorDetails:@"The request did not complete before its deadline."
+                                                     correlationId:correlationId];
+    }
+    
+    return nil;
+}
+
+- (id)addCancellationHandler:(dispatch_block_t)handler
+{
+    NSNumber* handle = nil;
+    @synchronized(self)
+    {
+        if (!(_cancelled || _expired))
+        {
+            handle = @(++_nextHandlerId);
+            [_handlers setObject:[handler copy] forKey:handle];
+            return handle;
+        }
+    }
+    
+    handler();
+    return nil;
+}
+
+- (void)removeCancellationHandler:(id)handle
+{
+    if (!handle)
+    {
+        return;
+    }
+    
+    @synchronized(self)
+    {
+        [_handlers removeObjectForKey:handle];
+    }
+}
+
+@end
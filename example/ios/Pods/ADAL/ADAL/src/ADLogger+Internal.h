@@ -96,6 +96,16 @@
 /*! Returns previously set callback call or nil, if the user has not set such callback. */
 + (LogCallback)getLogCallBack;
 
+/*! Returns YES if a message at this level would currently be logged anywhere. Used to skip
+ building expensive log information (e.g. stringifying response bodies) that would be dropped. */
++ (BOOL)isLevelEnabled:(ADAL_LOG_LEVEL)logLevel;
+
+/*! The serial queue log messages are formatted and delivered on. */
++ (dispatch_queue_t)logQueue;
+
+/*! Delivers the queued log messages. Only called on the log queue. */
++ (void)drainRecords;
+
 /*! Main logging function. Macros like ADAL_LOG_ERROR are provided on top for convenience
  @param logLevel The applicable priority of the logged message. Use AD_LOG_LEVEL_NO_LOG to disable all logging.
  @param message Short text defining the operation/condition.
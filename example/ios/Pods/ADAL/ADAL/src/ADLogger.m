@@ -28,6 +28,7 @@
 #include <sys/sysctl.h>
 #include <mach/machine.h>
 #include <CommonCrypto/CommonDigest.h>
+#include <pthread.h>
 
 @protocol LoggerContext <NSObject>
 
@@ -44,6 +45,38 @@ static NSMutableDictionary* s_adalId = nil;
 
 static dispatch_once_t s_logOnce;
 
+// Fingerprints of recently logged tokens, keyed by the token objects themselves. The same token
+// objects get logged over and over in the silent flow, this saves hashing them every time.
+#define TOKEN_HASH_CACHE_MAX_COUNT 128
+#define TOKEN_HASH_LENGTH 7
+
+// Log messages are captured on the calling thread and queued. They are formatted and handed to
+// NSLog and the callback on a serial queue. Logging threads never wait on any of that, and the
+// callback is never called with a lock held, though never from two threads at once either.
+#define MAX_PENDING_LOG_RECORDS 10000
+
+@interface ADLogRecord : NSObject
+{
+@public
+    ADAL_LOG_LEVEL _level;
+    NSString* _component;
+    NSString* _message;
+    NSString* _info;
+    NSInteger _errorCode;
+    NSUUID* _correlationId;
+    NSDictionary* _userInfo;
+    NSDate* _date;
+}
+@end
+
+@implementation ADLogRecord
+@end
+
+static pthread_mutex_t s_pendingLock = PTHREAD_MUTEX_INITIALIZER;
+static NSMutableArray* s_pendingRecords = nil;
+static NSUInteger s_droppedRecords = 0;
+static char s_logQueueKey;
+
 @implementation ADLogger
 
 + (void)initialize
@@ -78,7 +111,7 @@ static dispatch_once_t s_logOnce;
 
 + (void)setLogCallBack:(LogCallback)callback
 {
-    @synchronized(self)//Avoid changing to null while attempting to call it.
+    @synchronized(self)//The log queue reads it under the lock, then calls it outside.
     {
         s_LogCallback = [callback copy];
     }
@@ -95,6 +128,19 @@ static dispatch_once_t s_logOnce;
     return s_NSLogging;
 }
 
++ (void)flush
+{
+    // Would wait on itself if called from the callback
+    if (dispatch_get_specific(&s_logQueueKey))
+    {
+        return;
+    }
+    
+    dispatch_sync([self logQueue], ^{
+        [self drainRecords];
+    });
+}
+
 @end
 
 @implementation ADLogger (Internal)
@@ -107,6 +153,12 @@ static dispatch_once_t s_logOnce;
     }
 }
 
++ (BOOL)isLevelEnabled:(ADAL_LOG_LEVEL)logLevel
+{
+    // Read without the lock, this is only a hint and -log: checks again before logging
+    return logLevel > ADAL_LOG_LEVEL_NO_LOG && logLevel <= s_LogLevel && (s_LogCallback || s_NSLogging);
+}
+
 + (NSString*)stringForLevel:(ADAL_LOG_LEVEL)level
 {
     switch (level)
@@ -119,6 +171,111 @@ static dispatch_once_t s_logOnce;
     }
 }
 
++ (dispatch_queue_t)logQueue
+{
+    static dispatch_queue_t s_logQueue = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        s_logQueue = dispatch_queue_create("com.microsoft.adal.logger", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(s_logQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+        dispatch_queue_set_specific(s_logQueue, &s_logQueueKey, &s_logQueueKey, NULL);
+    });
+    return s_logQueue;
+}
+
++ (void)enqueueRecord:(ADLogRecord*)record
+{
+    BOOL scheduleDrain = NO;
+    
+    pthread_mutex_lock(&s_pendingLock);
+    if (!s_pendingRecords)
+    {
+        s_pendingRecords = [NSMutableArray new];
+        scheduleDrain = YES;
+    }
+    
+    if (s_pendingRecords.count < MAX_PENDING_LOG_RECORDS)
+    {
+        [s_pendingRecords addObject:record];
+    }
+    else
+    {
+        ++s_droppedRecords;
+    }
+    pthread_mutex_unlock(&s_pendingLock);
+    
+    // Only the first record since the last drain needs to schedule one, the rest go with it
+    if (scheduleDrain)
+    {
+        dispatch_async([self logQueue], ^{
+            [self drainRecords];
+        });
+    }
+}
+
+// Runs on the log queue, the only place records are formatted and delivered.
++ (void)drainRecords
+{
+    static NSDateFormatter* s_dateFormatter = nil;
+    if (!s_dateFormatter)
+    {
+        s_dateFormatter = [[NSDateFormatter alloc] init];
+        [s_dateFormatter setTimeZone:[NSTimeZone timeZoneWithName:@"UTC"]];
+        [s_dateFormatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
+    }
+    
+    pthread_mutex_lock(&s_pendingLock);
+    NSArray* records = s_pendingRecords;
+    NSUInteger dropped = s_droppedRecords;
+    s_pendingRecords = nil;
+    s_droppedRecords = 0;
+    pthread_mutex_unlock(&s_pendingLock);
+    
+    LogCallback callback = [self getLogCallBack];
+    BOOL nsLogging = s_NSLogging;
+    
+    if (dropped && nsLogging)
+    {
+        NSLog(@"ADAL " ADAL_VERSION_STRING " %@ WARNING: %lu log messages were dropped", s_OSString, (unsigned long)dropped);
+    }
+    
+    for (ADLogRecord* record in records)
+    {
+        @autoreleasepool
+        {
+            NSString* component = @"";
+            if (record->_component)
+            {
+                component = [NSString stringWithFormat:@" [%@]", record->_component];
+            }
+            
+            NSString* correlationIdStr = @"";
+            if (record->_correlationId)
+            {
+                correlationIdStr = [NSString stringWithFormat:@" - %@", record->_correlationId.UUIDString];
+            }
+            
+            NSString* dateString = [s_dateFormatter stringFromDate:record->_date];
+            if (nsLogging)
+            {
+                NSString* levelString = [self stringForLevel:record->_level];
+                
+                NSString* msg = [NSString stringWithFormat:@"ADAL " ADAL_VERSION_STRING " %@ [%@%@]%@ %@: %@", s_OSString, dateString, correlationIdStr,
+                                 component, levelString, record->_message];
+                
+                //NSLog is documented as thread-safe:
+                NSLog(@"%@", msg);
+            }
+            
+            if (callback)
+            {
+                NSString* msg = [NSString stringWithFormat:@"ADAL " ADAL_VERSION_STRING " %@ [%@%@]%@ %@", s_OSString, dateString, correlationIdStr, component, record->_message];
+                callback(record->_level, msg, record->_info, record->_errorCode, record->_userInfo);
+            }
+        }
+    }
+}
+
 + (void)log:(ADAL_LOG_LEVEL)logLevel
     context:(id)context
     message:(NSString*)message
@@ -127,15 +284,6 @@ static dispatch_once_t s_logOnce;
 correlationId:(NSUUID*)correlationId
    userInfo:(NSDictionary *)userInfo
 {
-    static NSDateFormatter* s_dateFormatter = nil;
-    static dispatch_once_t s_dateOnce;
-    
-    dispatch_once(&s_dateOnce, ^{
-        s_dateFormatter = [[NSDateFormatter alloc] init];
-        [s_dateFormatter setTimeZone:[NSTimeZone timeZoneWithName:@"UTC"]];
-        [s_dateFormatter setDateFormat:@"yyyy-MM-dd HH:mm:ss"];
-    });
-    
     //Note that the logging should not throw, as logging is heavily used in error conditions.
     //Hence, the checks below would rather swallow the error instead of throwing and changing the
     //program logic.
@@ -144,48 +292,32 @@ correlationId:(NSUUID*)correlationId
     if (!message)
         return;
     
+    if (!(logLevel <= s_LogLevel && (s_LogCallback || s_NSLogging)))
+    {
+        return;
+    }
+    
+    // Only capture the fields here, formatting and delivery happen on the log queue. Callers can
+    // pass mutable strings and dictionaries and keep changing them, so take copies.
+    ADLogRecord* record = [ADLogRecord new];
+    record->_level = logLevel;
+    record->_message = [message copy];
+    record->_info = [info copy];
+    record->_errorCode = errorCode;
+    record->_correlationId = correlationId;
+    record->_userInfo = [userInfo copy];
+    record->_date = [NSDate date];
     
-    @synchronized(self)//Guard against thread-unsafe callback and modification of sLogCallback after the check
+    if ([context respondsToSelector:@selector(component)])
     {
-        if (!(logLevel <= s_LogLevel && (s_LogCallback || s_NSLogging)))
-        {
-            return;
-        }
-        
-        NSString* component = @"";
-        if ([context respondsToSelector:@selector(component)])
-        {
-            id compRet = [context component];
-            if ([compRet isKindOfClass:[NSString class]])
-            {
-                component = [NSString stringWithFormat:@" [%@]", compRet];
-            }
-        }
-        
-        NSString* correlationIdStr = @"";
-        if (correlationId)
-        {
-            correlationIdStr = [NSString stringWithFormat:@" - %@", correlationId.UUIDString];
-        }
-        
-        NSString* dateString =  [s_dateFormatter stringFromDate:[NSDate date]];
-        if (s_NSLogging)
-        {
-            NSString* levelString = [self stringForLevel:logLevel];
-            
-            NSString* msg = [NSString stringWithFormat:@"ADAL " ADAL_VERSION_STRING " %@ [%@%@]%@ %@: %@", s_OSString, dateString, correlationIdStr,
-                             component, levelString, message];
-            
-            //NSLog is documented as thread-safe:
-            NSLog(@"%@", msg);
-        }
-        
-        if (s_LogCallback)
+        id compRet = [context component];
+        if ([compRet isKindOfClass:[NSString class]])
         {
-            NSString* msg = [NSString stringWithFormat:@"ADAL " ADAL_VERSION_STRING " %@ [%@%@]%@ %@", s_OSString, dateString, correlationIdStr, component, message];
-            s_LogCallback(logLevel, msg, info, errorCode, userInfo);
+            record->_component = compRet;
         }
     }
+    
+    [self enqueueRecord:record];
 }
 
 + (void)log:(ADAL_LOG_LEVEL)level
@@ -270,17 +402,50 @@ correlationId:(NSUUID*)correlationId
     {
         return nil;//Handle gracefully
     }
+    
+    static NSMapTable* s_tokenHashes = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        // Weak keys compared by pointer, so an entry never outlives its token or gets matched
+        // by a different token object with the same contents
+        s_tokenHashes = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                              valueOptions:NSPointerFunctionsStrongMemory];
+    });
+    
+    @synchronized(s_tokenHashes)
+    {
+        NSString* cached = [s_tokenHashes objectForKey:input];
+        if (cached)
+        {
+            return cached;
+        }
+    }
+    
     const char* inputStr = [input UTF8String];
     unsigned char hash[CC_SHA256_DIGEST_LENGTH];
     CC_SHA256(inputStr, (int)strlen(inputStr), hash);
-    NSMutableString* toReturn = [[NSMutableString alloc] initWithCapacity:CC_SHA256_DIGEST_LENGTH*2];
-    for (int i = 0; i < sizeof(hash)/sizeof(hash[0]); ++i)
+    
+    // 7 characters is sufficient to differentiate tokens in the log, otherwise the hashes start making log lines hard to read.
+    // Only hex encode the bytes those characters come from.
+    static const char s_kHexDigits[] = "0123456789abcdef";
+    char hex[TOKEN_HASH_LENGTH + 1];
+    for (int i = 0; i < TOKEN_HASH_LENGTH + 1; i += 2)
+    {
+        hex[i] = s_kHexDigits[hash[i / 2] >> 4];
+        hex[i + 1] = s_kHexDigits[hash[i / 2] & 0xF];
+    }
+    NSString* toReturn = [[NSString alloc] initWithBytes:hex length:TOKEN_HASH_LENGTH encoding:NSASCIIStringEncoding];
+    
+    @synchronized(s_tokenHashes)
     {
-        [toReturn appendFormat:@"%02x", hash[i]];
+        if (s_tokenHashes.count >= TOKEN_HASH_CACHE_MAX_COUNT)
+        {
+            [s_tokenHashes removeAllObjects];
+        }
+        [s_tokenHashes setObject:toReturn forKey:input];
     }
     
-    // 7 characters is sufficient to differentiate tokens in the log, otherwise the hashes start making log lines hard to read
-    return [toReturn substringToIndex:7];
+    return toReturn;
 }
 
 + (NSString*)getAdalVersion
@@ -294,8 +459,12 @@ correlationId:(NSUUID*)correlationId
          context:(NSString *)context
    correlationId:(NSUUID *)correlationId
 {
+    if (![self isLevelEnabled:ADAL_LOG_LEVEL_INFO])
+    {
+        return;
+    }
     
-    NSMutableString* logString = nil;
+    NSMutableString* logString = [NSMutableString new];
     
     if (context)
     {
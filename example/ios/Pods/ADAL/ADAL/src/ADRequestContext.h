@@ -24,9 +24,14 @@
 
 #import <Foundation/Foundation.h>
 
+@class ADCancellationToken;
+
 @protocol ADRequestContext <NSObject>
 
 - (NSUUID *)correlationId;
 - (NSString *)telemetryRequestId;
 
+@optional
+- (ADCancellationToken *)cancellationToken;
+
 @end
@@ -25,6 +25,7 @@
 #import "ADRequestContext.h"
 
 @class ADTokenCacheAccessor;
+@class ADCancellationToken;
 
 @interface ADRequestParameters : NSObject <ADRequestContext>
 {
@@ -37,6 +38,7 @@
     BOOL _extendedLifetime;
     NSUUID* _correlationId;
     NSString* _telemetryRequestId;
+    ADCancellationToken* _cancellationToken;
 }
 
 @property (retain, nonatomic) NSString* authority;
@@ -48,6 +50,7 @@
 @property BOOL extendedLifetime;
 @property (retain, nonatomic) NSUUID* correlationId;
 @property (retain, nonatomic) NSString* telemetryRequestId;
+@property (retain, nonatomic) ADCancellationToken* cancellationToken;
 
 - (id)initWithAuthority:(NSString *)authority
                resource:(NSString *)resource
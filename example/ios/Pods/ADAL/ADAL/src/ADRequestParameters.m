@@ -36,6 +36,7 @@
 @synthesize extendedLifetime = _extendedLifetime;
 @synthesize correlationId = _correlationId;
 @synthesize telemetryRequestId = _telemetryRequestId;
+@synthesize cancellationToken = _cancellationToken;
 
 - (id)initWithAuthority:(NSString *)authority
                resource:(NSString *)resource
@@ -81,6 +82,8 @@
     parameters->_correlationId = [_correlationId copyWithZone:zone];
     parameters->_extendedLifetime = _extendedLifetime;
     parameters->_telemetryRequestId = [_telemetryRequestId copyWithZone:zone];
+    // The cancellation token is deliberately not copied. Copies can outlive the request (e.g. the
+    // ones kept for background refresh), and must not inherit its deadline or be cancelled with it.
     
     return parameters;
 }
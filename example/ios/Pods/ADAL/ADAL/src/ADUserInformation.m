@@ -39,13 +39,216 @@ NSString* const ID_TOKEN_JWT_TYPE = @"JWT";
 NSString* const ID_TOKEN_OBJECT_ID = @"oid";
 NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
 
+static inline const uint8_t* SkipJSONWhitespace(const uint8_t* p, const uint8_t* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    {
+        ++p;
+    }
+    return p;
+}
+
+// Returns YES if the data is nil or only whitespace, the same as the decoded part being blank.
+static BOOL IsBlankJSON(NSData* data)
+{
+    const uint8_t* bytes = data.bytes;
+    return !data || SkipJSONWhitespace(bytes, bytes + data.length) == bytes + data.length;
+}
+
+// Moves p past the JSON string that starts at it, returning NULL if it isn't terminated.
+static const uint8_t* SkipJSONString(const uint8_t* p, const uint8_t* end, BOOL* escaped)
+{
+    *escaped = NO;
+    for (++p; p < end; ++p)
+    {
+        if (*p == '\\')
+        {
+            *escaped = YES;
+            ++p;
+        }
+        else if (*p == '"')
+        {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// Moves p past the object or array that starts at it, returning NULL if it isn't closed.
+static const uint8_t* SkipJSONContainer(const uint8_t* p, const uint8_t* end)
+{
+    int depth = 0;
+    BOOL escaped = NO;
+    while (p < end)
+    {
+        switch (*p)
+        {
+            case '"':
+                p = SkipJSONString(p, end, &escaped);
+                if (!p)
+                {
+                    return NULL;
+                }
+                continue;
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0)
+                {
+                    return p + 1;
+                }
+                break;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+// The claims the getters below read. Everything else is left for allClaims.
+static BOOL IsUsedClaim(const uint8_t* name, size_t length)
+{
+    static const char* s_usedClaims[] = { "sub", "tid", "upn", "given_name", "family_name", "unique_name",
+                                          "email", "idp", "typ", "oid", "altsecid" };
+    for (size_t i = 0; i < sizeof(s_usedClaims) / sizeof(s_usedClaims[0]); ++i)
+    {
+        if (strlen(s_usedClaims[i]) == length && memcmp(s_usedClaims[i], name, length) == 0)
+        {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Walks the top level of a JSON object and adds the string values of the used claims to claims,
+// without building the rest of it. Returns NO if the JSON is malformed, or has anything the walk
+// doesn't handle, such as an escaped claim name or a used claim that isn't a string. The caller
+// then parses it with NSJSONSerialization instead.
+static BOOL ScanClaims(const uint8_t* bytes, size_t length, NSMutableDictionary* claims)
+{
+    const uint8_t* end = bytes + length;
+    const uint8_t* p = SkipJSONWhitespace(bytes, end);
+    if (p == end || *p != '{')
+    {
+        return NO;
+    }
+    
+    p = SkipJSONWhitespace(p + 1, end);
+    if (p < end && *p == '}')
+    {
+        return SkipJSONWhitespace(p + 1, end) == end;
+    }
+    
+    while (p < end)
+    {
+        // Claim name
+        if (*p != '"')
+        {
+            return NO;
+        }
+        BOOL escaped = NO;
+        const uint8_t* name = p + 1;
+        p = SkipJSONString(p, end, &escaped);
+        if (!p || escaped)
+        {
+            return NO;
+        }
+        size_t nameLength = p - 1 - name;
+        BOOL used = IsUsedClaim(name, nameLength);
+        
+        p = SkipJSONWhitespace(p, end);
+        if (p == end || *p != ':')
+        {
+            return NO;
+        }
+        p = SkipJSONWhitespace(p + 1, end);
+        if (p == end)
+        {
+            return NO;
+        }
+        
+        // Claim value
+        const uint8_t* value = p;
+        if (*p == '"')
+        {
+            p = SkipJSONString(p, end, &escaped);
+            if (!p)
+            {
+                return NO;
+            }
+            
+            if (used)
+            {
+                NSString* string = nil;
+                if (escaped)
+                {
+                    NSData* json = [NSData dataWithBytesNoCopy:(void*)value length:p - value freeWhenDone:NO];
+                    string = [NSJSONSerialization JSONObjectWithData:json options:NSJSONReadingAllowFragments error:nil];
+                }
+                else
+                {
+                    string = [[NSString alloc] initWithBytes:value + 1 length:p - value - 2 encoding:NSUTF8StringEncoding];
+                }
+                
+                if (![string isKindOfClass:[NSString class]])
+                {
+                    return NO;
+                }
+                [claims setObject:string forKey:[[NSString alloc] initWithBytes:name length:nameLength encoding:NSUTF8StringEncoding]];
+            }
+        }
+        else if (used)
+        {
+            return NO;
+        }
+        else if (*p == '{' || *p == '[')
+        {
+            p = SkipJSONContainer(p, end);
+            if (!p)
+            {
+                return NO;
+            }
+        }
+        else
+        {
+            // Number, true, false or null
+            while (p < end && (isalnum(*p) || *p == '-' || *p == '+' || *p == '.'))
+            {
+                ++p;
+            }
+            if (p == value)
+            {
+                return NO;
+            }
+        }
+        
+        p = SkipJSONWhitespace(p, end);
+        if (p == end)
+        {
+            return NO;
+        }
+        if (*p == '}')
+        {
+            return SkipJSONWhitespace(p + 1, end) == end;
+        }
+        if (*p != ',')
+        {
+            return NO;
+        }
+        p = SkipJSONWhitespace(p + 1, end);
+    }
+    
+    return NO;
+}
+
 @implementation ADUserInformation
 
 @synthesize userId = _userId;
 @synthesize rawIdToken = _rawIdToken;
 @synthesize userIdDisplayable = _userIdDisplayable;
 @synthesize uniqueId = _uniqueId;
-@synthesize allClaims = _allClaims;
 
 - (id)init
 {
@@ -96,6 +299,97 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
                                                  correlationId:nil];
 }
 
+// Splits the id_token and base64url decodes its header and payload. The signature is never
+// needed. Parts that are blank or don't decode are skipped, as they always were. header is set
+// to the decoded header, if the id_token has one.
++ (NSArray<NSData *> *)decodedPartsOfIdToken:(NSString *)idToken
+                                encodedParts:(NSArray<NSString *> * __autoreleasing *)encodedParts
+                                      header:(NSData * __autoreleasing *)header
+{
+    NSMutableArray* decoded = [NSMutableArray arrayWithCapacity:2];
+    NSMutableArray* encoded = [NSMutableArray arrayWithCapacity:2];
+    
+    NSUInteger length = idToken.length;
+    NSUInteger start = 0;
+    for (int i = 0; i < 2 && start <= length; ++i)
+    {
+        NSRange dot = [idToken rangeOfString:@"." options:NSLiteralSearch range:NSMakeRange(start, length - start)];
+        NSUInteger end = dot.location == NSNotFound ? length : dot.location;
+        NSString* part = [idToken substringWithRange:NSMakeRange(start, end - start)];
+        start = end + 1;
+        
+        NSData* data = [NSString adBase64DecodeData:part];
+        if (!IsBlankJSON(data))
+        {
+            [decoded addObject:data];
+            [encoded addObject:part];
+            if (i == 0 && header)
+            {
+                *header = data;
+            }
+        }
+    }
+    
+    if (encodedParts)
+    {
+        *encodedParts = encoded;
+    }
+    return decoded;
+}
+
+// The type of the id_token, which only the header can declare.
++ (NSString *)typeFromHeader:(NSData *)header
+{
+    if (!header)
+    {
+        return nil;
+    }
+    
+    NSMutableDictionary* claims = [NSMutableDictionary new];
+    if (!ScanClaims(header.bytes, header.length, claims))
+    {
+        id jsonObject = [NSJSONSerialization JSONObjectWithData:header options:0 error:nil];
+        claims = [jsonObject isKindOfClass:[NSDictionary class]] ? jsonObject : nil;
+    }
+    
+    NSString* type = [claims objectForKey:ID_TOKEN_TYPE];
+    return [type isKindOfClass:[NSString class]] ? type : nil;
+}
+
+// Fully parses the decoded id_token parts into one dictionary of claims.
++ (NSDictionary *)allClaimsFromParts:(NSArray<NSData *> *)parts
+                        encodedParts:(NSArray<NSString *> *)encodedParts
+                               error:(ADAuthenticationError * __autoreleasing *)error
+{
+    NSMutableDictionary* allClaims = [NSMutableDictionary new];
+    for (NSUInteger i = 0; i < parts.count; ++i)
+    {
+        NSError* jsonError  = nil;
+        id jsonObject = [NSJSONSerialization JSONObjectWithData:parts[i]
+                                                        options:0
+                                                          error:&jsonError];
+        if (jsonError)
+        {
+            ADAuthenticationError* adError = [ADAuthenticationError errorFromNSError:jsonError
+                                                                        errorDetails:[NSString stringWithFormat:@"Failed to deserialize the id_token contents: %@", encodedParts[i]]
+                                                                       correlationId:nil];
+            if (error)
+            {
+                *error = adError;
+            }
+            return nil;
+        }
+        
+        if (![jsonObject isKindOfClass:[NSDictionary class]])
+        {
+            RETURN_ID_TOKEN_ERROR;
+        }
+        
+        [allClaims addEntriesFromDictionary:jsonObject];
+    }
+    return allClaims;
+}
+
 - (id)initWithIdToken:(NSString *)idToken
                 error:(ADAuthenticationError * __autoreleasing *)error
 {
@@ -116,58 +410,45 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
     
     _rawIdToken = idToken;
     
-    NSArray* parts = [idToken componentsSeparatedByCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"."]];
-    if (parts.count < 1)
+    NSArray* encodedParts = nil;
+    NSData* header = nil;
+    NSArray* parts = [ADUserInformation decodedPartsOfIdToken:idToken encodedParts:&encodedParts header:&header];
+    
+    // Only pick out the claims ADAL uses, allClaims parses the rest if anyone asks for it. Tokens
+    // the scanner doesn't handle are parsed in full right away.
+    NSMutableDictionary* claims = [NSMutableDictionary new];
+    BOOL scanned = YES;
+    for (NSData* part in parts)
     {
-        RETURN_ID_TOKEN_ERROR;
+        if (!ScanClaims(part.bytes, part.length, claims))
+        {
+            scanned = NO;
+            break;
+        }
     }
     
-    NSMutableDictionary* allClaims = [NSMutableDictionary new];
-    NSString* type = nil;
-    for (NSString* part in parts)
+    if (scanned)
     {
-        NSString* decoded = [part adBase64UrlDecode];
-        if (![NSString adIsStringNilOrBlank:decoded])
+        _claims = claims;
+    }
+    else
+    {
+        _allClaims = [ADUserInformation allClaimsFromParts:parts encodedParts:encodedParts error:error];
+        if (!_allClaims)
         {
-            NSError* jsonError  = nil;
-            id jsonObject = [NSJSONSerialization JSONObjectWithData:[decoded dataUsingEncoding:NSUTF8StringEncoding]
-                                                            options:0
-                                                              error:&jsonError];
-                if (jsonError)
-                {
-                    
-                    
-                    ADAuthenticationError* adError = [ADAuthenticationError errorFromNSError:jsonError
-                                                                                errorDetails:[NSString stringWithFormat:@"Failed to deserialize the id_token contents: %@", part]
-                                                                               correlationId:nil];
-                    if (error)
-                    {
-                        *error = adError;
-                    }
-                    return nil;
-                }
-            
-            if (![jsonObject isKindOfClass:[NSDictionary class]])
-            {
-                RETURN_ID_TOKEN_ERROR;
-            }
-            
-            NSDictionary* contents = (NSDictionary*)jsonObject;
-            if (!type)
-            {
-                type = [contents objectForKey:ID_TOKEN_TYPE];
-                if (type)
-                {
-                    //Type argument is passed, check if it is the expected one
-                    if (![ID_TOKEN_JWT_TYPE isEqualToString:type])
-                    {
-                        //Log it, but still try to use it as if it was a JWT token
-                        AD_LOG_WARN(@"Incompatible id_token type.", nil, type);
-                    }
-                }
-            }
-
-            [allClaims addEntriesFromDictionary:contents];
+            return nil;
+        }
+        _claims = _allClaims;
+    }
+    
+    NSString* type = [ADUserInformation typeFromHeader:header];
+    if (type)
+    {
+        //Type argument is passed, check if it is the expected one
+        if (![ID_TOKEN_JWT_TYPE isEqualToString:type])
+        {
+            //Log it, but still try to use it as if it was a JWT token
+            AD_LOG_WARN(@"Incompatible id_token type.", nil, type);
         }
     }
     if (!type)
@@ -175,8 +456,6 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
         AD_LOG_WARN(@"The id_token type is missing.", nil, @"Assuming JWT type.");
     }
     
-    _allClaims = allClaims;
-    
     //Now attempt to extract an unique user id:
     if (![NSString adIsStringNilOrBlank:self.upn])
     {
@@ -224,11 +503,30 @@ NSString* const ID_TOKEN_GUEST_ID = @"altsecid";
     return self;
 }
 
+- (NSDictionary *)allClaims
+{
+    @synchronized(self)
+    {
+        if (!_allClaims && _claims)
+        {
+            NSArray* encodedParts = nil;
+            NSArray* parts = [ADUserInformation decodedPartsOfIdToken:_rawIdToken encodedParts:&encodedParts header:nil];
+            // The claims the getters use aren't all of them, so nothing gets cached if this fails
+            _allClaims = [ADUserInformation allClaimsFromParts:parts encodedParts:encodedParts error:nil];
+            if (!_allClaims)
+            {
+                AD_LOG_WARN(@"Failed to parse all of the id_token claims.", nil, nil);
+            }
+        }
+        return _allClaims;
+    }
+}
+
 //Declares a propperty getter, which extracts the property from the claims dictionary
 #define ID_TOKEN_PROPERTY_GETTER(property, claimName) \
 -(NSString*) property \
 { \
-    return [self.allClaims objectForKey:claimName]; \
+    return [_claims objectForKey:claimName]; \
 }
 
 ID_TOKEN_PROPERTY_GETTER(givenName, ID_TOKEN_GIVEN_NAME);
@@ -273,7 +571,8 @@ ID_TOKEN_PROPERTY_GETTER(guestId, ID_TOKEN_GUEST_ID);
     // which would greatly increase the size of the user information blobs.
 #if TARGET_OS_IPHONE
     // These are needed for back-compat with ADAL 1.x
-    [aCoder encodeObject:_allClaims forKey:@"allClaims"];
+    NSDictionary* allClaims = self.allClaims;
+    [aCoder encodeObject:allClaims ? allClaims : _claims forKey:@"allClaims"];
     [aCoder encodeObject:_userId forKey:@"userId"];
     [aCoder encodeBool:_userIdDisplayable forKey:@"userIdDisplayable"];
 #endif
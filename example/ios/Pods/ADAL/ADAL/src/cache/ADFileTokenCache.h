@@ -0,0 +1,63 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+#import "ADTokenCacheDataSource.h"
+
+/*!
+    A token cache data source backed by a memory-mapped file, intended for app extensions
+    and test hosts where the keychain is slow or unavailable. Apps install it with
+    -[ADAuthenticationContext initWithAuthority:validateAuthority:cacheFilePath:error:].
+
+    The file is made of page-aligned regions: a header page, an open addressing hash index
+    and a heap of variable length records. Lookups hash the cache key and user, and only
+    unarchive the records that actually match. Writes append the new record to the heap
+    and then switch the index entry over to it.
+ */
+@interface ADFileTokenCache : NSObject <ADTokenCacheDataSource>
+
+/*!
+    Returns the cache for the file at the given path, opening (or creating) it the first
+    time. Every caller asking for the same path gets the same instance while it is in use.
+
+    @param path     Path to the cache file. The containing directory must already exist.
+
+    @return The cache, or nil if the file could not be opened or mapped.
+ */
++ (nullable ADFileTokenCache *)cacheWithPath:(nonnull NSString *)path;
+
+/*!
+    Opens (or creates) the cache file at the given path.
+
+    @param path     Path to the cache file. The containing directory must already exist.
+
+    @return An instance of ADFileTokenCache, or nil if the file could not be opened or mapped.
+ */
+- (nullable instancetype)initWithPath:(nonnull NSString *)path;
+
+/*! The path of the backing file. */
+@property (readonly, nonnull) NSString* path;
+
+- (BOOL)removeAll:(ADAuthenticationError * __nullable __autoreleasing * __nullable)error;
+
+@end
@@ -0,0 +1,1154 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+//  The cache file is laid out in page-aligned regions:
+//
+//  [ header page ][ index : slotCount entries ][ record heap : dataCapacity bytes ]
+//
+//  The index is an open addressing hash table (linear probing) keyed off of the hash
+//  of the cache key string and the user id. Each used index entry points at its record
+//  in the heap. Records take only as many bytes as they need, and are always appended
+//  at the end of the heap, so a write never touches the bytes of a record that is still
+//  in use, and only switches its index entry over once the new record is in place. Each
+//  record holds the raw cache key and user id bytes, so lookups can confirm a match
+//  before unarchiving the ADTokenCacheItem stored after them.
+//
+//  The file is shared between processes (e.g. an app and its extensions), flock(2) is
+//  used to coordinate with other processes and a pthread rwlock within this one. When
+//  the heap runs out of room it is compacted if at least half of it is taken by replaced
+//  or removed records, and otherwise grown in place. The file is only rebuilt (with all
+//  of the live records copied over) to compact it or when the index fills up, other
+//  processes remap when they see the header change.
+//
+
+#import "ADAL_Internal.h"
+#import "ADFileTokenCache.h"
+#import "ADTokenCacheKey.h"
+#import "ADTokenCacheItem+Internal.h"
+#import "ADUserInformation.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_CACHE_MAGIC                0x43464441 // "ADFC"
+#define FILE_CACHE_VERSION              2
+#define FILE_CACHE_INITIAL_SLOTS        64
+// Enough for a handful of tokens, the heap grows as more are added
+#define FILE_CACHE_INITIAL_DATA_SIZE    (32 * 1024)
+#define FILE_CACHE_RECORD_ALIGNMENT     8
+#define FILE_CACHE_MAX_LOAD_PERCENT     70
+
+enum
+{
+    ADFileCacheSlotEmpty = 0,
+    ADFileCacheSlotUsed = 1,
+    ADFileCacheSlotDeleted = 2,
+};
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pageSize;
+    uint32_t slotCount;     // Always a power of 2
+    uint32_t dataCapacity;  // Size of the record heap, always a multiple of pageSize
+    uint32_t dataUsed;      // Offset into the heap the next record is appended at
+    uint32_t liveBytes;     // Bytes of the heap taken by records that are still in the index
+    uint32_t usedCount;
+    uint32_t deletedCount;
+    uint32_t rebuilding;    // Set while the file is being rebuilt, a file found with it set is reset
+} ADFileCacheHeader;
+
+typedef struct
+{
+    uint32_t state;
+    uint32_t keyHash;
+    uint32_t userHash;
+    uint32_t recordOffset;  // Relative to the start of the heap
+    uint32_t recordLength;
+    uint32_t reserved;
+} ADFileCacheIndexEntry;
+
+typedef struct
+{
+    uint32_t keyLength;
+    uint32_t userLength;
+    uint32_t dataLength;
+    uint32_t reserved;
+} ADFileCacheRecordHeader;
+
+static uint32_t ADFileCacheHashBytes(const void* bytes, size_t length)
+{
+    // FNV-1a
+    const uint8_t* p = (const uint8_t*)bytes;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline uint32_t ADFileCacheSlotHash(uint32_t keyHash, uint32_t userHash)
+{
+    return keyHash ^ (userHash * 0x9E3779B1u);
+}
+
+static inline size_t ADFileCacheRoundUp(size_t value, size_t multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+static inline size_t ADFileCacheIndexOffset(uint32_t pageSize)
+{
+    return pageSize;
+}
+
+static inline size_t ADFileCacheDataOffset(uint32_t pageSize, uint32_t slotCount)
+{
+    return ADFileCacheIndexOffset(pageSize) + ADFileCacheRoundUp((size_t)slotCount * sizeof(ADFileCacheIndexEntry), pageSize);
+}
+
+static inline size_t ADFileCacheLength(uint32_t pageSize, uint32_t slotCount, uint32_t dataCapacity)
+{
+    return ADFileCacheDataOffset(pageSize, slotCount) + dataCapacity;
+}
+
+static inline uint32_t ADFileCacheInitialDataCapacity(uint32_t pageSize)
+{
+    return (uint32_t)ADFileCacheRoundUp(FILE_CACHE_INITIAL_DATA_SIZE, pageSize);
+}
+
+@implementation ADFileTokenCache
+{
+    NSString* _path;
+    int _fd;
+    void* _map;
+    size_t _mapLength;
+    uint32_t _slotCount;
+    uint32_t _dataCapacity;
+    pthread_rwlock_t _lock;
+    // flock(2) locks belong to the open file, not to a thread, so all of the readers in this
+    // process share one LOCK_SH: the first one in takes it and the last one out drops it.
+    pthread_mutex_t _sharedLockMutex;
+    NSUInteger _sharedLockHolders;
+    // Only changed while holding _lock for writing
+    BOOL _exclusiveLockHeld;
+    // Set while a batch of writes is in progress, the batch flushes the whole mapping once
+    // when it is done instead of after every record.
+    BOOL _deferFlush;
+}
+
+@synthesize path = _path;
+
++ (ADFileTokenCache *)cacheWithPath:(NSString *)path
+{
+    static NSMapTable* s_caches = nil;
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_caches = [NSMapTable strongToWeakObjectsMapTable];
+    });
+    
+    if ([NSString adIsStringNilOrBlank:path])
+    {
+        return nil;
+    }
+    
+    NSString* standardizedPath = [path stringByStandardizingPath];
+    @synchronized(s_caches)
+    {
+        ADFileTokenCache* cache = [s_caches objectForKey:standardizedPath];
+        if (!cache)
+        {
+            cache = [[ADFileTokenCache alloc] initWithPath:standardizedPath];
+            if (cache)
+            {
+                [s_caches setObject:cache forKey:standardizedPath];
+            }
+        }
+        return cache;
+    }
+}
+
+- (id)init
+{
+    // This cache can only be used with an explicit path.
+    [super doesNotRecognizeSelector:_cmd];
+    return nil;
+}
+
+- (id)initWithPath:(NSString *)path
+{
+    if (!(self = [super init]))
+    {
+        return nil;
+    }
+
+    _fd = -1;
+    pthread_rwlock_init(&_lock, NULL);
+    pthread_mutex_init(&_sharedLockMutex, NULL);
+
+    if ([NSString adIsStringNilOrBlank:path])
+    {
+        AD_LOG_ERROR(@"ADFileTokenCache requires a path", AD_ERROR_DEVELOPER_INVALID_ARGUMENT, nil, nil);
+        return nil;
+    }
+
+    _path = [path copy];
+
+    _fd = open([_path fileSystemRepresentation], O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (_fd < 0)
+    {
+        AD_LOG_ERROR_F(@"Failed to open token cache file", errno, nil, @"path: %@", _path);
+        return nil;
+    }
+
+#if TARGET_OS_IPHONE
+    // Match the accessibility of the keychain items ADAL writes.
+    [[NSFileManager defaultManager] setAttributes:@{ NSFileProtectionKey : NSFileProtectionCompleteUntilFirstUserAuthentication }
+                                     ofItemAtPath:_path
+                                            error:nil];
+#endif
+
+    flock(_fd, LOCK_EX);
+    BOOL mapped = [self remap];
+    flock(_fd, LOCK_UN);
+
+    if (!mapped)
+    {
+        return nil;
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_map)
+    {
+        munmap(_map, _mapLength);
+    }
+    if (_fd >= 0)
+    {
+        close(_fd);
+    }
+    pthread_rwlock_destroy(&_lock);
+    pthread_mutex_destroy(&_sharedLockMutex);
+}
+
+#pragma mark -
+#pragma mark Mapping
+
+- (ADFileCacheHeader *)header
+{
+    return (ADFileCacheHeader *)_map;
+}
+
+- (ADFileCacheIndexEntry *)entryAtIndex:(uint32_t)index
+{
+    return (ADFileCacheIndexEntry *)((uint8_t *)_map + ADFileCacheIndexOffset([self header]->pageSize)) + index;
+}
+
+- (uint8_t *)data
+{
+    return (uint8_t *)_map + ADFileCacheDataOffset([self header]->pageSize, _slotCount);
+}
+
+// Returns the record the entry points at, or NULL if the entry points outside of the heap
+- (uint8_t *)recordForEntry:(ADFileCacheIndexEntry *)entry
+{
+    if ((uint64_t)entry->recordOffset + entry->recordLength > _dataCapacity
+        || entry->recordLength < sizeof(ADFileCacheRecordHeader))
+    {
+        return NULL;
+    }
+    return [self data] + entry->recordOffset;
+}
+
+- (BOOL)isMappingCurrent
+{
+    ADFileCacheHeader* header = [self header];
+    return header && header->slotCount == _slotCount && header->dataCapacity == _dataCapacity;
+}
+
+// msync(2) wants page-aligned addresses
+- (void)flushBytes:(const void *)bytes
+            length:(size_t)length
+{
+    if (_deferFlush)
+    {
+        return;
+    }
+    
+    size_t pageSize = [self header]->pageSize;
+    size_t offset = (const uint8_t *)bytes - (const uint8_t *)_map;
+    size_t start = (offset / pageSize) * pageSize;
+    msync((uint8_t *)_map + start, ADFileCacheRoundUp(offset + length, pageSize) - start, MS_ASYNC);
+}
+
+- (void)unmap
+{
+    if (_map)
+    {
+        munmap(_map, _mapLength);
+    }
+    _map = NULL;
+    _mapLength = 0;
+    _slotCount = 0;
+    _dataCapacity = 0;
+}
+
+- (BOOL)mapLength:(size_t)length
+{
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        AD_LOG_ERROR_F(@"Failed to map token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+
+    _map = map;
+    _mapLength = length;
+    _slotCount = [self header]->slotCount;
+    _dataCapacity = [self header]->dataCapacity;
+    return YES;
+}
+
+// Must be called with the file locked exclusively (or with no other users, e.g. in init)
+- (BOOL)resetWithSlotCount:(uint32_t)slotCount
+              dataCapacity:(uint32_t)dataCapacity
+{
+    [self unmap];
+
+    uint32_t pageSize = (uint32_t)getpagesize();
+    size_t length = ADFileCacheLength(pageSize, slotCount, dataCapacity);
+
+    // Truncating to zero first guarantees every page of the new file reads back as zeroes,
+    // which is an empty index.
+    if (ftruncate(_fd, 0) != 0 || ftruncate(_fd, (off_t)length) != 0)
+    {
+        AD_LOG_ERROR_F(@"Failed to size token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        AD_LOG_ERROR_F(@"Failed to map token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+
+    ADFileCacheHeader* header = (ADFileCacheHeader *)map;
+    header->version = FILE_CACHE_VERSION;
+    header->pageSize = pageSize;
+    header->slotCount = slotCount;
+    header->dataCapacity = dataCapacity;
+    header->dataUsed = 0;
+    header->liveBytes = 0;
+    header->usedCount = 0;
+    header->deletedCount = 0;
+    header->rebuilding = 0;
+    // Write the magic last so a half written header is never mistaken for a valid one.
+    header->magic = FILE_CACHE_MAGIC;
+    msync(map, pageSize, MS_ASYNC);
+
+    _map = map;
+    _mapLength = length;
+    _slotCount = slotCount;
+    _dataCapacity = dataCapacity;
+    return YES;
+}
+
+- (BOOL)resetToInitialSize
+{
+    uint32_t pageSize = (uint32_t)getpagesize();
+    return [self resetWithSlotCount:FILE_CACHE_INITIAL_SLOTS dataCapacity:ADFileCacheInitialDataCapacity(pageSize)];
+}
+
+// Grows the heap without moving any of the records in it. Must be called with the file
+// locked exclusively.
+- (BOOL)growDataToCapacity:(uint32_t)dataCapacity
+{
+    uint32_t pageSize = [self header]->pageSize;
+    size_t length = ADFileCacheLength(pageSize, _slotCount, dataCapacity);
+    
+    // The header is only updated once the file is big enough, a file left longer than its
+    // header says (by a crash in between) is still valid.
+    if (ftruncate(_fd, (off_t)length) != 0)
+    {
+        AD_LOG_ERROR_F(@"Failed to grow token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+    
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        AD_LOG_ERROR_F(@"Failed to map token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+    
+    munmap(_map, _mapLength);
+    _map = map;
+    _mapLength = length;
+    _dataCapacity = dataCapacity;
+    
+    [self header]->dataCapacity = dataCapacity;
+    msync(_map, pageSize, MS_ASYNC);
+    return YES;
+}
+
+// Must be called with the file locked exclusively
+- (BOOL)remap
+{
+    [self unmap];
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+    {
+        AD_LOG_ERROR_F(@"Failed to stat token cache file", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+
+    uint32_t pageSize = (uint32_t)getpagesize();
+
+    if ((size_t)st.st_size < sizeof(ADFileCacheHeader))
+    {
+        return [self resetToInitialSize];
+    }
+
+    ADFileCacheHeader header;
+    if (pread(_fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        AD_LOG_ERROR_F(@"Failed to read token cache file header", errno, nil, @"path: %@", _path);
+        return NO;
+    }
+
+    if (header.magic != FILE_CACHE_MAGIC
+        || header.version != FILE_CACHE_VERSION
+        || header.pageSize != pageSize
+        || header.slotCount == 0
+        || (header.slotCount & (header.slotCount - 1)) != 0
+        || header.dataCapacity == 0
+        || header.dataCapacity % pageSize != 0
+        || header.dataUsed > header.dataCapacity
+        || header.liveBytes > header.dataUsed
+        || header.rebuilding
+        || (size_t)st.st_size < ADFileCacheLength(pageSize, header.slotCount, header.dataCapacity))
+    {
+        AD_LOG_WARN_F(@"Token cache file is not in the expected format, resetting it.", nil, @"path: %@", _path);
+        return [self resetToInitialSize];
+    }
+
+    return [self mapLength:ADFileCacheLength(pageSize, header.slotCount, header.dataCapacity)];
+}
+
+#pragma mark -
+#pragma mark Locking
+
+- (BOOL)lockExclusive:(BOOL)exclusive
+{
+    int err = exclusive ? pthread_rwlock_wrlock(&_lock) : pthread_rwlock_rdlock(&_lock);
+    if (err != 0)
+    {
+        AD_LOG_ERROR(@"pthread_rwlock lock failed in ADFileTokenCache", err, nil, nil);
+        return NO;
+    }
+
+    if (![self lockFile:exclusive])
+    {
+        AD_LOG_ERROR(@"flock failed in ADFileTokenCache", errno, nil, nil);
+        pthread_rwlock_unlock(&_lock);
+        return NO;
+    }
+
+    if ([self isMappingCurrent])
+    {
+        return YES;
+    }
+
+    // Another process rebuilt the file with a different geometry, we need to remap
+    // it, which can only be done while holding both locks exclusively.
+    if (exclusive)
+    {
+        if ([self remap])
+        {
+            return YES;
+        }
+        [self unlock];
+        return NO;
+    }
+
+    [self unlock];
+    if (![self lockExclusive:YES])
+    {
+        return NO;
+    }
+    [self unlock];
+    return [self lockExclusive:NO];
+}
+
+// Must be called holding _lock, for writing if exclusive
+- (BOOL)lockFile:(BOOL)exclusive
+{
+    if (exclusive)
+    {
+        // No other thread in this process holds the file lock while we hold _lock for writing
+        if (flock(_fd, LOCK_EX) != 0)
+        {
+            return NO;
+        }
+        _exclusiveLockHeld = YES;
+        return YES;
+    }
+
+    BOOL locked = YES;
+    pthread_mutex_lock(&_sharedLockMutex);
+    if (_sharedLockHolders == 0)
+    {
+        locked = flock(_fd, LOCK_SH) == 0;
+    }
+    if (locked)
+    {
+        _sharedLockHolders++;
+    }
+    pthread_mutex_unlock(&_sharedLockMutex);
+    return locked;
+}
+
+- (void)unlock
+{
+    if (_exclusiveLockHeld)
+    {
+        _exclusiveLockHeld = NO;
+        flock(_fd, LOCK_UN);
+    }
+    else
+    {
+        pthread_mutex_lock(&_sharedLockMutex);
+        if (--_sharedLockHolders == 0)
+        {
+            flock(_fd, LOCK_UN);
+        }
+        pthread_mutex_unlock(&_sharedLockMutex);
+    }
+    pthread_rwlock_unlock(&_lock);
+}
+
+#pragma mark -
+#pragma mark Records
+
++ (NSData *)keyBytesForKey:(ADTokenCacheKey *)key
+{
+    NSString* keyString = [NSString stringWithFormat:@"%@|%@|%@", key.authority, key.resource ? key.resource : @"", key.clientId];
+    return [keyString dataUsingEncoding:NSUTF8StringEncoding];
+}
+
++ (NSData *)userBytesForUserId:(NSString *)userId
+{
+    return [(userId ? userId : @"") dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (BOOL)record:(const uint8_t *)record
+        length:(uint32_t)length
+    matchesKey:(NSData *)keyBytes
+          user:(NSData *)userBytes
+{
+    if (!record)
+    {
+        return NO;
+    }
+
+    const ADFileCacheRecordHeader* recordHeader = (const ADFileCacheRecordHeader *)record;
+    const uint8_t* bytes = record + sizeof(ADFileCacheRecordHeader);
+    if (sizeof(ADFileCacheRecordHeader) + (uint64_t)recordHeader->keyLength + recordHeader->userLength > length)
+    {
+        return NO;
+    }
+
+    if (keyBytes)
+    {
+        if (recordHeader->keyLength != keyBytes.length || memcmp(bytes, keyBytes.bytes, keyBytes.length) != 0)
+        {
+            return NO;
+        }
+    }
+
+    if (userBytes)
+    {
+        if (recordHeader->userLength != userBytes.length || memcmp(bytes + recordHeader->keyLength, userBytes.bytes, userBytes.length) != 0)
+        {
+            return NO;
+        }
+    }
+
+    return YES;
+}
+
+- (ADTokenCacheItem *)itemFromRecord:(const uint8_t *)record
+                              length:(uint32_t)length
+{
+    if (!record)
+    {
+        AD_LOG_WARN(@"Token cache file index points outside of the record heap", nil, nil);
+        return nil;
+    }
+
+    const ADFileCacheRecordHeader* recordHeader = (const ADFileCacheRecordHeader *)record;
+    if (sizeof(ADFileCacheRecordHeader) + (uint64_t)recordHeader->keyLength + recordHeader->userLength + recordHeader->dataLength > length)
+    {
+        AD_LOG_WARN(@"Token cache file record is larger than its index entry says", nil, nil);
+        return nil;
+    }
+
+    const uint8_t* bytes = record + sizeof(ADFileCacheRecordHeader) + recordHeader->keyLength + recordHeader->userLength;
+    // The bytes are only valid while the lock is held, the unarchiver copies everything it needs.
+    NSData* data = [NSData dataWithBytesNoCopy:(void *)bytes length:recordHeader->dataLength freeWhenDone:NO];
+
+    @try
+    {
+        ADTokenCacheItem* item = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+        if (![item isKindOfClass:[ADTokenCacheItem class]])
+        {
+            AD_LOG_WARN(@"Unarchived Item was not of expected class", nil, nil);
+            return nil;
+        }
+        return item;
+    }
+    @catch (NSException *exception)
+    {
+        AD_LOG_WARN(@"Failed to deserialize data from token cache file", nil, nil);
+        return nil;
+    }
+}
+
+// Returns the slot holding the record for the key and user, or the first free slot in the
+// probe sequence if there is no such record. Returns UINT32_MAX if the table is full.
+- (uint32_t)slotForKeyBytes:(NSData *)keyBytes
+                  userBytes:(NSData *)userBytes
+                    keyHash:(uint32_t)keyHash
+                   userHash:(uint32_t)userHash
+                      found:(BOOL *)found
+{
+    uint32_t mask = _slotCount - 1;
+    uint32_t index = ADFileCacheSlotHash(keyHash, userHash) & mask;
+    uint32_t firstFree = UINT32_MAX;
+
+    *found = NO;
+    for (uint32_t probe = 0; probe < _slotCount; probe++, index = (index + 1) & mask)
+    {
+        ADFileCacheIndexEntry* entry = [self entryAtIndex:index];
+        if (entry->state == ADFileCacheSlotEmpty)
+        {
+            return firstFree != UINT32_MAX ? firstFree : index;
+        }
+
+        if (entry->state == ADFileCacheSlotDeleted)
+        {
+            if (firstFree == UINT32_MAX)
+            {
+                firstFree = index;
+            }
+            continue;
+        }
+
+        if (entry->keyHash == keyHash && entry->userHash == userHash
+            && [self record:[self recordForEntry:entry] length:entry->recordLength matchesKey:keyBytes user:userBytes])
+        {
+            *found = YES;
+            return index;
+        }
+    }
+
+    return firstFree;
+}
+
+// Appends the record to the heap and points the index entry at it. The caller has to make
+// sure the heap has room for it.
+- (void)writeRecordBytes:(const void *)bytes
+                  length:(uint32_t)length
+                 keyHash:(uint32_t)keyHash
+                userHash:(uint32_t)userHash
+                 atIndex:(uint32_t)index
+{
+    ADFileCacheIndexEntry* entry = [self entryAtIndex:index];
+    ADFileCacheHeader* header = [self header];
+    uint32_t offset = header->dataUsed;
+    uint32_t alignedLength = (uint32_t)ADFileCacheRoundUp(length, FILE_CACHE_RECORD_ALIGNMENT);
+
+    uint8_t* record = [self data] + offset;
+    memcpy(record, bytes, length);
+    header->dataUsed = offset + alignedLength;
+    [self flushBytes:record length:length];
+
+    if (entry->state == ADFileCacheSlotUsed)
+    {
+        // The record being replaced stays in the heap as garbage until the next compaction
+        header->liveBytes -= (uint32_t)ADFileCacheRoundUp(entry->recordLength, FILE_CACHE_RECORD_ALIGNMENT);
+    }
+    else
+    {
+        if (entry->state == ADFileCacheSlotDeleted)
+        {
+            header->deletedCount--;
+        }
+        header->usedCount++;
+    }
+    header->liveBytes += alignedLength;
+
+    entry->keyHash = keyHash;
+    entry->userHash = userHash;
+    entry->recordOffset = offset;
+    entry->recordLength = length;
+    entry->state = ADFileCacheSlotUsed;
+
+    [self flushBytes:entry length:sizeof(ADFileCacheIndexEntry)];
+    [self flushBytes:header length:sizeof(ADFileCacheHeader)];
+}
+
+// Rebuilds the file in place with the new geometry, carrying over all of the live records
+// as raw bytes and dropping the garbage between them. Must be called with the file locked
+// exclusively.
+- (BOOL)rebuildWithSlotCount:(uint32_t)slotCount
+                dataCapacity:(uint32_t)dataCapacity
+{
+    NSMutableArray* records = [NSMutableArray new];
+    NSMutableData* hashes = [NSMutableData new];
+    for (uint32_t i = 0; i < _slotCount; i++)
+    {
+        ADFileCacheIndexEntry* entry = [self entryAtIndex:i];
+        const uint8_t* record = entry->state == ADFileCacheSlotUsed ? [self recordForEntry:entry] : NULL;
+        if (!record)
+        {
+            continue;
+        }
+
+        [records addObject:[NSData dataWithBytes:record length:entry->recordLength]];
+        uint32_t entryHashes[2] = { entry->keyHash, entry->userHash };
+        [hashes appendBytes:entryHashes length:sizeof(entryHashes)];
+    }
+
+    AD_LOG_INFO_F(@"Rebuilding token cache file", nil, @"records: %lu slots: %u data capacity: %u", (unsigned long)records.count, slotCount, dataCapacity);
+
+    [self header]->rebuilding = 1;
+    msync(_map, [self header]->pageSize, MS_SYNC);
+
+    if (![self resetWithSlotCount:slotCount dataCapacity:dataCapacity])
+    {
+        return NO;
+    }
+
+    const uint32_t* entryHashes = hashes.bytes;
+    uint32_t mask = _slotCount - 1;
+    for (NSUInteger i = 0; i < records.count; i++)
+    {
+        NSData* record = records[i];
+        uint32_t keyHash = entryHashes[i * 2];
+        uint32_t userHash = entryHashes[i * 2 + 1];
+
+        uint32_t index = ADFileCacheSlotHash(keyHash, userHash) & mask;
+        while ([self entryAtIndex:index]->state != ADFileCacheSlotEmpty)
+        {
+            index = (index + 1) & mask;
+        }
+
+        [self writeRecordBytes:record.bytes length:(uint32_t)record.length keyHash:keyHash userHash:userHash atIndex:index];
+    }
+
+    return YES;
+}
+
+#pragma mark -
+#pragma mark ADTokenCacheDataSource
+
+- (NSArray<ADTokenCacheItem *> *)getItemsWithKey:(ADTokenCacheKey *)key
+                                          userId:(NSString *)userId
+                                   correlationId:(NSUUID *)correlationId
+                                           error:(ADAuthenticationError * __autoreleasing *)error
+{
+    NSData* keyBytes = key ? [ADFileTokenCache keyBytesForKey:key] : nil;
+    NSData* userBytes = userId ? [ADFileTokenCache userBytesForUserId:userId] : nil;
+    uint32_t keyHash = keyBytes ? ADFileCacheHashBytes(keyBytes.bytes, keyBytes.length) : 0;
+    uint32_t userHash = userBytes ? ADFileCacheHashBytes(userBytes.bytes, userBytes.length) : 0;
+
+    if (![self lockExclusive:NO])
+    {
+        AUTH_ERROR(AD_ERROR_UNEXPECTED, @"Failed to lock token cache file", correlationId);
+        return nil;
+    }
+
+    NSMutableArray<ADTokenCacheItem *> * items = [NSMutableArray new];
+
+    if (keyBytes && userBytes)
+    {
+        // Fully specified lookups go straight to their slot.
+        BOOL found = NO;
+        uint32_t index = [self slotForKeyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash found:&found];
+        ADFileCacheIndexEntry* entry = found ? [self entryAtIndex:index] : NULL;
+        ADTokenCacheItem* item = entry ? [self itemFromRecord:[self recordForEntry:entry] length:entry->recordLength] : nil;
+        if (item)
+        {
+            [items addObject:item];
+        }
+    }
+    else
+    {
+        // Otherwise walk the index, comparing hashes and then the raw key bytes, and only
+        // unarchive the records that match.
+        for (uint32_t i = 0; i < _slotCount; i++)
+        {
+            ADFileCacheIndexEntry* entry = [self entryAtIndex:i];
+            if (entry->state != ADFileCacheSlotUsed
+                || (keyBytes && entry->keyHash != keyHash)
+                || (userBytes && entry->userHash != userHash))
+            {
+                continue;
+            }
+
+            const uint8_t* record = [self recordForEntry:entry];
+            if (![self record:record length:entry->recordLength matchesKey:keyBytes user:userBytes])
+            {
+                continue;
+            }
+
+            ADTokenCacheItem* item = [self itemFromRecord:record length:entry->recordLength];
+            if (item)
+            {
+                [items addObject:item];
+            }
+        }
+    }
+
+    [self unlock];
+
+    return items;
+}
+
+- (ADTokenCacheItem *)getItemWithKey:(ADTokenCacheKey *)key
+                              userId:(NSString *)userId
+                       correlationId:(NSUUID *)correlationId
+                               error:(ADAuthenticationError * __autoreleasing *)error
+{
+    NSArray<ADTokenCacheItem *> * items = [self getItemsWithKey:key userId:userId correlationId:correlationId error:error];
+    NSArray<ADTokenCacheItem *> * itemsExcludingTombstones = [self filterOutTombstones:items];
+
+    if (!itemsExcludingTombstones || itemsExcludingTombstones.count == 0)
+    {
+        for (ADTokenCacheItem* item in items)
+        {
+            [item logMessage:@"Found"
+                       level:ADAL_LOG_LEVEL_WARN
+               correlationId:correlationId];
+        }
+        return nil;
+    }
+
+    if (itemsExcludingTombstones.count == 1)
+    {
+        return itemsExcludingTombstones.firstObject;
+    }
+
+    ADAuthenticationError* adError =
+    [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_MULTIPLE_USERS
+                                           protocolCode:nil
+                                           errorDetails:@"The token cache store for this resource contains more than one user. Please set the 'userId' parameter to the one that will be used."
+                                          correlationId:correlationId];
+    if (error)
+    {
+        *error = adError;
+    }
+
+    return nil;
+}
+
+- (BOOL)addOrUpdateItem:(ADTokenCacheItem *)item
+          correlationId:(NSUUID *)correlationId
+                  error:(ADAuthenticationError * __autoreleasing *)error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(item);
+
+    return [self addOrUpdateItems:@[ item ] correlationId:correlationId error:error];
+}
+
+- (BOOL)addOrUpdateItems:(NSArray<ADTokenCacheItem *> *)items
+           correlationId:(NSUUID *)correlationId
+                   error:(ADAuthenticationError * __autoreleasing *)error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(items);
+
+    // Archive everything up front so that the file is only locked for the copies.
+    NSMutableArray* records = [[NSMutableArray alloc] initWithCapacity:items.count];
+    for (ADTokenCacheItem* item in items)
+    {
+        ADTokenCacheKey* key = [item extractKey:error];
+        if (!key)
+        {
+            return NO;
+        }
+
+        NSData* itemData = [NSKeyedArchiver archivedDataWithRootObject:item];
+        if (!itemData)
+        {
+            AUTH_ERROR(AD_ERROR_CACHE_BAD_FORMAT, @"Failed to archive token cache item", correlationId);
+            return NO;
+        }
+
+        NSData* keyBytes = [ADFileTokenCache keyBytesForKey:key];
+        NSData* userBytes = [ADFileTokenCache userBytesForUserId:item.userInformation.userId];
+        [records addObject:@[ keyBytes, userBytes, [ADFileTokenCache recordWithKeyBytes:keyBytes userBytes:userBytes itemData:itemData] ]];
+    }
+
+    if (![self lockExclusive:YES])
+    {
+        AUTH_ERROR(AD_ERROR_UNEXPECTED, @"Failed to lock token cache file", correlationId);
+        return NO;
+    }
+
+    // Records are written in the order given, so a crash part way through never leaves a
+    // later record without the ones it depends on.
+    BOOL result = YES;
+    _deferFlush = YES;
+    for (NSArray* record in records)
+    {
+        NSData* keyBytes = record[0];
+        NSData* userBytes = record[1];
+        uint32_t keyHash = ADFileCacheHashBytes(keyBytes.bytes, keyBytes.length);
+        uint32_t userHash = ADFileCacheHashBytes(userBytes.bytes, userBytes.length);
+        if (![self writeRecord:record[2] keyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash])
+        {
+            result = NO;
+            break;
+        }
+    }
+    _deferFlush = NO;
+    msync(_map, _mapLength, MS_ASYNC);
+    [self unlock];
+
+    if (!result)
+    {
+        AUTH_ERROR(AD_ERROR_UNEXPECTED, @"Failed to write to token cache file", correlationId);
+    }
+
+    return result;
+}
+
++ (NSData *)recordWithKeyBytes:(NSData *)keyBytes
+                     userBytes:(NSData *)userBytes
+                      itemData:(NSData *)itemData
+{
+    ADFileCacheRecordHeader recordHeader = { (uint32_t)keyBytes.length, (uint32_t)userBytes.length, (uint32_t)itemData.length, 0 };
+    NSMutableData* record = [NSMutableData dataWithCapacity:sizeof(recordHeader) + keyBytes.length + userBytes.length + itemData.length];
+    [record appendBytes:&recordHeader length:sizeof(recordHeader)];
+    [record appendData:keyBytes];
+    [record appendData:userBytes];
+    [record appendData:itemData];
+    return record;
+}
+
+// Must be called with the file locked exclusively
+- (BOOL)writeRecord:(NSData *)record
+           keyBytes:(NSData *)keyBytes
+          userBytes:(NSData *)userBytes
+            keyHash:(uint32_t)keyHash
+           userHash:(uint32_t)userHash
+{
+    if (record.length > UINT32_MAX / 4)
+    {
+        AD_LOG_ERROR(@"Token cache item is too large for the token cache file", AD_ERROR_UNEXPECTED, nil, nil);
+        return NO;
+    }
+
+    BOOL found = NO;
+    uint32_t index = [self slotForKeyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash found:&found];
+
+    if (!found)
+    {
+        // Grow the table before it gets too full for linear probing to stay fast, or just
+        // compact away the deleted entries if that is what is filling it up.
+        ADFileCacheHeader* header = [self header];
+        if ((uint64_t)(header->usedCount + header->deletedCount + 1) * 100 > (uint64_t)_slotCount * FILE_CACHE_MAX_LOAD_PERCENT)
+        {
+            BOOL grow = (uint64_t)(header->usedCount + 1) * 100 > (uint64_t)_slotCount * FILE_CACHE_MAX_LOAD_PERCENT / 2;
+            if (![self rebuildWithSlotCount:grow ? _slotCount * 2 : _slotCount dataCapacity:_dataCapacity])
+            {
+                return NO;
+            }
+            index = [self slotForKeyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash found:&found];
+        }
+    }
+
+    if (index == UINT32_MAX)
+    {
+        return NO;
+    }
+
+    ADFileCacheHeader* header = [self header];
+    uint64_t needed = ADFileCacheRoundUp(record.length, FILE_CACHE_RECORD_ALIGNMENT);
+    if (header->dataUsed + needed > _dataCapacity)
+    {
+        uint32_t pageSize = header->pageSize;
+        uint64_t garbage = header->dataUsed - header->liveBytes;
+        BOOL compact = garbage >= header->dataUsed / 2;
+
+        // Compacting leaves room for at least as much again as what is live, so the next
+        // few writes don't immediately compact again.
+        uint64_t minimum = compact ? 2 * (header->liveBytes + needed) : header->dataUsed + needed;
+        uint64_t dataCapacity = _dataCapacity;
+        while (dataCapacity < minimum)
+        {
+            dataCapacity *= 2;
+        }
+        dataCapacity = ADFileCacheRoundUp(dataCapacity, pageSize);
+        if (dataCapacity > UINT32_MAX)
+        {
+            AD_LOG_ERROR(@"Token cache file is too large", AD_ERROR_UNEXPECTED, nil, nil);
+            return NO;
+        }
+
+        BOOL result = compact
+            ? [self rebuildWithSlotCount:_slotCount dataCapacity:(uint32_t)dataCapacity]
+            : [self growDataToCapacity:(uint32_t)dataCapacity];
+        if (!result)
+        {
+            return NO;
+        }
+
+        // A rebuild moves everything around
+        index = [self slotForKeyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash found:&found];
+        if (index == UINT32_MAX)
+        {
+            return NO;
+        }
+    }
+
+    [self writeRecordBytes:record.bytes length:(uint32_t)record.length keyHash:keyHash userHash:userHash atIndex:index];
+    return YES;
+}
+
+- (BOOL)removeItem:(ADTokenCacheItem *)item
+             error:(ADAuthenticationError * __autoreleasing *)error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(item);
+
+    ADTokenCacheKey* key = [item extractKey:error];
+    if (!key)
+    {
+        return NO;
+    }
+
+    NSData* keyBytes = [ADFileTokenCache keyBytesForKey:key];
+    NSData* userBytes = [ADFileTokenCache userBytesForUserId:item.userInformation.userId];
+    uint32_t keyHash = ADFileCacheHashBytes(keyBytes.bytes, keyBytes.length);
+    uint32_t userHash = ADFileCacheHashBytes(userBytes.bytes, userBytes.length);
+
+    if (![self lockExclusive:YES])
+    {
+        return NO;
+    }
+
+    BOOL found = NO;
+    uint32_t index = [self slotForKeyBytes:keyBytes userBytes:userBytes keyHash:keyHash userHash:userHash found:&found];
+    if (found)
+    {
+        ADFileCacheHeader* header = [self header];
+        ADFileCacheIndexEntry* entry = [self entryAtIndex:index];
+        entry->state = ADFileCacheSlotDeleted;
+        header->usedCount--;
+        header->deletedCount++;
+        header->liveBytes -= (uint32_t)ADFileCacheRoundUp(entry->recordLength, FILE_CACHE_RECORD_ALIGNMENT);
+
+        [self flushBytes:entry length:sizeof(ADFileCacheIndexEntry)];
+        [self flushBytes:header length:sizeof(ADFileCacheHeader)];
+    }
+
+    [self unlock];
+    return YES;
+}
+
+- (BOOL)removeAll:(ADAuthenticationError * __autoreleasing *)error
+{
+    if (![self lockExclusive:YES])
+    {
+        AUTH_ERROR(AD_ERROR_UNEXPECTED, @"Failed to lock token cache file", nil);
+        return NO;
+    }
+
+    BOOL result = [self resetToInitialSize];
+    [self unlock];
+
+    if (!result)
+    {
+        AUTH_ERROR(AD_ERROR_UNEXPECTED, @"Failed to reset token cache file", nil);
+    }
+    return result;
+}
+
+- (NSArray<ADTokenCacheItem *> *)allItems:(ADAuthenticationError * __autoreleasing *)error
+{
+    NSArray<ADTokenCacheItem *> * items = [self getItemsWithKey:nil userId:nil correlationId:nil error:error];
+    return [self filterOutTombstones:items];
+}
+
+- (NSArray<ADTokenCacheItem *> *)allTombstones:(ADAuthenticationError * __autoreleasing *)error
+{
+    NSArray* items = [self getItemsWithKey:nil userId:nil correlationId:nil error:error];
+    NSMutableArray* tombstones = [NSMutableArray new];
+    for (ADTokenCacheItem* item in items)
+    {
+        if ([item tombstone])
+        {
+            [tombstones addObject:item];
+        }
+    }
+    return tombstones;
+}
+
+- (NSMutableArray *)filterOutTombstones:(NSArray *)items
+{
+    if (!items)
+    {
+        return nil;
+    }
+
+    NSMutableArray* itemsKept = [NSMutableArray new];
+    for (ADTokenCacheItem* item in items)
+    {
+        if (![item tombstone])
+        {
+            [itemsKept addObject:item];
+        }
+    }
+    return itemsKept;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"ADFileTokenCache: %@", _path];
+}
+
+@end
@@ -31,5 +31,16 @@
 
 - (nullable id<ADTokenCacheDelegate>)delegate;
 
+/*! The number of items evicted from the cache to stay under maxItemCount or
+    maxSerializedSize. */
+- (NSUInteger)evictionCount;
+
+/*! The number of items currently in the cache, including tombstones. */
+- (NSUInteger)itemCount;
+
+/*! The estimated serialized size of the cache as of the last time the size limit was
+    enforced, 0 if maxSerializedSize is not set. */
+- (NSUInteger)estimatedSize;
+
 @end
 
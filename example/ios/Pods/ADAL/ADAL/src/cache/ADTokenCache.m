@@ -61,6 +61,17 @@
 }
 
 @implementation ADTokenCache
+{
+    NSUInteger _maxItemCount;
+    NSUInteger _maxSerializedSize;
+    NSMutableDictionary* _accessTimes;
+    NSMutableDictionary* _itemSizes;
+    NSUInteger _evictionCount;
+    NSUInteger _estimatedSize;
+}
+
+@synthesize maxItemCount = _maxItemCount;
+@synthesize maxSerializedSize = _maxSerializedSize;
 
 + (ADTokenCache *)defaultCache
 {
@@ -82,6 +93,8 @@
     }
     
     pthread_rwlock_init(&_lock, NULL);
+    _accessTimes = [NSMutableDictionary new];
+    _itemSizes = [NSMutableDictionary new];
     
     return self;
 }
@@ -107,6 +120,7 @@
     
     _delegate = delegate;
     _cache = nil;
+    [self resetTracking];
     
     pthread_rwlock_unlock(&_lock);
     
@@ -193,6 +207,7 @@
     if (!data)
     {
         _cache = nil;
+        [self resetTracking];
         return YES;
     }
     
@@ -207,7 +222,10 @@
         return NO;
     }
     
+    // The limits are only enforced on the write path, so that what the delegate persists is
+    // always the trimmed cache.
     _cache = [cache objectForKey:@"tokenCache"];
+    [self pruneTracking];
     return YES;
 }
 
@@ -239,6 +257,7 @@
     }
     
     _cache = [dict objectForKey:@"tokenCache"];
+    [self pruneTracking];
     
     return YES;
 }
@@ -272,7 +291,13 @@
     // Add items matching the key for this user
     if (key)
     {
+        NSUInteger count = items.count;
         [self addToItems:items fromDictionary:userTokens key:key];
+        if (items.count > count)
+        {
+            // Only lookups of a specific key count as a use, enumerating the cache doesn't
+            [self recordAccessForUserId:userId key:key];
+        }
     }
     else
     {
@@ -316,6 +341,217 @@
     return items;
 }
 
+#pragma mark -
+#pragma mark Eviction
+
+- (BOOL)hasLimits
+{
+    return _maxItemCount > 0 || _maxSerializedSize > 0;
+}
+
+- (void)resetTracking
+{
+    @synchronized(_accessTimes)
+    {
+        [_accessTimes removeAllObjects];
+    }
+    [_itemSizes removeAllObjects];
+    _estimatedSize = 0;
+}
+
+// Drops the tracking of the items that are gone after the cache got reloaded. The delegate can
+// deserialize the cache before every access, so the access times of the items that are still
+// there are kept, or the LRU order would never survive long enough to matter. The sizes are
+// recomputed as the items themselves could have changed.
+// Must be called with the write lock held
+- (void)pruneTracking
+{
+    NSDictionary* tokens = [_cache objectForKey:@"tokens"];
+    @synchronized(_accessTimes)
+    {
+        NSMutableArray* keysToRemove = [NSMutableArray new];
+        for (NSArray* trackingKey in _accessTimes)
+        {
+            if (![[tokens objectForKey:trackingKey.firstObject] objectForKey:trackingKey.lastObject])
+            {
+                [keysToRemove addObject:trackingKey];
+            }
+        }
+        [_accessTimes removeObjectsForKeys:keysToRemove];
+    }
+    [_itemSizes removeAllObjects];
+}
+
+// Called with either lock held, so access times get their own lock as readers can
+// update them concurrently.
+- (void)recordAccessForUserId:(NSString *)userId
+                          key:(ADTokenCacheKey *)key
+{
+    if (![self hasLimits])
+    {
+        return;
+    }
+    
+    @synchronized(_accessTimes)
+    {
+        [_accessTimes setObject:@([NSDate timeIntervalSinceReferenceDate]) forKey:@[userId, key]];
+    }
+}
+
+// Must be called with the write lock held
+- (void)forgetUserId:(NSString *)userId
+                 key:(ADTokenCacheKey *)key
+{
+    NSArray* trackingKey = @[userId, key];
+    @synchronized(_accessTimes)
+    {
+        [_accessTimes removeObjectForKey:trackingKey];
+    }
+    [_itemSizes removeObjectForKey:trackingKey];
+}
+
+// Must be called with the write lock held
+- (NSUInteger)sizeOfItem:(ADTokenCacheItem *)item
+             trackingKey:(NSArray *)trackingKey
+{
+    NSNumber* size = [_itemSizes objectForKey:trackingKey];
+    if (!size)
+    {
+        @try
+        {
+            size = @([[NSKeyedArchiver archivedDataWithRootObject:item] length]);
+        }
+        @catch (id exception)
+        {
+            size = @0;
+        }
+        [_itemSizes setObject:size forKey:trackingKey];
+    }
+    
+    return [size unsignedIntegerValue];
+}
+
+/*! Evicts items until the cache is under maxItemCount and maxSerializedSize. Expired
+    tombstones go first, then expired access tokens, then the least recently used access
+    tokens. Items holding a usable refresh token (and tombstones that haven't expired yet)
+    are never evicted, if they alone put the cache over its limits it is left that way.
+    Must be called with the write lock held. */
+- (void)enforceLimitsImpl:(NSUUID *)correlationId
+{
+    if (![self hasLimits])
+    {
+        return;
+    }
+    
+    NSMutableDictionary* tokens = [_cache objectForKey:@"tokens"];
+    if (!tokens)
+    {
+        _estimatedSize = 0;
+        return;
+    }
+    
+    NSUInteger maxItemCount = _maxItemCount;
+    NSUInteger maxSize = _maxSerializedSize;
+    __block NSUInteger itemCount = 0;
+    __block NSUInteger size = 0;
+    NSMutableArray* candidates = [NSMutableArray new];
+    
+    NSDictionary* accessTimes = nil;
+    @synchronized(_accessTimes)
+    {
+        accessTimes = [_accessTimes copy];
+    }
+    
+    for (NSString* userId in tokens)
+    {
+        NSDictionary* userTokens = [tokens objectForKey:userId];
+        for (ADTokenCacheKey* key in userTokens)
+        {
+            ADTokenCacheItem* item = [userTokens objectForKey:key];
+            NSArray* trackingKey = @[userId, key];
+            NSUInteger itemSize = maxSize ? [self sizeOfItem:item trackingKey:trackingKey] : 0;
+            
+            ++itemCount;
+            size += itemSize;
+            
+            // Lower ranks are evicted first
+            NSUInteger rank = 0;
+            if (item.tombstone)
+            {
+                // Tombstones only have to outlive the refresh token they replaced
+                if (item.expiresOn && [item.expiresOn timeIntervalSinceNow] > 0)
+                {
+                    continue;
+                }
+            }
+            else if (item.refreshToken)
+            {
+                continue;
+            }
+            else
+            {
+                rank = [item isExpired] ? 1 : 2;
+            }
+            
+            NSNumber* lastAccess = [accessTimes objectForKey:trackingKey];
+            [candidates addObject:@{ @"user" : userId,
+                                     @"key" : key,
+                                     @"rank" : @(rank),
+                                     @"lastAccess" : lastAccess ? lastAccess : @0,
+                                     @"size" : @(itemSize) }];
+        }
+    }
+    
+    BOOL (^overLimit)(void) = ^BOOL {
+        return (maxItemCount && itemCount > maxItemCount) || (maxSize && size > maxSize);
+    };
+    
+    if (overLimit())
+    {
+        [candidates sortUsingComparator:^NSComparisonResult(NSDictionary* obj1, NSDictionary* obj2)
+        {
+            NSComparisonResult result = [[obj1 objectForKey:@"rank"] compare:[obj2 objectForKey:@"rank"]];
+            if (result != NSOrderedSame)
+            {
+                return result;
+            }
+            return [[obj1 objectForKey:@"lastAccess"] compare:[obj2 objectForKey:@"lastAccess"]];
+        }];
+        
+        NSUInteger evicted = 0;
+        for (NSDictionary* candidate in candidates)
+        {
+            if (!overLimit())
+            {
+                break;
+            }
+            
+            NSString* userId = [candidate objectForKey:@"user"];
+            ADTokenCacheKey* key = [candidate objectForKey:@"key"];
+            NSMutableDictionary* userTokens = [tokens objectForKey:userId];
+            [userTokens removeObjectForKey:key];
+            if (!userTokens.count)
+            {
+                [tokens removeObjectForKey:userId];
+            }
+            [self forgetUserId:userId key:key];
+            
+            --itemCount;
+            size -= [[candidate objectForKey:@"size"] unsignedIntegerValue];
+            ++evicted;
+        }
+        
+        _evictionCount += evicted;
+        AD_LOG_INFO_F(@"Evicted items from the token cache", correlationId, @"evicted: %lu, items: %lu", (unsigned long)evicted, (unsigned long)itemCount);
+        
+        if (overLimit())
+        {
+            AD_LOG_WARN_F(@"Token cache is over its limits and only holds refresh tokens", correlationId, @"items: %lu size: %lu", (unsigned long)itemCount, (unsigned long)size);
+        }
+    }
+    
+    _estimatedSize = maxSize ? size : 0;
+}
 
 /*! Clears token cache details for specific keys.
  @param key: the key of the cache item. Key can be extracted from the ADTokenCacheItem using
@@ -373,6 +609,7 @@
     }
     
     [userTokens removeObjectForKey:key];
+    [self forgetUserId:userId key:key];
     
     // Check to see if we need to remove the overall dict
     if (!userTokens.count)
@@ -420,6 +657,53 @@
     return _delegate;
 }
 
+- (NSUInteger)evictionCount
+{
+    int err = pthread_rwlock_rdlock(&_lock);
+    if (err != 0)
+    {
+        AD_LOG_ERROR(@"pthread_rwlock_rdlock failed in evictionCount", err, nil, nil);
+        return 0;
+    }
+    NSUInteger evictionCount = _evictionCount;
+    pthread_rwlock_unlock(&_lock);
+    
+    return evictionCount;
+}
+
+- (NSUInteger)itemCount
+{
+    int err = pthread_rwlock_rdlock(&_lock);
+    if (err != 0)
+    {
+        AD_LOG_ERROR(@"pthread_rwlock_rdlock failed in itemCount", err, nil, nil);
+        return 0;
+    }
+    NSUInteger count = 0;
+    NSDictionary* tokens = [_cache objectForKey:@"tokens"];
+    for (NSString* userId in tokens)
+    {
+        count += [[tokens objectForKey:userId] count];
+    }
+    pthread_rwlock_unlock(&_lock);
+    
+    return count;
+}
+
+- (NSUInteger)estimatedSize
+{
+    int err = pthread_rwlock_rdlock(&_lock);
+    if (err != 0)
+    {
+        AD_LOG_ERROR(@"pthread_rwlock_rdlock failed in estimatedSize", err, nil, nil);
+        return 0;
+    }
+    NSUInteger estimatedSize = _estimatedSize;
+    pthread_rwlock_unlock(&_lock);
+    
+    return estimatedSize;
+}
+
 - (BOOL)validateCache:(NSDictionary*)dict
                 error:(ADAuthenticationError * __autoreleasing *)error
 {
@@ -523,12 +807,46 @@
         return NO;
     }
     BOOL result = [self addOrUpdateImpl:item correlationId:correlationId error:error];
+    if (result)
+    {
+        [self enforceLimitsImpl:correlationId];
+    }
     pthread_rwlock_unlock(&_lock);
     [_delegate didWriteCache:self];
     
     return result;
 }
 
+- (BOOL)addOrUpdateItems:(NSArray<ADTokenCacheItem *> *)items
+           correlationId:(NSUUID *)correlationId
+                   error:(ADAuthenticationError * __autoreleasing *)error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(items);
+
+    [_delegate willWriteCache:self];
+    int err = pthread_rwlock_wrlock(&_lock);
+    if (err != 0)
+    {
+        AD_LOG_ERROR(@"pthread_rwlock_wrlock failed in addOrUpdateItems", err, correlationId, nil);
+        return NO;
+    }
+    BOOL result = YES;
+    for (ADTokenCacheItem* item in items)
+    {
+        if (![self addOrUpdateImpl:item correlationId:correlationId error:error])
+        {
+            result = NO;
+            break;
+        }
+    }
+    [self enforceLimitsImpl:correlationId];
+    pthread_rwlock_unlock(&_lock);
+    // The delegate serializes the whole cache, so the batch only gets persisted once.
+    [_delegate didWriteCache:self];
+
+    return result;
+}
+
 - (BOOL)addOrUpdateImpl:(ADTokenCacheItem *)item
           correlationId:(NSUUID *)correlationId
                   error:(ADAuthenticationError * __autoreleasing *)error
@@ -583,6 +901,8 @@
     }
     
     [userDict setObject:item forKey:key];
+    [self forgetUserId:userId key:key];
+    [self recordAccessForUserId:userId key:key];
     return YES;
 }
 
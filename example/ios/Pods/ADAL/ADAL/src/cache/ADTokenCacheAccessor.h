@@ -47,6 +47,17 @@
                                  context:(id<ADRequestContext>)context
                                    error:(ADAuthenticationError * __autoreleasing *)error;
 
+/*!
+    Looks up the access tokens for several resources with a single read of the cache. Returns a
+    dictionary of resource to cache item, containing only the resources that have exactly one
+    matching item with an access token in it.
+ */
+- (NSDictionary<NSString *, ADTokenCacheItem *> *)getATItemsForUser:(ADUserIdentifier *)identifier
+                                                           resources:(NSArray<NSString *> *)resources
+                                                            clientId:(NSString *)clientId
+                                                             context:(id<ADRequestContext>)context
+                                                               error:(ADAuthenticationError * __autoreleasing *)error;
+
 /*!
     Returns a Multi-Resource Refresh Token (MRRT) Cache Item for the given parameters. A MRRT can
     potentially be used for many resources for that given user, client ID and authority.
@@ -31,6 +31,33 @@
 #import "ADTelemetry+Internal.h"
 #import "ADTelemetryCacheEvent.h"
 #import "ADTelemetryEventStrings.h"
+#if TARGET_OS_IPHONE
+#import "ADKeychainTokenCache+Internal.h"
+#endif
+
+// How long (in seconds) we remember that a refresh token lookup came up empty, or that a refresh
+// token was rejected, before asking the data source again.
+#define NEGATIVE_CACHE_TTL 30
+#define NEGATIVE_CACHE_MAX_ENTRIES 128
+
+// What we remember as missing for a single data source, keyed off of the authority, client ID,
+// resource and user. The values are the times the entries expire.
+@interface ADTokenCacheNegativeEntries : NSObject
+{
+@public
+    NSMutableDictionary* _entries;
+    // The data source's change generation the entries were recorded against
+    uint64_t _generation;
+}
+@end
+
+@implementation ADTokenCacheNegativeEntries
+@end
+
+// Shared by all of the accessors. Data sources are held weakly and compared by identity, so the
+// entries go away with their data source and are never picked up by a new object that happens
+// to get the same address.
+static NSMapTable* s_negativeCache = nil;
 
 @implementation ADTokenCacheAccessor
 
@@ -63,6 +90,166 @@
     return _dataSource;
 }
 
+#pragma mark -
+#pragma mark Negative Cache
+
++ (NSMapTable *)negativeCache
+{
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_negativeCache = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                                valueOptions:NSPointerFunctionsStrongMemory];
+    });
+    
+    return s_negativeCache;
+}
+
+// Bumped whenever the data source is written to, including by other apps sharing it.
+- (uint64_t)dataSourceGeneration
+{
+#if TARGET_OS_IPHONE
+    if ([(NSObject *)_dataSource isKindOfClass:[ADKeychainTokenCache class]])
+    {
+        return [(ADKeychainTokenCache *)_dataSource changeGeneration];
+    }
+#endif
+    return 0;
+}
+
+// Only data sources that tell us when they change under us can be negatively cached. The others
+// (ADTokenCache, ADFileTokenCache) get reloaded from their delegate or file behind our back, so
+// a remembered miss could hide a token that is there now.
+- (BOOL)dataSourceTracksChanges
+{
+#if TARGET_OS_IPHONE
+    return [(NSObject *)_dataSource isKindOfClass:[ADKeychainTokenCache class]];
+#else
+    return NO;
+#endif
+}
+
+// Must be called while synchronized on the negative cache
+- (NSMutableDictionary *)negativeEntries
+{
+    NSMapTable* negativeCache = [ADTokenCacheAccessor negativeCache];
+    ADTokenCacheNegativeEntries* entries = [negativeCache objectForKey:_dataSource];
+    uint64_t generation = [self dataSourceGeneration];
+    if (!entries)
+    {
+        entries = [ADTokenCacheNegativeEntries new];
+        entries->_entries = [NSMutableDictionary new];
+        entries->_generation = generation;
+        [negativeCache setObject:entries forKey:_dataSource];
+    }
+    else if (entries->_generation != generation)
+    {
+        // Something (possibly another app in the keychain group) wrote to the cache since the
+        // entries were recorded, what was missing might be there now.
+        [entries->_entries removeAllObjects];
+        entries->_generation = generation;
+    }
+    
+    return entries->_entries;
+}
+
+- (id)negativeCacheKeyForUser:(NSString *)userId
+                     clientId:(NSString *)clientId
+                     resource:(NSString *)resource
+{
+    NSNull* null = [NSNull null];
+    return @[ _authority ? _authority : null,
+              clientId ? clientId : null,
+              resource ? resource : null,
+              userId ? userId : null ];
+}
+
+- (BOOL)isKnownMissing:(id)key
+{
+    if (![self dataSourceTracksChanges])
+    {
+        return NO;
+    }
+    
+    NSMapTable* negativeCache = [ADTokenCacheAccessor negativeCache];
+    @synchronized(negativeCache)
+    {
+        NSMutableDictionary* entries = [self negativeEntries];
+        NSDate* expiresOn = [entries objectForKey:key];
+        if (!expiresOn)
+        {
+            return NO;
+        }
+        
+        if ([expiresOn timeIntervalSinceNow] <= 0)
+        {
+            [entries removeObjectForKey:key];
+            return NO;
+        }
+        
+        return YES;
+    }
+}
+
+- (void)recordMissing:(id)key
+{
+    if (![self dataSourceTracksChanges])
+    {
+        return;
+    }
+    
+    NSMapTable* negativeCache = [ADTokenCacheAccessor negativeCache];
+    @synchronized(negativeCache)
+    {
+        NSMutableDictionary* entries = [self negativeEntries];
+        if (entries.count >= NEGATIVE_CACHE_MAX_ENTRIES)
+        {
+            [entries removeAllObjects];
+        }
+        
+        [entries setObject:[NSDate dateWithTimeIntervalSinceNow:NEGATIVE_CACHE_TTL] forKey:key];
+    }
+}
+
+// Drops everything we remember about the user, including the lookups that weren't for any user
+// in particular.
+- (void)invalidateNegativeCacheForUser:(NSString *)userId
+{
+    if (![self dataSourceTracksChanges])
+    {
+        return;
+    }
+    
+    NSMapTable* negativeCache = [ADTokenCacheAccessor negativeCache];
+    @synchronized(negativeCache)
+    {
+        NSMutableDictionary* entries = [self negativeEntries];
+        NSMutableArray* keysToRemove = [NSMutableArray new];
+        for (NSArray* key in entries)
+        {
+            id keyUser = [key lastObject];
+            if (keyUser == [NSNull null] || [keyUser isEqual:userId])
+            {
+                [keysToRemove addObject:key];
+            }
+        }
+        [entries removeObjectsForKeys:keysToRemove];
+    }
+}
+
+- (void)addMemoryCacheCountersToEvent:(ADTelemetryCacheEvent *)event
+{
+#if TARGET_OS_IPHONE
+    if ([(NSObject *)_dataSource isKindOfClass:[ADKeychainTokenCache class]])
+    {
+        ADKeychainTokenCache* keychainCache = (ADKeychainTokenCache *)_dataSource;
+        [event setMemoryCacheHitCount:[keychainCache memoryCacheHits]
+                            missCount:[keychainCache memoryCacheMisses]];
+    }
+#else
+    (void)event;
+#endif
+}
+
 - (ADTokenCacheItem *)getItemForUser:(ADUserIdentifier *)identifier
                             resource:(NSString *)resource
                             clientId:(NSString *)clientId
@@ -102,10 +289,57 @@
                                                                        context:context];
     [event setTokenType:AD_TELEMETRY_VALUE_ACCESS_TOKEN];
     [event setStatus:item? AD_TELEMETRY_VALUE_SUCCEEDED : AD_TELEMETRY_VALUE_FAILED];
+    [self addMemoryCacheCountersToEvent:event];
     [[ADTelemetry sharedInstance] stopEvent:[context telemetryRequestId] event:event];
     return item;
 }
 
+- (NSDictionary<NSString *, ADTokenCacheItem *> *)getATItemsForUser:(ADUserIdentifier *)identifier
+                                                           resources:(NSArray<NSString *> *)resources
+                                                            clientId:(NSString *)clientId
+                                                             context:(id<ADRequestContext>)context
+                                                               error:(ADAuthenticationError * __autoreleasing *)error
+{
+    [[ADTelemetry sharedInstance] startEvent:[context telemetryRequestId] eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP];
+    
+    NSArray* items = [_dataSource getItemsWithKey:nil
+                                           userId:identifier.userId
+                                    correlationId:[context correlationId]
+                                            error:error];
+    
+    NSSet* wanted = [NSSet setWithArray:resources];
+    NSMutableDictionary* found = [NSMutableDictionary new];
+    NSMutableSet* ambiguous = [NSMutableSet new];
+    for (ADTokenCacheItem* item in items)
+    {
+        if (item.tombstone || !item.accessToken || !item.resource
+            || ![wanted containsObject:item.resource]
+            || ![item.clientId isEqualToString:clientId]
+            || ![item.authority isEqualToString:_authority])
+        {
+            continue;
+        }
+        
+        // Tokens for more than one user, let the regular lookup sort that out.
+        if ([found objectForKey:item.resource])
+        {
+            [ambiguous addObject:item.resource];
+            continue;
+        }
+        
+        [found setObject:item forKey:item.resource];
+    }
+    [found removeObjectsForKeys:[ambiguous allObjects]];
+    
+    ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP
+                                                                       context:context];
+    [event setTokenType:AD_TELEMETRY_VALUE_ACCESS_TOKEN];
+    [event setStatus:found.count ? AD_TELEMETRY_VALUE_SUCCEEDED : AD_TELEMETRY_VALUE_FAILED];
+    [self addMemoryCacheCountersToEvent:event];
+    [[ADTelemetry sharedInstance] stopEvent:[context telemetryRequestId] event:event];
+    return found;
+}
+
 /*!
     Returns a Multi-Resource Refresh Token (MRRT) Cache Item for the given parameters. A MRRT can
     potentially be used for many resources for that given user, client ID and authority.
@@ -115,8 +349,24 @@
                                  context:(id<ADRequestContext>)context
                                    error:(ADAuthenticationError * __autoreleasing *)error
 {
+    id negativeKey = [self negativeCacheKeyForUser:identifier.userId clientId:clientId resource:nil];
+    if ([self isKnownMissing:negativeKey])
+    {
+        AD_LOG_VERBOSE(@"Skipping MRRT lookup, recently found missing or rejected", [context correlationId], nil);
+        return nil;
+    }
+    
     [[ADTelemetry sharedInstance] startEvent:[context telemetryRequestId] eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP];
-    ADTokenCacheItem* item = [self getItemForUser:identifier resource:nil clientId:clientId context:context error:error];
+    ADAuthenticationError* adError = nil;
+    ADTokenCacheItem* item = [self getItemForUser:identifier resource:nil clientId:clientId context:context error:&adError];
+    if (!item && !adError)
+    {
+        [self recordMissing:negativeKey];
+    }
+    if (error && adError)
+    {
+        *error = adError;
+    }
     ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP
                                                                      requestId:[context telemetryRequestId]
                                                                  correlationId:[context correlationId]];
@@ -128,6 +378,7 @@
         [event setMRRTStatus:AD_TELEMETRY_VALUE_TRIED];
     }
     [event setStatus:item? AD_TELEMETRY_VALUE_SUCCEEDED : AD_TELEMETRY_VALUE_FAILED];
+    [self addMemoryCacheCountersToEvent:event];
     [[ADTelemetry sharedInstance] stopEvent:[context telemetryRequestId] event:event];
     return item;
 }
@@ -141,10 +392,26 @@
                                 context:(id<ADRequestContext>)context
                                   error:(ADAuthenticationError * __autoreleasing *)error
 {
+    NSString* fociClientId = [ADTokenCacheAccessor familyClientId:familyId];
+    id negativeKey = [self negativeCacheKeyForUser:identifier.userId clientId:fociClientId resource:nil];
+    if ([self isKnownMissing:negativeKey])
+    {
+        AD_LOG_VERBOSE(@"Skipping FRT lookup, recently found missing or rejected", [context correlationId], nil);
+        return nil;
+    }
+    
     [[ADTelemetry sharedInstance] startEvent:context.telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP];
     
-    NSString* fociClientId = [ADTokenCacheAccessor familyClientId:familyId];
-    ADTokenCacheItem* item = [self getItemForUser:identifier resource:nil clientId:fociClientId context:context error:error];
+    ADAuthenticationError* adError = nil;
+    ADTokenCacheItem* item = [self getItemForUser:identifier resource:nil clientId:fociClientId context:context error:&adError];
+    if (!item && !adError)
+    {
+        [self recordMissing:negativeKey];
+    }
+    if (error && adError)
+    {
+        *error = adError;
+    }
 
     ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP
                                                                        context:context];
@@ -156,6 +423,7 @@
         [event setFRTStatus:AD_TELEMETRY_VALUE_TRIED];
     }
     [event setStatus:item? AD_TELEMETRY_VALUE_SUCCEEDED : AD_TELEMETRY_VALUE_FAILED];
+    [self addMemoryCacheCountersToEvent:event];
     [[ADTelemetry sharedInstance] stopEvent:[context telemetryRequestId] event:event];
     return item;
 }
@@ -177,9 +445,25 @@
     {
         return nil;
     }
+    
+    id negativeKey = [self negativeCacheKeyForUser:@"" clientId:clientId resource:resource];
+    if ([self isKnownMissing:negativeKey])
+    {
+        AD_LOG_VERBOSE(@"Skipping ADFS token lookup, recently found missing or rejected", [context correlationId], nil);
+        return nil;
+    }
 
     [[ADTelemetry sharedInstance] startEvent:[context telemetryRequestId] eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP];
-    ADTokenCacheItem* item = [_dataSource getItemWithKey:key userId:@"" correlationId:[context correlationId] error:error];
+    ADAuthenticationError* adError = nil;
+    ADTokenCacheItem* item = [_dataSource getItemWithKey:key userId:@"" correlationId:[context correlationId] error:&adError];
+    if (!item && !adError)
+    {
+        [self recordMissing:negativeKey];
+    }
+    if (error && adError)
+    {
+        *error = adError;
+    }
     ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_LOOKUP
                                                                        context:context];
     [event setTokenType:AD_TELEMETRY_VALUE_ADFS_TOKEN];
@@ -190,6 +474,7 @@
         [event setRTStatus:AD_TELEMETRY_VALUE_TRIED];
     }
     [event setStatus:item? AD_TELEMETRY_VALUE_SUCCEEDED : AD_TELEMETRY_VALUE_FAILED];
+    [self addMemoryCacheCountersToEvent:event];
     [[ADTelemetry sharedInstance] stopEvent:[context telemetryRequestId] event:event];
     return item;
 }
@@ -252,10 +537,18 @@
     NSString* telemetryRequestId = [context telemetryRequestId];
     
     NSString* savedRefreshToken = cacheItem.refreshToken;
+    NSString* userId = cacheItem.userInformation.userId;
+    
+    [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE];
+    
+    // All of the items are written as one batch. The refresh tokens go first so that the cache
+    // never ends up with an access token whose MRRT didn't make it in. There's still one write
+    // event per item, same as when they were written one at a time.
+    NSMutableArray<ADTokenCacheItem *> * items = [NSMutableArray new];
+    NSMutableArray<ADTelemetryCacheEvent *> * events = [NSMutableArray new];
     if (isMRRT)
     {
         AD_LOG_VERBOSE_F(@"Token cache store", correlationId, @"Storing multi-resource refresh token for authority: %@", _authority);
-        [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE];
         
         //If the server returned a multi-resource refresh token, we break
         //the item into two: one with the access token and no refresh token and
@@ -267,41 +560,59 @@
         multiRefreshTokenItem.accessToken = nil;
         multiRefreshTokenItem.resource = nil;
         multiRefreshTokenItem.expiresOn = nil;
-        [_dataSource addOrUpdateItem:multiRefreshTokenItem correlationId:correlationId error:nil];
-        ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
-                                                                           context:context];
-        [event setIsMRRT:AD_TELEMETRY_VALUE_YES];
-        [event setTokenType:AD_TELEMETRY_VALUE_MULTI_RESOURCE_REFRESH_TOKEN];
-        [[ADTelemetry sharedInstance] stopEvent:telemetryRequestId event:event];
+        [items addObject:multiRefreshTokenItem];
+        ADTelemetryCacheEvent* mrrtEvent = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
+                                                                               context:context];
+        [mrrtEvent setIsMRRT:AD_TELEMETRY_VALUE_YES];
+        [mrrtEvent setTokenType:AD_TELEMETRY_VALUE_MULTI_RESOURCE_REFRESH_TOKEN];
+        [events addObject:mrrtEvent];
         
         // If the item is also a Family Refesh Token (FRT) we update the FRT
         // as well so we have a guaranteed spot to look for the most recent FRT.
         NSString* familyId = cacheItem.familyId;
         if (familyId)
         {
-            [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE];
-            
             ADTokenCacheItem* frtItem = [multiRefreshTokenItem copy];
             NSString* fociClientId = [ADTokenCacheAccessor familyClientId:familyId];
             frtItem.clientId = fociClientId;
-            [_dataSource addOrUpdateItem:frtItem correlationId:correlationId error:nil];
+            [items addObject:frtItem];
             
-            ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
-                                                                               context:context];
-            [event setIsFRT:AD_TELEMETRY_VALUE_YES];
-            [event setTokenType:AD_TELEMETRY_VALUE_FAMILY_REFRESH_TOKEN];
-            [[ADTelemetry sharedInstance] stopEvent:telemetryRequestId event:event];
+            ADTelemetryCacheEvent* frtEvent = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
+                                                                                  context:context];
+            [frtEvent setIsFRT:AD_TELEMETRY_VALUE_YES];
+            [frtEvent setTokenType:AD_TELEMETRY_VALUE_FAMILY_REFRESH_TOKEN];
+            [events addObject:frtEvent];
         }
     }
     
     AD_LOG_VERBOSE_F(@"Token cache store", correlationId, @"Storing access token for resource: %@", cacheItem.resource);
-    [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE];
-    [_dataSource addOrUpdateItem:cacheItem correlationId:correlationId error:nil];
+    [items addObject:cacheItem];
+    ADTelemetryCacheEvent* atEvent = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
+                                                                         context:context];
+    [atEvent setTokenType:AD_TELEMETRY_VALUE_ACCESS_TOKEN];
+    [events addObject:atEvent];
+    
+    ADAuthenticationError* error = nil;
+    if (![_dataSource addOrUpdateItems:items correlationId:correlationId error:&error])
+    {
+        AD_LOG_ERROR_F(@"Failed to update the token cache", error.code, correlationId, @"%@", error.errorDetails);
+    }
     cacheItem.refreshToken = savedRefreshToken;//Restore for the result
-    ADTelemetryCacheEvent* event = [[ADTelemetryCacheEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE
-                                                                       context:context];
-    [event setTokenType:AD_TELEMETRY_VALUE_ACCESS_TOKEN];
-    [[ADTelemetry sharedInstance] stopEvent:telemetryRequestId event:event];
+    
+    // Anything we remembered as missing for this user might be there now. This has to come after
+    // the write, a lookup racing with it could otherwise record the miss again right before the
+    // items land.
+    [self invalidateNegativeCacheForUser:userId ? userId : @""];
+    
+    // The time of the batch goes to the first event, the items after it didn't cost anything extra.
+    for (ADTelemetryCacheEvent* itemEvent in events)
+    {
+        if (itemEvent != events.firstObject)
+        {
+            [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_TOKEN_CACHE_WRITE];
+        }
+        [[ADTelemetry sharedInstance] stopEvent:telemetryRequestId event:itemEvent];
+    }
 }
 
 - (void)removeItemFromCache:(ADTokenCacheItem *)cacheItem
@@ -330,6 +641,9 @@
                                        @"errorDetails" : [error errorDetails],
                                        @"protocolCode" : [error protocolCode] }];
             [_dataSource addOrUpdateItem:existing correlationId:correlationId error:nil];
+            // Users without an ID (ADFS) are looked up as @"", not as any user
+            NSString* userId = existing.userInformation.userId;
+            [self recordMissing:[self negativeCacheKeyForUser:userId ? userId : @"" clientId:existing.clientId resource:existing.resource]];
             removed = YES;
         }
     }
@@ -352,6 +666,8 @@
                                             @"errorDetails" : [error errorDetails],
                                             @"protocolCode" : [error protocolCode] }];
                 [_dataSource addOrUpdateItem:broadItem correlationId:correlationId error:nil];
+                NSString* userId = broadItem.userInformation.userId;
+                [self recordMissing:[self negativeCacheKeyForUser:userId ? userId : @"" clientId:broadItem.clientId resource:nil]];
             }
         }
     }
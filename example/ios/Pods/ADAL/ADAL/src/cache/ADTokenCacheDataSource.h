@@ -67,6 +67,26 @@
           correlationId:(nullable NSUUID *)correlationId
                   error:(ADAuthenticationError * __nullable __autoreleasing * __nullable)error;
 
+/*!
+ Adds or updates all of the passed in items as a single write, taking the cache lock and
+ persisting the cache only once for the whole batch.
+
+ Items are written in the order given. Callers should put items that others depend on
+ (e.g. the MRRT for an access token) first, so that an interrupted batch never leaves a
+ dependent item behind without them.
+
+ @param  items   The items to add to the cache, or update if items matching their key and
+ userId already exist in the cache.
+ @param  error   (Optional) In the case of an error this will be filled with the
+ error details.
+
+ @return YES if all of the items were written. If NO, the items before the one that failed
+ may have been written.
+ */
+- (BOOL)addOrUpdateItems:(nonnull NSArray<ADTokenCacheItem *> *)items
+           correlationId:(nullable NSUUID *)correlationId
+                   error:(ADAuthenticationError * __nullable __autoreleasing * __nullable)error;
+
 /*!
  @param  item    The item to remove from the cache
  @param  error   (Optional) In the case of an error this will be filled with the
@@ -252,6 +252,11 @@
 
 - (void)logMessage:(NSString*)message level:(ADAL_LOG_LEVEL)level correlationId:(NSUUID*)correlationId
 {
+    if (![ADLogger isLevelEnabled:level])
+    {
+        return;
+    }
+    
     if (_tombstone)
     {
         NSString* tombstoneMessage = nil;
@@ -45,4 +45,17 @@
 
 - (NSDictionary*)defaultKeychainQuery;
 
+/*! Number of getItemsWithKey: calls answered from the in-memory copy of the keychain, and
+    the number that had to go to the keychain. */
+- (NSUInteger)memoryCacheHits;
+- (NSUInteger)memoryCacheMisses;
+
+/*! Changes whenever the keychain items of this cache's group are written to, by this app or
+    another one in the group. */
+- (uint64_t)changeGeneration;
+
+/*! Number of expired tombstones deleted from this cache's keychain group by the background
+    tombstone compactor since launch. */
+- (NSUInteger)tombstonesReclaimed;
+
 @end
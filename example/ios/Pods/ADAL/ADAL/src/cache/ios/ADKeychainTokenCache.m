@@ -22,6 +22,8 @@
 // THE SOFTWARE.
 
 #import <Security/Security.h>
+#include <notify.h>
+#include <stdatomic.h>
 #import "ADAL_Internal.h"
 #import "ADKeychainTokenCache+Internal.h"
 #import "ADKeychainUtil.h"
@@ -37,6 +39,14 @@
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define ONE_DAY_IN_SECONDS (24*60*60)
+#define MEMORY_CACHE_MAX_ENTRIES 64
+
+// Expired tombstones are reclaimed a few items at a time on a background queue, starting a while
+// after launch and only once nobody has looked anything up in the cache for a little bit.
+#define TOMBSTONE_COMPACTION_SLICE_SIZE 16
+#define TOMBSTONE_COMPACTION_START_DELAY 30
+#define TOMBSTONE_COMPACTION_SLICE_DELAY 2
+#define TOMBSTONE_COMPACTION_IDLE_INTERVAL 5
 
 static NSString* const s_nilKey = @"CC3513A0-0E69-4B4D-97FC-DFB6C91EE132";//A special attribute to write, instead of nil/empty one.
 static NSString* const s_delimiter = @"|";
@@ -44,16 +54,65 @@ static NSString* const s_delimiter = @"|";
 static NSString* const s_libraryString = @"MSOpenTech.ADAL." TOSTRING(KEYCHAIN_VERSION);
 
 static NSString* const s_keyForStoringTomestoneCleanTime = @"NextTombstoneCleanTime";
+static NSString* const s_keyForStoringTombstoneCompactionCursor = @"TombstoneCompactionCursor";
 static NSString* const s_tombstoneLibraryString = @"Microsoft.ADAL.Tombstone." TOSTRING(KEYCHAIN_VERSION);
 
+// Written to kSecAttrType so that lookups can look at the items most likely to be live tokens
+// first. Items written by older versions of ADAL have no type, and older versions sharing the
+// keychain group can leave a stale one behind, so it is never trusted on its own.
+static const UInt32 s_tokenItemType = 0x4144544B;       // 'ADTK'
+static const UInt32 s_tombstoneItemType = 0x41445453;   // 'ADTS'
+
+// Posted whenever an ADKeychainTokenCache writes to a keychain group so other processes sharing
+// the group know to drop their in-memory copies.
+static NSString* const s_cacheChangedNotificationPrefix = @"com.microsoft.adal.cache.changed.";
+
 static NSString* s_defaultKeychainGroup = @"com.microsoft.adalcache";
 static ADKeychainTokenCache* s_defaultCache = nil;
 
+// Tombstone compaction state of each keychain group, keyed off of the group's change
+// notification name. Compaction is scheduled once per group, no matter how many caches
+// are created for it.
+static NSMutableDictionary* s_tombstoneCompactors = nil;
+// The last time any cache in this process looked up a token. Written by lookups on any thread,
+// read on the compaction queue.
+static _Atomic(CFAbsoluteTime) s_lastLookupTime = 0;
+
+@interface ADTombstoneCompactor : NSObject
+{
+@public
+    // Compaction runs through a cache of the group. It is held weakly so that the compactor
+    // doesn't keep a cache the app let go of alive, once it is gone compaction pauses until
+    // another cache for the group is created.
+    __weak ADKeychainTokenCache* _cache;
+    // Whether a compaction step is scheduled. Guarded by the compactors dictionary.
+    BOOL _scheduled;
+    // Attributes of the items left to look at in the current pass, in cursor order. Only
+    // touched on the compaction queue.
+    NSMutableArray* _pending;
+    NSUInteger _reclaimed;
+}
+@end
+
+@implementation ADTombstoneCompactor
+@end
+
 @implementation ADKeychainTokenCache
 {
     NSString* _sharedGroup;
     NSDictionary* _default;
     NSDictionary* _defaultTombstone;
+    
+    // Read-through cache of getItemsWithKey: results, keyed off of @[ key, userId, liveOnly ].
+    // Every write to the keychain (by us or another app in the group) bumps the generation
+    // and drops the cached results; results of a keychain read are only stored if no write
+    // happened while it was in flight.
+    NSMutableDictionary* _memoryCache;
+    uint64_t _memoryCacheGeneration;
+    NSString* _notificationName;
+    int _notifyToken;
+    NSUInteger _memoryCacheHits;
+    NSUInteger _memoryCacheMisses;
 }
 
 + (ADKeychainTokenCache*)defaultKeychainCache
@@ -116,6 +175,8 @@ static ADKeychainTokenCache* s_defaultCache = nil;
         return nil;
     }
     
+    _notifyToken = NOTIFY_TOKEN_INVALID;
+    
     if (!sharedGroup)
     {
         sharedGroup = [[NSBundle mainBundle] bundleIdentifier];
@@ -161,21 +222,127 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     _default = defaultQuery;
     _defaultTombstone = defaultTombstoneQuery;
     
-    static dispatch_once_t onceToken = 0;
-    dispatch_once(&onceToken, ^{
-        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-            [self cleanTombstoneIfNecessary];
-        });
-    });
+    _memoryCache = [NSMutableDictionary new];
+    _notificationName = [NSString stringWithFormat:@"%@%@", s_cacheChangedNotificationPrefix, _sharedGroup ? _sharedGroup : sharedGroup];
+    if (notify_register_check([_notificationName UTF8String], &_notifyToken) != NOTIFY_STATUS_OK)
+    {
+        _notifyToken = NOTIFY_TOKEN_INVALID;
+    }
+    
+    [ADKeychainTokenCache registerForTombstoneCompaction:self];
     
     return self;
 }
 
+- (void)dealloc
+{
+    if (_notifyToken != NOTIFY_TOKEN_INVALID)
+    {
+        notify_cancel(_notifyToken);
+    }
+}
+
 -  (NSString*)sharedGroup
 {
     return _sharedGroup;
 }
 
+#pragma mark -
+#pragma mark Memory Cache
+
+- (id)memoryCacheKeyForKey:(ADTokenCacheKey *)key
+                    userId:(NSString *)userId
+                  liveOnly:(BOOL)liveOnly
+{
+    return @[ key ? key : [NSNull null], userId ? userId : [NSNull null], @(liveOnly) ];
+}
+
+// Must be called while synchronized on _memoryCache
+- (void)checkForExternalChanges
+{
+    if (_notifyToken == NOTIFY_TOKEN_INVALID)
+    {
+        // Without notifications we can't tell when other apps write to the group, so don't
+        // trust anything we have cached.
+        [_memoryCache removeAllObjects];
+        _memoryCacheGeneration++;
+        return;
+    }
+    
+    int changed = 0;
+    notify_check(_notifyToken, &changed);
+    if (changed)
+    {
+        [_memoryCache removeAllObjects];
+        _memoryCacheGeneration++;
+    }
+}
+
+- (NSArray<ADTokenCacheItem *> *)memoryCachedItemsForKey:(id)cacheKey
+                                              generation:(uint64_t *)generation
+{
+    @synchronized(_memoryCache)
+    {
+        atomic_store_explicit(&s_lastLookupTime, CFAbsoluteTimeGetCurrent(), memory_order_relaxed);
+        [self checkForExternalChanges];
+        *generation = _memoryCacheGeneration;
+        
+        NSArray* items = [_memoryCache objectForKey:cacheKey];
+        if (!items)
+        {
+            _memoryCacheMisses++;
+            return nil;
+        }
+        
+        _memoryCacheHits++;
+        // Callers are free to modify the items they get back, so hand out copies.
+        return [[NSArray alloc] initWithArray:items copyItems:YES];
+    }
+}
+
+- (void)storeMemoryCachedItems:(NSArray<ADTokenCacheItem *> *)items
+                        forKey:(id)cacheKey
+                    generation:(uint64_t)generation
+{
+    NSArray* copies = [[NSArray alloc] initWithArray:items copyItems:YES];
+    @synchronized(_memoryCache)
+    {
+        // Something was written while we were reading the keychain, what we read might
+        // already be stale.
+        if (generation != _memoryCacheGeneration)
+        {
+            return;
+        }
+        
+        if (_memoryCache.count >= MEMORY_CACHE_MAX_ENTRIES)
+        {
+            [_memoryCache removeAllObjects];
+        }
+        
+        [_memoryCache setObject:copies forKey:cacheKey];
+    }
+}
+
+- (uint64_t)changeGeneration
+{
+    @synchronized(_memoryCache)
+    {
+        [self checkForExternalChanges];
+        return _memoryCacheGeneration;
+    }
+}
+
+- (void)invalidateMemoryCache
+{
+    @synchronized(_memoryCache)
+    {
+        [_memoryCache removeAllObjects];
+        _memoryCacheGeneration++;
+    }
+    
+    notify_post([_notificationName UTF8String]);
+}
+
 #pragma mark -
 #pragma mark Keychain Loggig
 
@@ -277,6 +444,139 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     return CFBridgingRelease(items);
 }
 
+// Internal method: the first half of a two phase lookup. Returns the keychain attributes (along
+// with a persistent reference) of all items that match the criteria, without reading or decrypting
+// any of the item data. Use itemsFromKeychainAttributes: to get the token cache items for the
+// attributes that are actually needed.
+// May return nil in case of error.
+- (NSArray<NSDictionary *> *)keychainAttributesWithKey:(ADTokenCacheKey*)key
+                                                userId:(NSString*)userId
+                                                 error:(ADAuthenticationError* __autoreleasing*)error
+{
+    NSMutableDictionary* query = [self queryDictionaryForKey:key
+                                                      userId:userId
+                                                  additional:@{ (id)kSecMatchLimit : (id)kSecMatchLimitAll,
+                                                                (id)kSecReturnAttributes : @YES,
+                                                                (id)kSecReturnPersistentRef : @YES }];
+    CFTypeRef items = nil;
+    OSStatus status = SecItemCopyMatching((CFDictionaryRef)query, &items);
+    if (status == errSecItemNotFound)
+    {
+        return @[];
+    }
+    else if (status != errSecSuccess)
+    {
+        [ADKeychainTokenCache checkStatus:status operation:@"retrieve item attributes" correlationId:nil error:error];
+        return nil;
+    }
+    
+    NSData* generic = [_default objectForKey:(id)kSecAttrGeneric];
+    NSMutableArray* matches = [NSMutableArray new];
+    for (NSDictionary* attrs in (NSArray*)CFBridgingRelease(items))
+    {
+        // Make sure that the item is really one of ours before we pay to decrypt it.
+        if (![generic isEqual:[attrs objectForKey:(id)kSecAttrGeneric]] ||
+            ![attrs objectForKey:(id)kSecAttrService] ||
+            ![attrs objectForKey:(id)kSecAttrAccount])
+        {
+            continue;
+        }
+        
+        [matches addObject:attrs];
+    }
+    
+    return matches;
+}
+
+// Internal method: the second half of a two phase lookup. Fetches the data of all of the passed in
+// items with a single keychain query, keyed by their persistent reference. Each value holds the
+// item data along with its current attributes. Items that have gone away since their attributes
+// were read are missing from the result.
+- (NSDictionary<NSData *, NSDictionary *> *)keychainDataForAttributes:(NSArray<NSDictionary *> *)attributes
+{
+    NSMutableArray* persistentRefs = [[NSMutableArray alloc] initWithCapacity:attributes.count];
+    for (NSDictionary* attrs in attributes)
+    {
+        NSData* persistentRef = [attrs objectForKey:(id)kSecValuePersistentRef];
+        if (persistentRef)
+        {
+            [persistentRefs addObject:persistentRef];
+        }
+    }
+    
+    if (!persistentRefs.count)
+    {
+        return @{};
+    }
+    
+    NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:_default];
+    [query addEntriesFromDictionary:@{ (id)kSecMatchItemList : persistentRefs,
+                                       (id)kSecMatchLimit : (id)kSecMatchLimitAll,
+                                       (id)kSecReturnData : @YES,
+                                       (id)kSecReturnAttributes : @YES,
+                                       (id)kSecReturnPersistentRef : @YES }];
+    CFTypeRef items = nil;
+    OSStatus status = SecItemCopyMatching((CFDictionaryRef)query, &items);
+    if (status != errSecSuccess || !items)
+    {
+        if (status != errSecItemNotFound)
+        {
+            AD_LOG_WARN_F(@"Failed to retrieve keychain item data", nil, @"status: %d", (int)status);
+        }
+        return @{};
+    }
+    
+    NSMutableDictionary* dataByRef = [[NSMutableDictionary alloc] initWithCapacity:persistentRefs.count];
+    for (NSDictionary* result in (NSArray*)CFBridgingRelease(items))
+    {
+        NSData* persistentRef = [result objectForKey:(id)kSecValuePersistentRef];
+        if (persistentRef && [result objectForKey:(id)kSecValueData])
+        {
+            [dataByRef setObject:result forKey:persistentRef];
+        }
+    }
+    
+    return dataByRef;
+}
+
+// Internal method: fetches (see keychainDataForAttributes:) and unarchives the passed in items,
+// in the same order. Items that have gone away since their attributes were read, or that fail to
+// decode, are skipped.
+- (NSArray<ADTokenCacheItem *> *)itemsFromKeychainAttributes:(NSArray<NSDictionary *> *)attributes
+{
+    NSDictionary* dataByRef = [self keychainDataForAttributes:attributes];
+    NSMutableArray* tokenItems = [[NSMutableArray<ADTokenCacheItem *> alloc] initWithCapacity:dataByRef.count];
+    for (NSDictionary* attrs in attributes)
+    {
+        NSData* persistentRef = [attrs objectForKey:(id)kSecValuePersistentRef];
+        NSDictionary* result = persistentRef ? [dataByRef objectForKey:persistentRef] : nil;
+        if (!result)
+        {
+            continue;
+        }
+        
+        ADTokenCacheItem* item = [self itemFromKeychainAttributes:result];
+        if (item)
+        {
+            [tokenItems addObject:item];
+        }
+    }
+    
+    return tokenItems;
+}
+
+// Returns YES if the attributes say they belong to a tombstone. The type is only a hint: items
+// written before the type was recorded have none, and older versions of ADAL that tombstone or
+// revive an item by rewriting its data leave the type as it was.
++ (BOOL)isTombstoneAttributes:(NSDictionary *)attrs
+{
+    return [[attrs objectForKey:(id)kSecAttrType] unsignedIntValue] == s_tombstoneItemType;
+}
+
++ (BOOL)isTokenAttributes:(NSDictionary *)attrs
+{
+    return [[attrs objectForKey:(id)kSecAttrType] unsignedIntValue] == s_tokenItemType;
+}
 
 - (ADTokenCacheItem*)itemFromKeychainAttributes:(NSDictionary*)attrs
 {
@@ -286,6 +586,12 @@ static ADKeychainTokenCache* s_defaultCache = nil;
         AD_LOG_WARN(@"Retrieved item with key that did not have generic item data!", nil, nil);
         return nil;
     }
+    
+    return [self itemFromKeychainData:data];
+}
+
+- (ADTokenCacheItem*)itemFromKeychainData:(NSData*)data
+{
     @try
     {
         ADTokenCacheItem* item = [NSKeyedUnarchiver unarchiveObjectWithData:data];
@@ -364,7 +670,9 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     NSMutableDictionary* query = [self queryDictionaryForKey:key
                                                       userId:item.userInformation.userId
                                                   additional:nil];
-    return SecItemDelete((CFDictionaryRef)query);
+    OSStatus status = SecItemDelete((CFDictionaryRef)query);
+    [self invalidateMemoryCache];
+    return status;
 }
 
 - (NSMutableArray *)filterOutTombstones:(NSArray *)items
@@ -447,31 +755,246 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     return deleteSuccessful;
 }
 
-- (BOOL)cleanTombstoneIfNecessary
+#pragma mark -
+#pragma mark Tombstone Compaction
+
++ (dispatch_queue_t)tombstoneCompactionQueue
+{
+    static dispatch_queue_t s_queue = nil;
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_queue = dispatch_queue_create("com.microsoft.adal.tombstonecompaction", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(s_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    });
+    
+    return s_queue;
+}
+
++ (NSMutableDictionary *)tombstoneCompactors
+{
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_tombstoneCompactors = [NSMutableDictionary new];
+    });
+    
+    return s_tombstoneCompactors;
+}
+
++ (void)registerForTombstoneCompaction:(ADKeychainTokenCache *)cache
 {
-    //Check whether it is time to clean tombstones
-    if (![self isTimeToCleanTombstones])
+    NSMutableDictionary* compactors = [self tombstoneCompactors];
+    ADTombstoneCompactor* compactor = nil;
+    @synchronized(compactors)
     {
-        return NO;
+        compactor = [compactors objectForKey:cache->_notificationName];
+        if (!compactor)
+        {
+            compactor = [ADTombstoneCompactor new];
+            [compactors setObject:compactor forKey:cache->_notificationName];
+        }
+        
+        if (!compactor->_cache)
+        {
+            compactor->_cache = cache;
+        }
+        
+        // Only the first cache of the group starts compaction, or a later one if compaction
+        // paused because the cache it ran through went away.
+        if (compactor->_scheduled)
+        {
+            return;
+        }
+        compactor->_scheduled = YES;
+    }
+    
+    [self scheduleTombstoneCompaction:compactor after:TOMBSTONE_COMPACTION_START_DELAY];
+}
+
+// Must only be called with the compactor's _scheduled set, it stays set until the compaction
+// is done or pauses.
++ (void)scheduleTombstoneCompaction:(ADTombstoneCompactor *)compactor
+                              after:(NSTimeInterval)delay
+{
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), [self tombstoneCompactionQueue], ^{
+        ADKeychainTokenCache* cache = nil;
+        @synchronized([self tombstoneCompactors])
+        {
+            cache = compactor->_cache;
+        }
+        
+        NSTimeInterval next = [cache compactTombstonesIfNecessary:compactor];
+        if (next > 0)
+        {
+            [self scheduleTombstoneCompaction:compactor after:next];
+            return;
+        }
+        
+        @synchronized([self tombstoneCompactors])
+        {
+            compactor->_scheduled = NO;
+        }
+    });
+}
+
+// Returns how long to wait before the next step, 0 if there's nothing left to do for now.
+// Must be called on the compaction queue
+- (NSTimeInterval)compactTombstonesIfNecessary:(ADTombstoneCompactor *)compactor
+{
+    // Stay out of the way of token lookups, in particular the ones an app does right after launch.
+    // Lookups on any cache count, a slightly stale value only delays compaction a little.
+    CFAbsoluteTime lastLookupTime = atomic_load_explicit(&s_lastLookupTime, memory_order_relaxed);
+    if (CFAbsoluteTimeGetCurrent() - lastLookupTime < TOMBSTONE_COMPACTION_IDLE_INTERVAL)
+    {
+        return TOMBSTONE_COMPACTION_IDLE_INTERVAL;
     }
     
-    //Clean tombstones that are too old
-    NSArray* tombstones = [self allTombstones:nil];
-    for (ADTokenCacheItem * item in tombstones)
+    // A cursor means a previous pass (possibly in a previous launch) didn't get to finish.
+    NSString* cursor = [self tombstoneMetadataForKey:s_keyForStoringTombstoneCompactionCursor];
+    if (![cursor isKindOfClass:[NSString class]])
     {
-        if (!item)
+        if (![self isTimeToCleanTombstones])
+        {
+            return 0;
+        }
+        cursor = @"";
+    }
+    
+    if ([self compactTombstoneSlice:compactor afterCursor:&cursor])
+    {
+        [self removeTombstoneMetadataForKey:s_keyForStoringTombstoneCompactionCursor];
+        [self storeTombstoneCleanTime:[NSDate dateWithTimeIntervalSinceNow:ONE_DAY_IN_SECONDS]]; //clean tombstone once everyday
+        return 0;
+    }
+    
+    [self storeTombstoneMetadata:cursor forKey:s_keyForStoringTombstoneCompactionCursor];
+    return TOMBSTONE_COMPACTION_SLICE_DELAY;
+}
+
++ (NSString *)compactionCursorForAttributes:(NSDictionary *)attrs
+{
+    return [NSString stringWithFormat:@"%@%@%@", [attrs objectForKey:(id)kSecAttrService], s_delimiter, [attrs objectForKey:(id)kSecAttrAccount]];
+}
+
+// Looks at the next TOMBSTONE_COMPACTION_SLICE_SIZE items, in order of their keychain service
+// and account, that come after the cursor, and deletes the ones that have expired. Updates the
+// cursor to the last item looked at, returns YES once the end of the keychain has been reached.
+// Must be called on the compaction queue.
+- (BOOL)compactTombstoneSlice:(ADTombstoneCompactor *)compactor
+                  afterCursor:(NSString **)cursor
+{
+    if (!compactor->_pending)
+    {
+        // The keychain can't be queried for a range of items, so the attributes (without any of
+        // the item data) are listed once at the start of a pass, and each slice only reads and
+        // decrypts its own items.
+        NSArray* attributes = [self keychainAttributesWithKey:nil userId:nil error:nil];
+        if (!attributes)
+        {
+            // Try again with a fresh pass tomorrow rather than spinning on a broken keychain.
+            return YES;
+        }
+        
+        NSMutableArray* cursors = [NSMutableArray new];
+        NSMutableDictionary* attributesByCursor = [NSMutableDictionary new];
+        for (NSDictionary* attrs in attributes)
+        {
+            NSString* itemCursor = [ADKeychainTokenCache compactionCursorForAttributes:attrs];
+            if ([itemCursor compare:*cursor] != NSOrderedDescending)
+            {
+                continue;
+            }
+            
+            [cursors addObject:itemCursor];
+            [attributesByCursor setObject:attrs forKey:itemCursor];
+        }
+        [cursors sortUsingSelector:@selector(compare:)];
+        compactor->_pending = [[attributesByCursor objectsForKeys:cursors notFoundMarker:[NSNull null]] mutableCopy];
+    }
+    
+    NSMutableArray* pending = compactor->_pending;
+    NSRange range = NSMakeRange(0, MIN(pending.count, (NSUInteger)TOMBSTONE_COMPACTION_SLICE_SIZE));
+    // The item type can be stale (see getItemWithKey:), so every item has to be unarchived
+    NSArray* slice = [pending subarrayWithRange:range];
+    [pending removeObjectsInRange:range];
+    if (slice.count)
+    {
+        *cursor = [ADKeychainTokenCache compactionCursorForAttributes:slice.lastObject];
+    }
+    
+    NSUInteger reclaimed = 0;
+    NSDictionary* dataByRef = [self keychainDataForAttributes:slice];
+    for (NSDictionary* attrs in slice)
+    {
+        NSDictionary* result = [dataByRef objectForKey:[attrs objectForKey:(id)kSecValuePersistentRef]];
+        ADTokenCacheItem* item = result ? [self itemFromKeychainAttributes:result] : nil;
+        if (!item.tombstone)
         {
             continue;
         }
         
-        if ([item expiresOn]==nil | [[item expiresOn] compare:[NSDate date]] == NSOrderedAscending)
+        if ([item expiresOn] == nil || [[item expiresOn] compare:[NSDate date]] == NSOrderedAscending)
+        {
+            if ([self deleteUnchangedKeychainItem:result])
+            {
+                reclaimed++;
+            }
+        }
+    }
+    
+    if (reclaimed)
+    {
+        // Once for the whole slice rather than for every item deleted
+        [self invalidateMemoryCache];
+        
+        @synchronized([ADKeychainTokenCache tombstoneCompactors])
         {
-            [self deleteItem:item error:nil];
+            compactor->_reclaimed += reclaimed;
         }
+        AD_LOG_VERBOSE_F(@"Reclaimed expired tombstones", nil, @"count: %lu", (unsigned long)reclaimed);
+    }
+    
+    if (pending.count)
+    {
+        return NO;
     }
+    
+    compactor->_pending = nil;
     return YES;
 }
 
+// Deletes the item by its persistent reference, unless it was written to since the passed in
+// attributes were read, e.g. because another app in the group revived the tombstone in the
+// meantime. Doesn't invalidate the memory cache, that is up to the caller.
+- (BOOL)deleteUnchangedKeychainItem:(NSDictionary *)attrs
+{
+    NSData* persistentRef = [attrs objectForKey:(id)kSecValuePersistentRef];
+    NSDate* modificationDate = [attrs objectForKey:(id)kSecAttrModificationDate];
+    if (!persistentRef || !modificationDate)
+    {
+        return NO;
+    }
+    
+    NSDictionary* query = @{ (id)kSecClass : (id)kSecClassGenericPassword,
+                             (id)kSecValuePersistentRef : persistentRef,
+                             (id)kSecMatchLimit : (id)kSecMatchLimitOne,
+                             (id)kSecReturnAttributes : @YES };
+    CFTypeRef current = nil;
+    if (SecItemCopyMatching((CFDictionaryRef)query, &current) != errSecSuccess || !current)
+    {
+        return NO;
+    }
+    
+    NSDictionary* currentAttrs = CFBridgingRelease(current);
+    if (![modificationDate isEqualToDate:[currentAttrs objectForKey:(id)kSecAttrModificationDate]])
+    {
+        return NO;
+    }
+    
+    query = @{ (id)kSecClass : (id)kSecClassGenericPassword,
+               (id)kSecValuePersistentRef : persistentRef };
+    return SecItemDelete((CFDictionaryRef)query) == errSecSuccess;
+}
+
 - (BOOL)isTimeToCleanTombstones
 {
     NSDate* nextCleanTime = [self getTombstoneCleanTime];
@@ -482,40 +1005,53 @@ static ADKeychainTokenCache* s_defaultCache = nil;
         return NO;
     }
     
-    // otherwise create a new entry and store it in keychain
-    nextCleanTime = [NSDate dateWithTimeIntervalSinceNow:ONE_DAY_IN_SECONDS]; //clean tombstone once everyday
-    [self storeTombstoneCleanTime:nextCleanTime];
     return YES;
 }
 
 - (NSDate*)getTombstoneCleanTime
+{
+    NSDate* cleanTime = [self tombstoneMetadataForKey:s_keyForStoringTomestoneCleanTime];
+    return [cleanTime isKindOfClass:[NSDate class]] ? cleanTime : nil;
+}
+
+- (void)storeTombstoneCleanTime:(NSDate *)cleanTime
+{
+    [self storeTombstoneMetadata:cleanTime forKey:s_keyForStoringTomestoneCleanTime];
+}
+
+- (id)tombstoneMetadataForKey:(NSString *)key
 {
     NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:_defaultTombstone];
     
     [query addEntriesFromDictionary:@{ (id)kSecMatchLimit : (id)kSecMatchLimitOne,
                                        (id)kSecReturnData : @YES,
-                                       (id)kSecAttrService : s_keyForStoringTomestoneCleanTime }];
+                                       (id)kSecAttrService : key }];
     
     CFTypeRef data = nil;
     OSStatus status = SecItemCopyMatching((CFDictionaryRef)query, &data);
-    if (status == errSecSuccess && data)
+    if (status != errSecSuccess || !data)
     {
-        NSDate* cleanTime = [NSKeyedUnarchiver unarchiveObjectWithData:(__bridge NSData * _Nonnull)(data)];
-        CFRelease(data);
-        if (cleanTime)
-        {
-            return cleanTime;
-        }
+        return nil;
+    }
+    
+    NSData* archive = CFBridgingRelease(data);
+    @try
+    {
+        return [NSKeyedUnarchiver unarchiveObjectWithData:archive];
+    }
+    @catch (NSException *exception)
+    {
+        return nil;
     }
-    return nil;
 }
 
-- (void)storeTombstoneCleanTime:(NSDate *)cleanTime
+- (void)storeTombstoneMetadata:(id<NSCoding>)value
+                        forKey:(NSString *)key
 {
     NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:_defaultTombstone];
-    [query setObject:s_keyForStoringTomestoneCleanTime forKey:(id)kSecAttrService];
+    [query setObject:key forKey:(id)kSecAttrService];
     
-    NSData* itemData = [NSKeyedArchiver archivedDataWithRootObject:cleanTime];
+    NSData* itemData = [NSKeyedArchiver archivedDataWithRootObject:value];
     if (!itemData)
     {
         return;
@@ -533,6 +1069,13 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     return;
 }
 
+- (void)removeTombstoneMetadataForKey:(NSString *)key
+{
+    NSMutableDictionary* query = [NSMutableDictionary dictionaryWithDictionary:_defaultTombstone];
+    [query setObject:key forKey:(id)kSecAttrService];
+    SecItemDelete((CFDictionaryRef)query);
+}
+
 @end
 
 @implementation ADKeychainTokenCache (Internal)
@@ -608,6 +1151,15 @@ static ADKeychainTokenCache* s_defaultCache = nil;
                                    correlationId:(NSUUID *)correlationId
                                            error:(ADAuthenticationError * __autoreleasing* )error
 {
+    id cacheKey = [self memoryCacheKeyForKey:key userId:userId liveOnly:NO];
+    uint64_t generation = 0;
+    NSArray<ADTokenCacheItem *> * cachedItems = [self memoryCachedItemsForKey:cacheKey generation:&generation];
+    if (cachedItems)
+    {
+        [self logItemRetrievalStatus:cachedItems key:key userId:userId correlationId:correlationId];
+        return cachedItems;
+    }
+    
     NSArray* items = [self keychainItemsWithKey:key userId:userId error:error];
     if (!items)
     {
@@ -627,6 +1179,8 @@ static ADKeychainTokenCache* s_defaultCache = nil;
         [tokenItems addObject:item];
     }
     
+    [self storeMemoryCachedItems:tokenItems forKey:cacheKey generation:generation];
+    
     [self logItemRetrievalStatus:tokenItems key:key userId:userId correlationId:correlationId];
     return tokenItems;
     
@@ -645,34 +1199,105 @@ static ADKeychainTokenCache* s_defaultCache = nil;
                       correlationId:(NSUUID *)correlationId
                               error:(ADAuthenticationError * __autoreleasing *)error
 {
-    NSArray* items = [self getItemsWithKey:key userId:userId correlationId:correlationId error:error];
-    NSArray* itemsExcludingTombstones = [self filterOutTombstones:items];
+    id cacheKey = [self memoryCacheKeyForKey:key userId:userId liveOnly:YES];
+    uint64_t generation = 0;
+    NSArray* itemsExcludingTombstones = [self memoryCachedItemsForKey:cacheKey generation:&generation];
+    if (!itemsExcludingTombstones)
+    {
+        // Only read the attributes at first, the data of an item is only fetched and decrypted
+        // if we actually need it.
+        NSArray* attributes = [self keychainAttributesWithKey:key userId:userId error:error];
+        if (!attributes)
+        {
+            [self logItemRetrievalStatus:nil key:key userId:userId correlationId:correlationId];
+            return nil;
+        }
+        
+        // The item type can be stale, older versions of ADAL sharing the keychain group tombstone
+        // and revive items by rewriting only their data. So it is only used to look at the items
+        // most likely to be live tokens first, whether an item is a tombstone is always decided
+        // by unarchiving it.
+        NSMutableArray* candidates = [NSMutableArray new];
+        NSMutableArray* likelyTombstones = [NSMutableArray new];
+        for (NSDictionary* attrs in attributes)
+        {
+            if ([ADKeychainTokenCache isTombstoneAttributes:attrs])
+            {
+                [likelyTombstones addObject:attrs];
+            }
+            else if ([ADKeychainTokenCache isTokenAttributes:attrs])
+            {
+                [candidates insertObject:attrs atIndex:0];
+            }
+            else
+            {
+                [candidates addObject:attrs];
+            }
+        }
+        [candidates addObjectsFromArray:likelyTombstones];
+        
+        // The data of every candidate is fetched in one round trip, only the unarchiving stops
+        // early once the result is known to be ambiguous.
+        NSMutableArray* liveItems = [NSMutableArray new];
+        NSMutableArray* tombstones = [NSMutableArray new];
+        for (ADTokenCacheItem* item in [self itemsFromKeychainAttributes:candidates])
+        {
+            if ([item tombstone])
+            {
+                [tombstones addObject:item];
+                continue;
+            }
+            
+            [liveItems addObject:item];
+            if (liveItems.count > 1)
+            {
+                // No need to look at the rest, it's ambiguous either way
+                [self logItemRetrievalStatus:liveItems key:key userId:userId correlationId:correlationId];
+                [self fillMultipleUsersError:error correlationId:correlationId];
+                return nil;
+            }
+        }
+        
+        itemsExcludingTombstones = liveItems;
+        
+        //if nothing but tombstones is found, tombstones details should be logged.
+        if (itemsExcludingTombstones.count == 0)
+        {
+            [self logTombstones:tombstones];
+        }
+        
+        [self storeMemoryCachedItems:itemsExcludingTombstones forKey:cacheKey generation:generation];
+        [self logItemRetrievalStatus:itemsExcludingTombstones key:key userId:userId correlationId:correlationId];
+    }
     
-    //if nothing but tombstones is found, tombstones details should be logged.
-    if (!itemsExcludingTombstones || [itemsExcludingTombstones count]==0)
+    if (itemsExcludingTombstones.count == 0)
     {
-        [self logTombstones:items];
         return nil;
     }
     
     if (itemsExcludingTombstones.count > 1)
     {
-        ADAuthenticationError* adError =
-        [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_MULTIPLE_USERS
-                                               protocolCode:nil
-                                               errorDetails:@"The token cache store for this resource contains more than one user. Please set the 'userId' parameter to the one that will be used."
-                                              correlationId:correlationId];
-        if (error)
-        {
-            *error = adError;
-        }
-        
+        [self fillMultipleUsersError:error correlationId:correlationId];
         return nil;
     }
     
     return itemsExcludingTombstones.firstObject;
 }
 
+- (void)fillMultipleUsersError:(ADAuthenticationError * __autoreleasing *)error
+                 correlationId:(NSUUID *)correlationId
+{
+    ADAuthenticationError* adError =
+    [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_MULTIPLE_USERS
+                                           protocolCode:nil
+                                           errorDetails:@"The token cache store for this resource contains more than one user. Please set the 'userId' parameter to the one that will be used."
+                                          correlationId:correlationId];
+    if (error)
+    {
+        *error = adError;
+    }
+}
+
 /*!
     Ensures the cache contains an item matching the passed in item, adding or updating the
     item as necessary.
@@ -688,61 +1313,103 @@ static ADKeychainTokenCache* s_defaultCache = nil;
 {
     @synchronized(self)
     {
-        ADTokenCacheKey* key = [item extractKey:error];
-        if (!key)
-        {
-            return NO;
-        }
-        
-        // In layers above this a nil/blank user ID means we simply don't know who it is (thanks to ADFS)
-        // however for the purposes of adding users we still do need to have an account name, even if it
-        // is just blank.
-        NSString* userId = item.userInformation.userId;
-        if (!userId)
-        {
-            userId = @"";
-        }
-        
-        // If the item wasn't found that means we need to add it.
-        NSMutableDictionary* query = [self queryDictionaryForKey:key
-                                                          userId:userId
-                                                      additional:nil];
-        
-        NSData* itemData = [NSKeyedArchiver archivedDataWithRootObject:item];
-        if (!itemData)
+        BOOL result = [self addOrUpdateImpl:item correlationId:correlationId error:error];
+        [self invalidateMemoryCache];
+        return result;
+    }
+}
+
+/*!
+    Writes all of the items under a single lock, dropping the memory cache and notifying
+    other processes sharing the keychain group once for the whole batch.
+ 
+    The keychain has no transactions, so items are written in the order given and the batch
+    stops at the first failure.
+ */
+- (BOOL)addOrUpdateItems:(NSArray<ADTokenCacheItem *> *)items
+           correlationId:(nullable NSUUID *)correlationId
+                   error:(ADAuthenticationError * __autoreleasing*)error
+{
+    RETURN_NO_ON_NIL_ARGUMENT(items);
+    
+    @synchronized(self)
+    {
+        BOOL result = YES;
+        for (ADTokenCacheItem* item in items)
         {
-            ADAuthenticationError* adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_BAD_FORMAT protocolCode:nil errorDetails:@"Failed to archive keychain item" correlationId:correlationId];
-            if (error)
+            if (![self addOrUpdateImpl:item correlationId:correlationId error:error])
             {
-                *error = adError;
+                result = NO;
+                break;
             }
-            return NO;
-        }
-        
-        NSDictionary* attrToUpdate = @{ (id)kSecValueData : itemData };
-        OSStatus status = SecItemUpdate((CFDictionaryRef)query, (CFDictionaryRef)attrToUpdate);
-        if (status == errSecSuccess)
-        {
-            return YES;
         }
-        else if (status == errSecItemNotFound)
+        [self invalidateMemoryCache];
+        return result;
+    }
+}
+
+// Must be called while synchronized on self
+- (BOOL)addOrUpdateImpl:(ADTokenCacheItem *)item
+          correlationId:(nullable NSUUID *)correlationId
+                  error:(ADAuthenticationError * __autoreleasing*)error
+{
+    ADTokenCacheKey* key = [item extractKey:error];
+    if (!key)
+    {
+        return NO;
+    }
+    
+    // In layers above this a nil/blank user ID means we simply don't know who it is (thanks to ADFS)
+    // however for the purposes of adding users we still do need to have an account name, even if it
+    // is just blank.
+    NSString* userId = item.userInformation.userId;
+    if (!userId)
+    {
+        userId = @"";
+    }
+    
+    // If the item wasn't found that means we need to add it.
+    NSMutableDictionary* query = [self queryDictionaryForKey:key
+                                                      userId:userId
+                                                  additional:nil];
+    
+    NSData* itemData = [NSKeyedArchiver archivedDataWithRootObject:item];
+    if (!itemData)
+    {
+        ADAuthenticationError* adError = [ADAuthenticationError errorFromAuthenticationError:AD_ERROR_CACHE_BAD_FORMAT protocolCode:nil errorDetails:@"Failed to archive keychain item" correlationId:correlationId];
+        if (error)
         {
-            // If the item wasn't found that means we need to add it instead.
-            
-            [query addEntriesFromDictionary:@{ (id)kSecValueData : itemData,
-                                               (id)kSecAttrAccessible : (id)kSecAttrAccessibleAfterFirstUnlockThisDeviceOnly}];
-            status = SecItemAdd((CFDictionaryRef)query, NULL);
-            if ([ADKeychainTokenCache checkStatus:status operation:@"add" correlationId:correlationId error:error])
-            {
-                return NO;
-            }
+            *error = adError;
         }
-        else if ([ADKeychainTokenCache checkStatus:status operation:@"update" correlationId:correlationId error:error])
+        return NO;
+    }
+    
+    NSNumber* itemType = @(item.tombstone ? s_tombstoneItemType : s_tokenItemType);
+    NSDictionary* attrToUpdate = @{ (id)kSecValueData : itemData,
+                                    (id)kSecAttrType : itemType };
+    OSStatus status = SecItemUpdate((CFDictionaryRef)query, (CFDictionaryRef)attrToUpdate);
+    if (status == errSecSuccess)
+    {
+        return YES;
+    }
+    else if (status == errSecItemNotFound)
+    {
+        // If the item wasn't found that means we need to add it instead.
+        
+        [query addEntriesFromDictionary:@{ (id)kSecValueData : itemData,
+                                           (id)kSecAttrType : itemType,
+                                           (id)kSecAttrAccessible : (id)kSecAttrAccessibleAfterFirstUnlockThisDeviceOnly}];
+        status = SecItemAdd((CFDictionaryRef)query, NULL);
+        if ([ADKeychainTokenCache checkStatus:status operation:@"add" correlationId:correlationId error:error])
         {
             return NO;
         }
     }
-    
+    else if ([ADKeychainTokenCache checkStatus:status operation:@"update" correlationId:correlationId error:error])
+    {
+        return NO;
+    }
+
     return YES;
 }
 
@@ -753,6 +1420,7 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     {
         NSMutableDictionary* query = [self queryDictionaryForKey:nil userId:nil additional:nil];
         OSStatus status = SecItemDelete((CFDictionaryRef)query);
+        [self invalidateMemoryCache];
         [ADKeychainTokenCache checkStatus:status operation:@"remove all" correlationId:nil error:error];
         
         // Remove the tombstone timestamp as well;
@@ -766,9 +1434,37 @@ static ADKeychainTokenCache* s_defaultCache = nil;
     return _default;
 }
 
+- (NSUInteger)memoryCacheHits
+{
+    @synchronized(_memoryCache)
+    {
+        return _memoryCacheHits;
+    }
+}
+
+- (NSUInteger)memoryCacheMisses
+{
+    @synchronized(_memoryCache)
+    {
+        return _memoryCacheMisses;
+    }
+}
+
+- (NSUInteger)tombstonesReclaimed
+{
+    NSMutableDictionary* compactors = [ADKeychainTokenCache tombstoneCompactors];
+    @synchronized(compactors)
+    {
+        ADTombstoneCompactor* compactor = [compactors objectForKey:_notificationName];
+        return compactor ? compactor->_reclaimed : 0;
+    }
+}
+
 - (NSArray<ADTokenCacheItem *> *)allTombstones:(ADAuthenticationError * __autoreleasing *)error
 {
-    NSArray* items = [self getItemsWithKey:nil userId:nil correlationId:nil error:error];
+    // The item type can be stale (see getItemWithKey:), so every item has to be unarchived
+    NSArray* attributes = [self keychainAttributesWithKey:nil userId:nil error:error];
+    NSArray* items = [self itemsFromKeychainAttributes:attributes];
     NSMutableArray* tombstones = [NSMutableArray new];
     for (ADTokenCacheItem* item in items)
     {
@@ -47,6 +47,10 @@ typedef WebView   WebViewType;
 /*! The completion block declaration. */
 typedef void(^ADAuthenticationCallback)(ADAuthenticationResult* result);
 
+/*! The completion block declaration for requests covering several resources. The results
+ are keyed by resource. */
+typedef void(^ADBatchAuthenticationCallback)(NSDictionary<NSString*, ADAuthenticationResult*>* results);
+
 #import <ADAL/ADAuthenticationContext.h>
 #import <ADAL/ADAuthenticationError.h>
 #import <ADAL/ADAuthenticationParameters.h>
@@ -123,6 +123,7 @@ typedef enum
     BOOL _extendedLifetimeEnabled;
     NSString* _logComponent;
     NSUUID* _correlationId;
+    NSHashTable* _cancellationTokens;
 #if __has_feature(objc_arc)
     __weak WebViewType* _webView;
 #else 
@@ -178,6 +179,24 @@ typedef enum
       validateAuthority:(BOOL)validateAuthority
                   error:(ADAuthenticationError * __autoreleasing *)error;
 
+/*!
+    Initializes an instance of ADAuthenticationContext that keeps its tokens in a memory-mapped
+    file instead of the default cache, e.g. for app extensions where the keychain is slow or
+    unavailable. Contexts created with the same path share the file, and so do other processes
+    that open it.
+ 
+    @param authority            The AAD or ADFS authority. Example: @"https://login.windows.net/contoso.com"
+    @param validateAuthority    Specifies if the authority should be validated.
+    @param cacheFilePath        Path to the cache file. The containing directory must already exist.
+    @param error                (Optional) Any extra error details, if the method fails
+ 
+    @return An instance of ADAuthenticationContext, nil if it fails.
+ */
+- (id)initWithAuthority:(NSString *)authority
+      validateAuthority:(BOOL)validateAuthority
+          cacheFilePath:(NSString *)cacheFilePath
+                  error:(ADAuthenticationError * __autoreleasing *)error;
+
 
 /*!
     Creates an instance of ADAuthenticationContext with the provided parameters.
@@ -242,6 +261,18 @@ typedef enum
  */
 + (BOOL)handleBrokerResponse:(NSURL*)response;
 
+/*!
+    Validates the given authorities in the background, e.g. while the app is idle after launch,
+    so that the first token requests against them don't wait on authority validation. Validations
+    already in progress are shared with the token requests that need them.
+ 
+    @param authorities          The AAD or ADFS authorities that will be used.
+    @param userId               (Optional) The user the ADFS authorities will be used for, needed
+                                to validate them. ADFS authorities are skipped if nil.
+ */
++ (void)prefetchAuthorityValidation:(NSArray<NSString*>*)authorities
+                             userId:(NSString*)userId;
+
 /*! Represents the authority used by the context. */
 @property (readonly) NSString* authority;
 
@@ -417,6 +448,28 @@ typedef enum
                                 userId:(NSString*)userId
                        completionBlock:(ADAuthenticationCallback)completionBlock;
 
+/*! Gets tokens for several resources at once, without showing UI. Valid access tokens for all of the
+ resources are looked up with a single read of the cache, the remaining resources then go through
+ acquireTokenSilentWithResource with a bounded number of requests in flight at any time, sharing the
+ cached MRRT/FRT. Each resource gets the same result acquireTokenSilentWithResource would have given it.
+ The completion block is always called on a background queue.
+ @param resources The resources whose tokens are needed. Duplicates are ignored.
+ @param clientId The client identifier
+ @param redirectUri The redirect URI according to OAuth2 protocol
+ @param userId The user whose tokens are needed. This parameter can be nil.
+ @param completionBlock Called once all of the resources are done, with the result for each resource.
+ */
+- (void)acquireTokensSilentWithResources:(NSArray<NSString*>*)resources
+                                clientId:(NSString*)clientId
+                             redirectUri:(NSURL*)redirectUri
+                                  userId:(NSString*)userId
+                         completionBlock:(ADBatchAuthenticationCallback)completionBlock;
+
+/*! Cancels all of the token requests started from this context that are still running. Their
+ completion blocks get called with an AD_ERROR_REQUEST_CANCELLED error. Requests showing UI are
+ not affected once the UI is up. */
+- (void)cancelOutstandingRequests;
+
 @end
 
 
@@ -50,6 +50,44 @@
  about to expire. */
 @property uint expirationBuffer;
 
+/*! When set, ADAL keeps track of the access tokens recently returned by silent requests and
+ refreshes them in the background using the MRRT shortly before they expire, so that later
+ silent requests find a valid token in the cache. Default is NO. */
+@property BOOL enableBackgroundRefresh;
+
+/*! Optional. Called before each background refresh, return NO to put it off for now, e.g. when
+ the device is low on battery or on a metered network. */
+@property (copy) BOOL (^backgroundRefreshCondition)(void);
+
+/*! When set (between 0 and 1), a silent request redeeming a multi resource refresh token that hasn't
+ heard back by this percentile of recently observed redemption times also starts redeeming the
+ family refresh token, if there is one, and uses whichever comes back with a token first. Default is 0,
+ which turns hedging off. */
+@property double refreshHedgingPercentile;
+
+/*! The maximum number of times a web request is sent when the server responds with 500, 503
+ or 504, or the request fails with a transient network error. Token requests are only sent more
+ than twice when they never reached the server (DNS or connection failures), authority validation
+ requests are retried up to the limit. Default is 2, 1 turns retries off. */
+@property NSUInteger maxRequestAttempts;
+
+/*! The base of the exponential backoff between retries, in seconds. Each retry waits a random
+ time between 0 and base * 2^(retry - 1), capped at retryMaxDelay, or longer if the server asks
+ for it with a Retry-After header. Default is 0.5. */
+@property NSTimeInterval retryBaseDelay;
+
+/*! The longest backoff between retries, in seconds. Default is 8. */
+@property NSTimeInterval retryMaxDelay;
+
+/*! A request is not retried if doing so would go past this many seconds since it was first
+ sent. 0 means no deadline. Default is 30. */
+@property NSTimeInterval retryDeadline;
+
+/*! The longest a silent token request may take end to end in seconds, across authority
+ validation, discovery, refresh token redemptions and retries. Requests still running at the
+ deadline fail with AD_ERROR_REQUEST_DEADLINE_EXCEEDED. Default is 0, no deadline. */
+@property NSTimeInterval requestDeadline;
+
 #if TARGET_OS_IPHONE
 /*! Used for the webView. Default is YES.*/
 @property BOOL enableFullScreen;
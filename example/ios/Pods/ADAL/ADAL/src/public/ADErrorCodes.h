@@ -177,6 +177,17 @@ typedef enum
     /*! We can't call out to tokenbroker in an extension */
     AD_ERROR_TOKENBROKER_NOT_SUPPORTED_IN_EXTENSION = 511,
     
+    //
+    // Request Errors
+    // These errors occur when a request is stopped before it could finish.
+    //
+    
+    /*! The request was cancelled with -[ADAuthenticationContext cancelOutstandingRequests] */
+    AD_ERROR_REQUEST_CANCELLED = 600,
+    
+    /*! The silent request did not finish within ADAuthenticationSettings.requestDeadline */
+    AD_ERROR_REQUEST_DEADLINE_EXCEEDED = 601,
+    
 } ADErrorCode;
 
 /* HTTP status codes used by the library */
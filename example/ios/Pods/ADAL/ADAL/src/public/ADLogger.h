@@ -81,5 +81,13 @@ typedef void (^LogCallback)(ADAL_LOG_LEVEL logLevel,
  */
 + (BOOL)getNSLogging;
 
+/*!
+    Log messages are delivered to NSLog and the log callback asynchronously, on a background queue,
+    in the order they were logged. The callback is never called from two threads at once.
+    Blocks until the messages logged so far have been delivered. Does nothing when called from
+    the log callback.
+ */
++ (void)flush;
+
 @end
 
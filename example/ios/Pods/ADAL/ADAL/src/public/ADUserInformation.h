@@ -31,6 +31,7 @@
     NSString* _uniqueId;
     NSString* _rawIdToken;
     NSDictionary* _allClaims;
+    NSDictionary* _claims;
 }
 
 /*! Factory method to extract user information from the AAD id_token parameter.
@@ -83,7 +84,8 @@
 /*! The raw id_token claim string. */
 @property (readonly) NSString* rawIdToken;
 
-/*! Contains all claims that had been read from the id_token. May be null, if the object was not created from a real id_token. */
+/*! Contains all claims that had been read from the id_token. May be null, if the object was not created from a real id_token.
+    Parsed on first access, reading the other properties doesn't need it. */
 @property (readonly) NSDictionary* allClaims;
 
 /* A helper method to normalize userId, e.g. remove white spaces, lowercase. 
@@ -52,6 +52,16 @@
 
 - (void)setDelegate:(nullable id<ADTokenCacheDelegate>)delegate;
 
+/*! The maximum number of items to keep in the cache, 0 (the default) means no limit.
+    When the cache goes over the limit expired tombstones and access tokens are evicted
+    first, followed by the least recently used access tokens. Items holding a usable refresh
+    token are never evicted. */
+@property NSUInteger maxItemCount;
+
+/*! The approximate maximum size in bytes of the serialized cache, 0 (the default) means
+    no limit. Eviction follows the same rules as maxItemCount. */
+@property NSUInteger maxSerializedSize;
+
 - (nullable NSData *)serialize;
 - (BOOL)deserialize:(nullable NSData*)data
               error:(ADAuthenticationError * __nullable __autoreleasing * __nullable)error;
@@ -43,6 +43,21 @@
 
 + (ADAcquireTokenSilentHandler *)requestWithParams:(ADRequestParameters*)requestParams;
 
+/*!
+    Gets a token out of the cache, redeeming refresh tokens as needed. If another handler is
+    already getting a token for the same authority, resource, client ID and user, this waits
+    for that handler's result instead of starting its own refresh.
+ */
 - (void)getToken:(ADAuthenticationCallback)completionBlock;
 
+/*!
+    Skips looking for an access token in the cache and goes straight to redeeming the MRRT
+    (or FRT) for a new one. Used to refresh tokens ahead of their expiration. Shares a
+    redemption with getToken: calls for the same token in the same way getToken: calls do.
+ */
+- (void)refreshToken:(ADAuthenticationCallback)completionBlock;
+
+/*! Number of getToken: and refreshToken: calls that were attached to a request already in flight. */
++ (NSUInteger)coalescedRequestCount;
+
 @end
@@ -36,9 +36,43 @@
 #import "ADTelemetry+Internal.h"
 #import "ADTelemetryAPIEvent.h"
 #import "ADTelemetryEventStrings.h"
+#import "ADTokenRefreshScheduler.h"
+#import "ADAuthenticationSettings.h"
+#import "ADCancellationToken.h"
+
+// Silent token requests currently in flight, keyed by the parameters that determine their result.
+// Each value is the list of (handler, completion block) pairs waiting on the request that got
+// there first.
+static NSMutableDictionary* s_inflightRequests = nil;
+static NSUInteger s_coalescedRequestCount = 0;
+
+// Recent MRRT redemption times (in seconds), used to work out when to hedge with the FRT.
+#define HEDGE_LATENCY_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 10
+#define HEDGE_DEFAULT_DELAY 2.0
+static NSTimeInterval s_mrrtLatencies[HEDGE_LATENCY_SAMPLES];
+static NSUInteger s_mrrtLatencyCount = 0;
 
 @implementation ADAcquireTokenSilentHandler
 
++ (NSMutableDictionary *)inflightRequests
+{
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_inflightRequests = [NSMutableDictionary new];
+    });
+    
+    return s_inflightRequests;
+}
+
++ (NSUInteger)coalescedRequestCount
+{
+    @synchronized([self inflightRequests])
+    {
+        return s_coalescedRequestCount;
+    }
+}
+
 + (ADAcquireTokenSilentHandler *)requestWithParams:(ADRequestParameters*)requestParams
 {
     ADAcquireTokenSilentHandler* handler = [ADAcquireTokenSilentHandler new];
@@ -51,7 +85,108 @@
     return handler;
 }
 
+- (id)inflightRequestKey
+{
+    ADUserIdentifier* identifier = [_requestParams identifier];
+    NSNull* null = [NSNull null];
+    // Requests against different caches must not share a result. The data source stays alive
+    // for as long as the request that holds it is in flight, so its address is a stable id.
+    id<ADTokenCacheDataSource> dataSource = [[_requestParams tokenCache] dataSource];
+    return @[ dataSource ? [NSValue valueWithNonretainedObject:dataSource] : null,
+              [_requestParams authority] ? [_requestParams authority] : null,
+              [_requestParams resource] ? [_requestParams resource] : null,
+              [_requestParams clientId] ? [_requestParams clientId] : null,
+              identifier.userId ? identifier.userId : null,
+              @(identifier.type),
+              @([_requestParams extendedLifetime]) ];
+}
+
 - (void)getToken:(ADAuthenticationCallback)completionBlock
+{
+    THROW_ON_NIL_ARGUMENT(completionBlock);
+    [self coalesceRequest:NO completionBlock:completionBlock];
+}
+
+- (void)refreshToken:(ADAuthenticationCallback)completionBlock
+{
+    THROW_ON_NIL_ARGUMENT(completionBlock);
+    [self coalesceRequest:YES completionBlock:completionBlock];
+}
+
+- (void)coalesceRequest:(BOOL)refresh
+        completionBlock:(ADAuthenticationCallback)completionBlock
+{
+    // If somebody else is already getting this exact token then wait for their result, there is
+    // no point in redeeming the same refresh token twice, and doing so can trip over RT rotation.
+    // Background refreshes go through here too, so that they share a redemption with any silent
+    // request for the same token that is in flight at the same time.
+    id key = [self inflightRequestKey];
+    NSMutableDictionary* inflightRequests = [ADAcquireTokenSilentHandler inflightRequests];
+    @synchronized(inflightRequests)
+    {
+        NSMutableArray* waiters = [inflightRequests objectForKey:key];
+        if (waiters)
+        {
+            s_coalescedRequestCount++;
+            [waiters addObject:@[ self, [completionBlock copy], @(refresh) ]];
+            AD_LOG_INFO_F(@"Waiting on silent token request already in flight", [_requestParams correlationId], @"resource: '%@';", [_requestParams resource]);
+            return;
+        }
+        
+        [inflightRequests setObject:[NSMutableArray new] forKey:key];
+    }
+    
+    ADAuthenticationCallback leaderCompletion = ^(ADAuthenticationResult *result)
+    {
+        NSArray* waiters = nil;
+        @synchronized(inflightRequests)
+        {
+            waiters = [inflightRequests objectForKey:key];
+            [inflightRequests removeObjectForKey:key];
+        }
+        
+        // The scheduler tracks the tokens it refreshes itself
+        if (!refresh && result.status == AD_SUCCEEDED && !result.extendedLifeTimeToken)
+        {
+            [[ADTokenRefreshScheduler sharedInstance] trackTokenItem:result.tokenCacheItem requestParams:_requestParams];
+        }
+        
+        completionBlock(result);
+        
+        // A cancelled or timed out result belongs to the request that got it, the requests that
+        // were waiting on it have their own cancellation tokens and get to try for themselves.
+        NSInteger code = result.error.code;
+        BOOL stopped = [result.error.domain isEqualToString:ADAuthenticationErrorDomain] &&
+                       (code == AD_ERROR_REQUEST_CANCELLED || code == AD_ERROR_REQUEST_DEADLINE_EXCEEDED);
+        
+        for (NSArray* waiter in waiters)
+        {
+            ADAcquireTokenSilentHandler* waiterHandler = waiter[0];
+            ADAuthenticationCallback waiterCompletion = waiter[1];
+            if (stopped)
+            {
+                [waiterHandler coalesceRequest:[waiter[2] boolValue] completionBlock:waiterCompletion];
+            }
+            else
+            {
+                // Each waiter gets its own copy of the result, so that its logs and telemetry
+                // carry its own correlation id rather than the one of the request it waited on.
+                waiterCompletion([result resultWithCorrelationId:[waiterHandler->_requestParams correlationId]]);
+            }
+        }
+    };
+    
+    if (refresh)
+    {
+        [self tryMRRT:leaderCompletion];
+    }
+    else
+    {
+        [self getTokenImpl:leaderCompletion];
+    }
+}
+
+- (void)getTokenImpl:(ADAuthenticationCallback)completionBlock
 {
     [self getAccessToken:^(ADAuthenticationResult *result)
      {
@@ -83,10 +218,21 @@
 
 //Obtains an access token from the passed refresh token. If "cacheItem" is passed, updates it with the additional
 //information and updates the cache:
-- (void)acquireTokenByRefreshToken:(NSString*)refreshToken
-                         cacheItem:(ADTokenCacheItem*)cacheItem
-                   completionBlock:(ADAuthenticationCallback)completionBlock
+- (ADWebAuthRequest *)acquireTokenByRefreshToken:(NSString*)refreshToken
+                                       cacheItem:(ADTokenCacheItem*)cacheItem
+                                 completionBlock:(ADAuthenticationCallback)completionBlock
 {
+    // Don't start a redemption the request no longer has time (or reason) to wait for
+    ADAuthenticationError* cancelError = [[_requestParams cancellationToken] errorWithCorrelationId:_requestParams.correlationId];
+    if (cancelError)
+    {
+        ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:cancelError correlationId:_requestParams.correlationId];
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            completionBlock(result);
+        });
+        return nil;
+    }
+    
     [ADLogger logToken:refreshToken
              tokenType:@"RT"
              expiresOn:nil
@@ -149,6 +295,8 @@
          
          completionBlock(result);
      }];
+    
+    return webReq;
 }
 
 - (NSString*)createAccessTokenRequestJWTUsingRT:(ADTokenCacheItem*)cacheItem
@@ -182,15 +330,15 @@
     return returnValue;
 }
 
-- (void)acquireTokenWithItem:(ADTokenCacheItem *)item
-                 refreshType:(NSString *)refreshType
-             completionBlock:(ADAuthenticationCallback)completionBlock
-                    fallback:(ADAuthenticationCallback)fallback
+- (ADWebAuthRequest *)acquireTokenWithItem:(ADTokenCacheItem *)item
+                               refreshType:(NSString *)refreshType
+                           completionBlock:(ADAuthenticationCallback)completionBlock
+                                  fallback:(ADAuthenticationCallback)fallback
 {
     [[ADTelemetry sharedInstance] startEvent:[_requestParams telemetryRequestId] eventName:AD_TELEMETRY_EVENT_TOKEN_GRANT];
-    [self acquireTokenByRefreshToken:item.refreshToken
-                           cacheItem:item
-                     completionBlock:^(ADAuthenticationResult *result)
+    return [self acquireTokenByRefreshToken:item.refreshToken
+                                  cacheItem:item
+                            completionBlock:^(ADAuthenticationResult *result)
      {
          ADTelemetryAPIEvent* event = [[ADTelemetryAPIEvent alloc] initWithName:AD_TELEMETRY_EVENT_TOKEN_GRANT
                                                                         context:_requestParams];
@@ -277,6 +425,7 @@
         // that matches.
         if (!item)
         {
+            [[ADTokenRefreshScheduler sharedInstance] recordLookupForRequestParams:_requestParams hit:NO];
             [self tryMRRT:completionBlock];
             return;
         }
@@ -294,6 +443,7 @@
         [ADAuthenticationResult resultFromTokenCacheItem:item
                                multiResourceRefreshToken:NO
                                            correlationId:correlationId];
+        [[ADTokenRefreshScheduler sharedInstance] recordLookupForRequestParams:_requestParams hit:YES];
         completionBlock(result);
         return;
     }
@@ -304,6 +454,7 @@
         _extendedLifetimeAccessTokenItem = item;
     }
     
+    [[ADTokenRefreshScheduler sharedInstance] recordLookupForRequestParams:_requestParams hit:NO];
     [self tryRT:item completionBlock:completionBlock];
 }
 
@@ -380,6 +531,14 @@
         return;
     }
     
+    // If the MRRT is slow to come back we might want to race the FRT against it
+    ADTokenCacheItem* hedgeItem = [self hedgeItemForMRRT];
+    if (hedgeItem)
+    {
+        [self acquireTokenWithMRRTHedgedBy:hedgeItem completionBlock:completionBlock];
+        return;
+    }
+    
     // Otherwise try the MRRT
     [self acquireTokenWithItem:_mrrtItem
                    refreshType:@"Multi Resource"
@@ -453,6 +612,232 @@
      }];
 }
 
+#pragma mark -
+#pragma mark Hedging
+
++ (void)recordMRRTLatency:(NSTimeInterval)latency
+{
+    @synchronized([ADAcquireTokenSilentHandler class])
+    {
+        s_mrrtLatencies[s_mrrtLatencyCount % HEDGE_LATENCY_SAMPLES] = latency;
+        s_mrrtLatencyCount++;
+    }
+}
+
+// Returns how long to wait on the MRRT before starting on the FRT as well, based off of the
+// configured percentile of the recent MRRT redemption times.
++ (NSTimeInterval)hedgeDelay
+{
+    double percentile = [[ADAuthenticationSettings sharedInstance] refreshHedgingPercentile];
+    
+    NSTimeInterval samples[HEDGE_LATENCY_SAMPLES];
+    NSUInteger count = 0;
+    @synchronized([ADAcquireTokenSilentHandler class])
+    {
+        count = MIN(s_mrrtLatencyCount, (NSUInteger)HEDGE_LATENCY_SAMPLES);
+        memcpy(samples, s_mrrtLatencies, count * sizeof(NSTimeInterval));
+    }
+    
+    if (count < HEDGE_MIN_SAMPLES)
+    {
+        return HEDGE_DEFAULT_DELAY;
+    }
+    
+    // Insertion sort, there's only a handful of samples
+    for (NSUInteger i = 1; i < count; i++)
+    {
+        NSTimeInterval sample = samples[i];
+        NSUInteger j = i;
+        for (; j > 0 && samples[j - 1] > sample; j--)
+        {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = sample;
+    }
+    
+    NSUInteger index = MIN((NSUInteger)(percentile * count), count - 1);
+    return samples[index];
+}
+
+// Returns the FRT to hedge the MRRT redemption with, if hedging is turned on and we have one.
+- (ADTokenCacheItem *)hedgeItemForMRRT
+{
+    double percentile = [[ADAuthenticationSettings sharedInstance] refreshHedgingPercentile];
+    if (percentile <= 0 || percentile > 1 || _attemptedFRT)
+    {
+        return nil;
+    }
+    
+    ADTokenCacheItem* frtItem = [[_requestParams tokenCache] getFRTItemForUser:[_requestParams identifier]
+                                                                      familyId:_mrrtItem.familyId
+                                                                       context:_requestParams
+                                                                         error:nil];
+    if (!frtItem.refreshToken || [frtItem.refreshToken isEqualToString:_mrrtItem.refreshToken])
+    {
+        return nil;
+    }
+    
+    return frtItem;
+}
+
+/*
+ Redeems the MRRT, and if it hasn't come back by the hedge deadline starts redeeming the FRT as well.
+ The first of the two to come back with a token wins and the other one is cancelled. If neither
+ works out the result of the MRRT is returned, same as it would be without hedging.
+ */
+- (void)acquireTokenWithMRRTHedgedBy:(ADTokenCacheItem *)frtItem
+                     completionBlock:(ADAuthenticationCallback)completionBlock
+{
+    __block BOOL finished = NO;
+    __block BOOL mrrtDone = NO;
+    __block BOOL frtStarted = NO;
+    __block BOOL frtDone = NO;
+    __block BOOL mrrtLatencyRecorded = NO;
+    __block ADWebAuthRequest* mrrtRequest = nil;
+    __block ADWebAuthRequest* frtRequest = nil;
+    
+    NSDate* startTime = [NSDate date];
+    NSString* familyId = _mrrtItem.familyId;
+    
+    ADAuthenticationCallback mrrtCallback = ^(ADAuthenticationResult *result)
+    {
+        ADWebAuthRequest* toCancel = nil;
+        BOOL deliver = NO;
+        BOOL tryFRT = NO;
+        @synchronized(self)
+        {
+            mrrtDone = YES;
+            // Recorded even if the FRT already won, leaving the slow redemptions out would bias
+            // the hedge delay low.
+            if (!mrrtLatencyRecorded)
+            {
+                mrrtLatencyRecorded = YES;
+                [ADAcquireTokenSilentHandler recordMRRTLatency:-[startTime timeIntervalSinceNow]];
+            }
+            
+            if (finished)
+            {
+                return;
+            }
+            
+            if (result.status == AD_SUCCEEDED)
+            {
+                finished = deliver = YES;
+                toCancel = frtRequest;
+            }
+            else
+            {
+                _mrrtItem = nil;
+                _mrrtResult = result;
+                
+                if (frtStarted)
+                {
+                    // Let the FRT have its say, unless it already has
+                    finished = deliver = frtDone;
+                }
+                else if ([ADAuthenticationContext isFinalResult:result])
+                {
+                    finished = deliver = YES;
+                }
+                else
+                {
+                    finished = tryFRT = YES;
+                }
+            }
+        }
+        
+        [toCancel cancel];
+        if (deliver)
+        {
+            completionBlock(result);
+        }
+        else if (tryFRT)
+        {
+            [self tryFRT:familyId completionBlock:completionBlock];
+        }
+    };
+    
+    ADAuthenticationCallback frtCallback = ^(ADAuthenticationResult *result)
+    {
+        ADWebAuthRequest* toCancel = nil;
+        ADAuthenticationResult* toDeliver = nil;
+        BOOL deliver = NO;
+        @synchronized(self)
+        {
+            frtDone = YES;
+            if (finished)
+            {
+                return;
+            }
+            
+            if (result.status == AD_SUCCEEDED)
+            {
+                finished = deliver = YES;
+                toDeliver = result;
+                toCancel = mrrtRequest;
+                
+                if (!mrrtDone && !mrrtLatencyRecorded)
+                {
+                    // The MRRT is cancelled, it would have taken at least this long
+                    mrrtLatencyRecorded = YES;
+                    [ADAcquireTokenSilentHandler recordMRRTLatency:-[startTime timeIntervalSinceNow]];
+                }
+            }
+            else if (mrrtDone)
+            {
+                // The MRRT already failed, go with its result like we would without hedging
+                finished = deliver = YES;
+                toDeliver = _mrrtResult;
+            }
+        }
+        
+        [toCancel cancel];
+        if (deliver)
+        {
+            completionBlock(toDeliver);
+        }
+    };
+    
+    ADWebAuthRequest* request = [self acquireTokenWithItem:_mrrtItem
+                                               refreshType:@"Multi Resource"
+                                           completionBlock:mrrtCallback
+                                                  fallback:mrrtCallback];
+    @synchronized(self)
+    {
+        mrrtRequest = request;
+    }
+    
+    NSTimeInterval delay = [ADAcquireTokenSilentHandler hedgeDelay];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        @synchronized(self)
+        {
+            if (mrrtDone || finished)
+            {
+                return;
+            }
+            frtStarted = YES;
+            _attemptedFRT = YES;
+        }
+        
+        AD_LOG_INFO_F(@"MRRT redemption is slow, hedging with FRT", [_requestParams correlationId], @"delay: %.3f", delay);
+        ADWebAuthRequest* hedgeRequest = [self acquireTokenWithItem:frtItem
+                                                        refreshType:@"Family"
+                                                    completionBlock:frtCallback
+                                                           fallback:frtCallback];
+        BOOL cancel = NO;
+        @synchronized(self)
+        {
+            frtRequest = hedgeRequest;
+            // The MRRT came back with a token while we were getting the FRT request going
+            cancel = finished && mrrtDone;
+        }
+        if (cancel)
+        {
+            [hedgeRequest cancel];
+        }
+    });
+}
+
 - (BOOL) isServerUnavailable:(ADAuthenticationResult *)result
 {
     if (![[result.error domain] isEqualToString:ADHTTPErrorCodeDomain])
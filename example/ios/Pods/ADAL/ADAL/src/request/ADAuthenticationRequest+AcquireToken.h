@@ -28,6 +28,16 @@
 - (void)acquireToken:(NSString *)apiId
      completionBlock:(ADAuthenticationCallback)completionBlock;
 
+/*!
+    Goes through the same checks as a silent acquireToken: (cancellation, authority validation)
+    and then looks up the access tokens for all of the resources with a single cache read. The
+    results only have the resources that had a valid access token in the cache, unless the
+    request failed before the cache was read, in which case every resource gets the error.
+ */
+- (void)acquireTokensFromCacheForResources:(NSArray<NSString *> *)resources
+                                     apiId:(NSString *)apiId
+                           completionBlock:(ADBatchAuthenticationCallback)completionBlock;
+
 // For use after the authority has been validated
 - (void)validatedAcquireToken:(ADAuthenticationCallback)completionBlock;
 
@@ -35,6 +35,9 @@
 #import "ADTelemetryBrokerEvent.h"
 #import "ADTelemetryEventStrings.h"
 #import "ADBrokerHelper.h"
+#import "ADCancellationToken.h"
+#import "ADAuthenticationSettings.h"
+#import "ADTokenRefreshScheduler.h"
 
 @implementation ADAuthenticationRequest (AcquireToken)
 
@@ -50,7 +53,7 @@
     
     AD_REQUEST_CHECK_ARGUMENT([_requestParams resource]);
     [self ensureRequest];
-    NSString* telemetryRequestId = [_requestParams telemetryRequestId];
+    [self ensureCancellationToken];
     
     __block NSString* log = [NSString stringWithFormat:@"##### BEGIN acquireToken%@ (authority = %@, resource = %@, clientId = %@, idtype = %@) #####",
                              _silent ? @"Silent" : @"", _requestParams.authority, _requestParams.resource, _requestParams.clientId, [_requestParams.identifier typeAsString]];
@@ -73,32 +76,7 @@
         
         AD_LOG_INFO(finalLog, result.correlationId, nil);
         
-        ADTelemetryAPIEvent* event = [[ADTelemetryAPIEvent alloc] initWithName:AD_TELEMETRY_EVENT_API_EVENT
-                                                                       context:self];
-        [event setApiId:apiId];
-        
-        [event setCorrelationId:self.correlationId];
-        [event setClientId:_requestParams.clientId];
-        [event setAuthority:_context.authority];
-        [event setExtendedExpiresOnSetting:[_requestParams extendedLifetime]? AD_TELEMETRY_VALUE_YES:AD_TELEMETRY_VALUE_NO];
-        [event setPromptBehavior:_promptBehavior];
-        if ([result tokenCacheItem])
-        {
-            [event setUserInformation:result.tokenCacheItem.userInformation];
-        }
-        else
-        {
-            [event setUserId:_requestParams.identifier.userId];
-        }
-        [event setResultStatus:result.status];
-        [event setIsExtendedLifeTimeToken:[result extendedLifeTimeToken]? AD_TELEMETRY_VALUE_YES:AD_TELEMETRY_VALUE_NO];
-        [event setErrorCode:[NSString stringWithFormat:@"%ld",(long)[result.error code]]];
-        [event setErrorDomain:[result.error domain]];
-        [event setProtocolCode:[[result error] protocolCode]];
-        
-        [[ADTelemetry sharedInstance] stopEvent:self.telemetryRequestId event:event];
-        //flush all events in the end of the acquireToken call
-        [[ADTelemetry sharedInstance] flush:self.telemetryRequestId];
+        [self stopAPIEvent:apiId result:result];
         
         completionBlock(result);
     };
@@ -137,12 +115,154 @@
         return;
     }
     
+    if ([self checkCancellation:wrappedCallback])
+    {
+        return;
+    }
+    
+    [self validateAuthority:^(ADAuthenticationError *error)
+     {
+         if (error)
+         {
+             wrappedCallback([ADAuthenticationResult resultFromError:error correlationId:_requestParams.correlationId]);
+         }
+         else if (![self checkCancellation:wrappedCallback])
+         {
+             [self validatedAcquireToken:wrappedCallback];
+         }
+     }];
+}
+
+- (void)acquireTokensFromCacheForResources:(NSArray<NSString *> *)resources
+                                     apiId:(NSString *)apiId
+                           completionBlock:(ADBatchAuthenticationCallback)completionBlock
+{
+    THROW_ON_NIL_ARGUMENT(completionBlock);
+    [[ADTelemetry sharedInstance] startEvent:self.telemetryRequestId
+                                   eventName:AD_TELEMETRY_EVENT_API_EVENT];
+    
+    [self ensureRequest];
+    [self ensureCancellationToken];
+    
+    AD_LOG_INFO_F(@"##### BEGIN batch cache lookup #####", _requestParams.correlationId, @"resources: %lu; userId = %@", (unsigned long)resources.count, _requestParams.identifier.userId);
+    
+    // A failure before the cache was read is the answer for every resource, the same as it would
+    // have been for each of their single resource requests.
+    void (^fail)(ADAuthenticationError *) = ^(ADAuthenticationError *error)
+    {
+        ADAuthenticationResult* result = [ADAuthenticationResult resultFromError:error correlationId:_requestParams.correlationId];
+        [self stopAPIEvent:apiId result:result];
+        
+        NSMutableDictionary* results = [NSMutableDictionary new];
+        for (NSString* resource in resources)
+        {
+            [results setObject:result forKey:resource];
+        }
+        completionBlock(results);
+    };
+    
+    ADAuthenticationError* cancelError = [[_requestParams cancellationToken] errorWithCorrelationId:_requestParams.correlationId];
+    if (cancelError)
+    {
+        fail(cancelError);
+        return;
+    }
+    
+    [self validateAuthority:^(ADAuthenticationError *error)
+     {
+         ADAuthenticationError* stopError = error ? error : [[_requestParams cancellationToken] errorWithCorrelationId:_requestParams.correlationId];
+         if (stopError)
+         {
+             fail(stopError);
+             return;
+         }
+         
+         NSDictionary* results = [self accessTokensFromCacheForResources:resources];
+         [self stopAPIEvent:apiId result:[[results allValues] firstObject]];
+         completionBlock(results);
+     }];
+}
+
+// Returns the results for the resources that have a valid access token in the cache, read with
+// a single lookup. Resources that need anything more than returning a cached access token (an
+// expired token, an ambiguous user) are left out for their single resource requests to handle.
+- (NSDictionary<NSString *, ADAuthenticationResult *> *)accessTokensFromCacheForResources:(NSArray<NSString *> *)resources
+{
+    NSDictionary* items = [[_requestParams tokenCache] getATItemsForUser:[_requestParams identifier]
+                                                               resources:resources
+                                                                clientId:[_requestParams clientId]
+                                                                 context:_requestParams
+                                                                   error:nil];
+    
+    NSMutableDictionary* validItems = [NSMutableDictionary new];
+    NSMutableSet* userIds = [NSMutableSet new];
+    for (NSString* resource in items)
+    {
+        ADTokenCacheItem* item = [items objectForKey:resource];
+        if (item.isExpired)
+        {
+            continue;
+        }
+        
+        NSString* userId = item.userInformation.userId;
+        [userIds addObject:userId ? userId : @""];
+        [validItems setObject:item forKey:resource];
+    }
+    
+    // Without a user each resource was matched on its own, so the tokens can belong to different
+    // users. The single resource requests fail with AD_ERROR_CACHE_MULTIPLE_USERS in that case.
+    if (![[_requestParams identifier] userId] && userIds.count > 1)
+    {
+        AD_LOG_INFO(@"Cached tokens belong to more than one user, skipping batch cache lookup", _requestParams.correlationId, nil);
+        return @{};
+    }
+    
+    NSMutableDictionary* results = [NSMutableDictionary new];
+    for (NSString* resource in validItems)
+    {
+        ADTokenCacheItem* item = [validItems objectForKey:resource];
+        [ADLogger logToken:item.accessToken
+                 tokenType:@"AT"
+                 expiresOn:item.expiresOn
+                   context:@"Returning"
+             correlationId:_requestParams.correlationId];
+        
+        ADRequestParameters* params = [_requestParams copy];
+        [params setResource:resource];
+        [[ADTokenRefreshScheduler sharedInstance] recordLookupForRequestParams:params hit:YES];
+        
+        [results setObject:[ADAuthenticationResult resultFromTokenCacheItem:item
+                                                  multiResourceRefreshToken:NO
+                                                              correlationId:_requestParams.correlationId]
+                    forKey:resource];
+    }
+    
+    return results;
+}
+
+- (void)ensureCancellationToken
+{
+    if ([_requestParams cancellationToken])
+    {
+        return;
+    }
+    
+    // Only silent requests get a deadline, interactive ones wait on the user
+    NSTimeInterval deadline = _silent ? [[ADAuthenticationSettings sharedInstance] requestDeadline] : 0;
+    ADCancellationToken* token = [ADCancellationToken tokenWithTimeout:deadline];
+    [_requestParams setCancellationToken:token];
+    [_context registerCancellationToken:token];
+}
+
+- (void)validateAuthority:(void (^)(ADAuthenticationError *error))completionBlock
+{
     if (!_context.validateAuthority)
     {
-        [self validatedAcquireToken:wrappedCallback];
+        completionBlock(nil);
         return;
     }
     
+    NSString* telemetryRequestId = [_requestParams telemetryRequestId];
     [[ADTelemetry sharedInstance] startEvent:telemetryRequestId eventName:AD_TELEMETRY_EVENT_AUTHORITY_VALIDATION];
     
     ADAuthorityValidation* authorityValidation = [ADAuthorityValidation sharedInstance];
@@ -154,16 +274,60 @@
          [event setAuthorityValidationStatus:validated ? AD_TELEMETRY_VALUE_YES:AD_TELEMETRY_VALUE_NO];
          [event setAuthority:_context.authority];
          [[ADTelemetry sharedInstance] stopEvent:telemetryRequestId event:event];
-         if (error)
-         {
-             wrappedCallback([ADAuthenticationResult resultFromError:error correlationId:_requestParams.correlationId]);
-         }
-         else
-         {
-             [self validatedAcquireToken:wrappedCallback];
-         }
+         completionBlock(error);
      }];
+}
+
+// Reports the API event for the request, started when it was kicked off, and flushes all of its
+// telemetry. A nil result means the request came back without a token.
+- (void)stopAPIEvent:(NSString *)apiId
+              result:(ADAuthenticationResult *)result
+{
+    ADTelemetryAPIEvent* event = [[ADTelemetryAPIEvent alloc] initWithName:AD_TELEMETRY_EVENT_API_EVENT
+                                                                   context:self];
+    [event setApiId:apiId];
     
+    [event setCorrelationId:self.correlationId];
+    [event setClientId:_requestParams.clientId];
+    [event setAuthority:_context.authority];
+    [event setExtendedExpiresOnSetting:[_requestParams extendedLifetime]? AD_TELEMETRY_VALUE_YES:AD_TELEMETRY_VALUE_NO];
+    [event setPromptBehavior:_promptBehavior];
+    if ([result tokenCacheItem])
+    {
+        [event setUserInformation:result.tokenCacheItem.userInformation];
+    }
+    else
+    {
+        [event setUserId:_requestParams.identifier.userId];
+    }
+    [event setResultStatus:result ? result.status : AD_FAILED];
+    [event setIsExtendedLifeTimeToken:[result extendedLifeTimeToken]? AD_TELEMETRY_VALUE_YES:AD_TELEMETRY_VALUE_NO];
+    [event setErrorCode:[NSString stringWithFormat:@"%ld",(long)[result.error code]]];
+    [event setErrorDomain:[result.error domain]];
+    [event setProtocolCode:[[result error] protocolCode]];
+    
+    [[ADTelemetry sharedInstance] stopEvent:self.telemetryRequestId event:event];
+    //flush all events in the end of the acquireToken call
+    [[ADTelemetry sharedInstance] flush:self.telemetryRequestId];
+}
+
+/*!
+    Finishes the request with the cancellation error if it was cancelled or ran past its
+    deadline. Called between stages so a stopped request doesn't start any more work.
+ 
+    @return YES if the request was stopped and completionBlock was called
+ */
+- (BOOL)checkCancellation:(ADAuthenticationCallback)completionBlock
+{
+    ADAuthenticationError* error = [[_requestParams cancellationToken] errorWithCorrelationId:_requestParams.correlationId];
+    if (!error)
+    {
+        return NO;
+    }
+    
+    AD_LOG_WARN(@"Request stopped before it finished", _requestParams.correlationId, error.errorDetails);
+    completionBlock([ADAuthenticationResult resultFromError:error correlationId:_requestParams.correlationId]);
+    return YES;
 }
 
 - (BOOL)checkExtraQueryParameters
@@ -204,6 +368,11 @@
             
             _underlyingError = result.error;
             
+            if ([self checkCancellation:completionBlock])
+            {
+                return;
+            }
+            
             [self requestToken:completionBlock];
         }];
         return;
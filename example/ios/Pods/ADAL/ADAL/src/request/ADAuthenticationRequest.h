@@ -28,6 +28,7 @@
 
 @class ADUserIdentifier;
 @class ADTokenCacheAccessor;
+@class ADCancellationToken;
 
 #define AD_REQUEST_CHECK_ARGUMENT(_arg) { \
     if (!_arg || ([_arg isKindOfClass:[NSString class]] && [(NSString*)_arg isEqualToString:@""])) { \
@@ -101,6 +102,7 @@
 - (NSUUID*)correlationId;
 - (NSString*)telemetryRequestId;
 - (ADRequestParameters*)requestParams;
+- (ADCancellationToken*)cancellationToken;
 #if AD_BROKER
 - (NSString*)redirectUri;
 - (void)setRedirectUri:(NSString*)redirectUri;
@@ -273,6 +273,11 @@ static dispatch_semaphore_t s_interactionLock = nil;
     return _requestParams;
 }
 
+- (ADCancellationToken*)cancellationToken
+{
+    return [_requestParams cancellationToken];
+}
+
 /*!
     Takes the UI interaction lock for the current request, will send an error
     to completionBlock if it fails.
@@ -0,0 +1,60 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+@class ADRequestParameters;
+@class ADTokenCacheItem;
+
+/*!
+    Keeps access tokens that were recently handed out by silent requests fresh, by redeeming the
+    MRRT in the background shortly before they expire. Only active when
+    ADAuthenticationSettings.enableBackgroundRefresh is set.
+ */
+@interface ADTokenRefreshScheduler : NSObject
+
++ (ADTokenRefreshScheduler *)sharedInstance;
+
+/*!
+    Starts (or keeps) tracking the token returned for the given request, and schedules a
+    refresh ahead of its expiration.
+ */
+- (void)trackTokenItem:(ADTokenCacheItem *)item
+         requestParams:(ADRequestParameters *)requestParams;
+
+/*!
+    Records whether a silent request for the given parameters found a valid access token in
+    the cache. Requests for tokens that aren't being tracked aren't counted.
+ */
+- (void)recordLookupForRequestParams:(ADRequestParameters *)requestParams
+                                 hit:(BOOL)hit;
+
+/*! Silent requests for tracked tokens that found a valid access token in the cache. */
+@property (readonly) NSUInteger hitCount;
+/*! Silent requests for tracked tokens that had to go to the network. */
+@property (readonly) NSUInteger missCount;
+/*! Background refreshes that got a new access token, and the ones that did not. */
+@property (readonly) NSUInteger refreshCount;
+@property (readonly) NSUInteger refreshFailureCount;
+
+@end
@@ -0,0 +1,315 @@
+// Copyright (c) Microsoft Corporation.
+// All rights reserved.
+//
+// This code is licensed under the MIT License.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import "ADTokenRefreshScheduler.h"
+#import "ADAcquireTokenSilentHandler.h"
+#import "ADAuthenticationSettings.h"
+#import "ADCancellationToken.h"
+#import "ADRequestParameters.h"
+#import "ADTokenCacheItem.h"
+#import "ADUserIdentifier.h"
+#import "ADTelemetry.h"
+#import "ADTelemetry+Internal.h"
+
+// Tokens are refreshed this many seconds (plus jitter) before they would be considered expired
+#define REFRESH_LEAD_TIME 60
+#define REFRESH_MAX_JITTER 60
+// Tokens that haven't been asked for in this long are no longer kept fresh
+#define REFRESH_TRACKING_WINDOW (60 * 60)
+#define REFRESH_MAX_TRACKED_TOKENS 32
+#define REFRESH_MAX_CONCURRENT 2
+#define REFRESH_RETRY_DELAY 5
+
+@interface ADTokenRefreshEntry : NSObject
+{
+@public
+    ADRequestParameters* _requestParams;
+    NSDate* _expiresOn;
+    NSDate* _lastUsed;
+    NSUInteger _generation;
+}
+@end
+
+@implementation ADTokenRefreshEntry
+@end
+
+@implementation ADTokenRefreshScheduler
+{
+    dispatch_queue_t _queue;
+    NSMutableDictionary* _entries;
+    NSUInteger _refreshesInFlight;
+    
+    NSUInteger _hitCount;
+    NSUInteger _missCount;
+    NSUInteger _refreshCount;
+    NSUInteger _refreshFailureCount;
+}
+
++ (ADTokenRefreshScheduler *)sharedInstance
+{
+    static ADTokenRefreshScheduler* s_instance = nil;
+    static dispatch_once_t s_once;
+    
+    dispatch_once(&s_once, ^{
+        s_instance = [ADTokenRefreshScheduler new];
+    });
+    
+    return s_instance;
+}
+
+- (id)init
+{
+    if (!(self = [super init]))
+    {
+        return nil;
+    }
+    
+    _queue = dispatch_queue_create("com.microsoft.adal.refreshscheduler", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+    _entries = [NSMutableDictionary new];
+    
+    return self;
+}
+
++ (id)keyForRequestParams:(ADRequestParameters *)requestParams
+{
+    NSNull* null = [NSNull null];
+    NSString* userId = [[requestParams identifier] userId];
+    return @[ [requestParams authority] ? [requestParams authority] : null,
+              [requestParams resource] ? [requestParams resource] : null,
+              [requestParams clientId] ? [requestParams clientId] : null,
+              userId ? userId : null ];
+}
+
+#pragma mark -
+#pragma mark Tracking
+
+- (void)trackTokenItem:(ADTokenCacheItem *)item
+         requestParams:(ADRequestParameters *)requestParams
+{
+    if (![[ADAuthenticationSettings sharedInstance] enableBackgroundRefresh])
+    {
+        return;
+    }
+    
+    // Without a user there's no MRRT to refresh with
+    NSDate* expiresOn = item.expiresOn;
+    if (!expiresOn || ![[requestParams identifier] userId])
+    {
+        return;
+    }
+    
+    ADRequestParameters* params = [requestParams copy];
+    dispatch_async(_queue, ^{
+        id key = [ADTokenRefreshScheduler keyForRequestParams:params];
+        ADTokenRefreshEntry* entry = [_entries objectForKey:key];
+        if (!entry)
+        {
+            if (_entries.count >= REFRESH_MAX_TRACKED_TOKENS)
+            {
+                [self evictLeastRecentlyUsed];
+            }
+            entry = [ADTokenRefreshEntry new];
+            [_entries setObject:entry forKey:key];
+        }
+        
+        entry->_requestParams = params;
+        entry->_lastUsed = [NSDate date];
+        if ([entry->_expiresOn isEqualToDate:expiresOn])
+        {
+            // Already scheduled for this token
+            return;
+        }
+        
+        entry->_expiresOn = expiresOn;
+        NSTimeInterval delay = [expiresOn timeIntervalSinceNow] - [[ADAuthenticationSettings sharedInstance] expirationBuffer] - REFRESH_LEAD_TIME;
+        [self scheduleRefreshForKey:key entry:entry delay:delay];
+    });
+}
+
+- (void)recordLookupForRequestParams:(ADRequestParameters *)requestParams
+                                 hit:(BOOL)hit
+{
+    if (![[ADAuthenticationSettings sharedInstance] enableBackgroundRefresh])
+    {
+        return;
+    }
+    
+    id key = [ADTokenRefreshScheduler keyForRequestParams:requestParams];
+    dispatch_async(_queue, ^{
+        ADTokenRefreshEntry* entry = [_entries objectForKey:key];
+        if (!entry)
+        {
+            return;
+        }
+        
+        entry->_lastUsed = [NSDate date];
+        if (hit)
+        {
+            _hitCount++;
+        }
+        else
+        {
+            _missCount++;
+        }
+    });
+}
+
+// Must be called on _queue
+- (void)evictLeastRecentlyUsed
+{
+    id oldestKey = nil;
+    NSDate* oldest = nil;
+    for (id key in _entries)
+    {
+        ADTokenRefreshEntry* entry = [_entries objectForKey:key];
+        if (!oldest || [entry->_lastUsed compare:oldest] == NSOrderedAscending)
+        {
+            oldest = entry->_lastUsed;
+            oldestKey = key;
+        }
+    }
+    
+    if (oldestKey)
+    {
+        [_entries removeObjectForKey:oldestKey];
+    }
+}
+
+#pragma mark -
+#pragma mark Refreshing
+
+// Must be called on _queue
+- (void)scheduleRefreshForKey:(id)key
+                        entry:(ADTokenRefreshEntry *)entry
+                        delay:(NSTimeInterval)delay
+{
+    // Spread the refreshes out so that tokens that were acquired together don't all hit the
+    // token endpoint at the same moment.
+    delay = MAX(delay, 0) + arc4random_uniform(REFRESH_MAX_JITTER);
+    NSUInteger generation = ++entry->_generation;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), _queue, ^{
+        ADTokenRefreshEntry* current = [_entries objectForKey:key];
+        if (current != entry || entry->_generation != generation)
+        {
+            // The token was refreshed or dropped in the meantime
+            return;
+        }
+        
+        [self refreshKey:key entry:entry];
+    });
+}
+
+// Must be called on _queue
+- (void)refreshKey:(id)key
+             entry:(ADTokenRefreshEntry *)entry
+{
+    ADAuthenticationSettings* settings = [ADAuthenticationSettings sharedInstance];
+    if (![settings enableBackgroundRefresh]
+        || -[entry->_lastUsed timeIntervalSinceNow] > REFRESH_TRACKING_WINDOW)
+    {
+        [_entries removeObjectForKey:key];
+        return;
+    }
+    
+    BOOL (^condition)(void) = [settings backgroundRefreshCondition];
+    if (_refreshesInFlight >= REFRESH_MAX_CONCURRENT || (condition && !condition()))
+    {
+        [self scheduleRefreshForKey:key entry:entry delay:REFRESH_RETRY_DELAY];
+        return;
+    }
+    
+    _refreshesInFlight++;
+    
+    ADRequestParameters* params = [entry->_requestParams copy];
+    [params setCorrelationId:[NSUUID UUID]];
+    [params setTelemetryRequestId:[[ADTelemetry sharedInstance] registerNewRequest]];
+    // The refresh is a request of its own, its deadline starts now
+    [params setCancellationToken:[ADCancellationToken tokenWithTimeout:[settings requestDeadline]]];
+    
+    AD_LOG_VERBOSE_F(@"Refreshing access token in the background", [params correlationId], @"resource: '%@';", [params resource]);
+    
+    ADAcquireTokenSilentHandler* handler = [ADAcquireTokenSilentHandler requestWithParams:params];
+    [handler refreshToken:^(ADAuthenticationResult *result)
+     {
+         [[ADTelemetry sharedInstance] flush:[params telemetryRequestId]];
+         
+         dispatch_async(_queue, ^{
+             _refreshesInFlight--;
+             
+             NSDate* expiresOn = result.tokenCacheItem.expiresOn;
+             if (result.status != AD_SUCCEEDED || !expiresOn)
+             {
+                 // Leave it to the next silent request to sort out
+                 _refreshFailureCount++;
+                 if ([_entries objectForKey:key] == entry)
+                 {
+                     [_entries removeObjectForKey:key];
+                 }
+                 return;
+             }
+             
+             _refreshCount++;
+             if ([_entries objectForKey:key] == entry)
+             {
+                 entry->_expiresOn = expiresOn;
+                 NSTimeInterval delay = [expiresOn timeIntervalSinceNow] - [settings expirationBuffer] - REFRESH_LEAD_TIME;
+                 [self scheduleRefreshForKey:key entry:entry delay:delay];
+             }
+         });
+     }];
+}
+
+#pragma mark -
+#pragma mark Metrics
+
+- (NSUInteger)hitCount
+{
+    __block NSUInteger count = 0;
+    dispatch_sync(_queue, ^{ count = _hitCount; });
+    return count;
+}
+
+- (NSUInteger)missCount
+{
+    __block NSUInteger count = 0;
+    dispatch_sync(_queue, ^{ count = _missCount; });
+    return count;
+}
+
+- (NSUInteger)refreshCount
+{
+    __block NSUInteger count = 0;
+    dispatch_sync(_queue, ^{ count = _refreshCount; });
+    return count;
+}
+
+- (NSUInteger)refreshFailureCount
+{
+    __block NSUInteger count = 0;
+    dispatch_sync(_queue, ^{ count = _refreshFailureCount; });
+    return count;
+}
+
+@end
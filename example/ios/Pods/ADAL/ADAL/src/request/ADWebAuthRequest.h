@@ -29,6 +29,7 @@
     BOOL _retryIfServerError;
     BOOL _returnRawResponse;
     BOOL _acceptOnlyOKResponse;
+    NSUInteger _retryCount;
     
     NSMutableDictionary* _responseDictionary;
     
@@ -41,6 +42,9 @@
 @property BOOL retryIfServerError;
 @property BOOL acceptOnlyOKResponse;
 
+/*! The number of times the request has been resent by the retry policy. */
+@property NSUInteger retryCount;
+
 @property (readonly) NSDate* startTime;
 @property (copy) NSDictionary<NSString *, NSString *> * requestDictionary;
 
@@ -36,6 +36,7 @@
 @synthesize retryIfServerError = _retryIfServerError;
 @synthesize startTime = _startTime;
 @synthesize acceptOnlyOKResponse = _acceptOnlyOKResponse;
+@synthesize retryCount = _retryCount;
 
 - (id)initWithURL:(NSURL *)url
           context:(id<ADRequestContext>)context
@@ -64,17 +65,18 @@
     }
     else
     {
-        [self setBody:[[_requestDictionary adURLFormEncode] dataUsingEncoding:NSUTF8StringEncoding]];
+        [self setBody:[_requestDictionary adURLFormEncodedData]];
     }
     
     _startTime = [NSDate new];
+    _retryCount = 0;
     [[ADClientMetrics getInstance] addClientMetrics:self.headers endpoint:[_requestURL absoluteString]];
     
     [self send:^( NSError *error, ADWebResponse *webResponse )
     {
         if (error)
         {
-            [ADWebAuthResponse processError:error correlationId:_correlationId completion:completionBlock];
+            [ADWebAuthResponse processError:error request:self completion:completionBlock];
         }
         else
         {
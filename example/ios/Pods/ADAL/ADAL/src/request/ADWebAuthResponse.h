@@ -37,7 +37,7 @@ typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
 }
 
 + (void)processError:(NSError *)error
-       correlationId:(NSUUID *)correlationId
+             request:(ADWebAuthRequest *)request
           completion:(ADWebResponseCallback)completionBlock;
 
 + (void)processResponse:(ADWebResponse *)webResponse
@@ -46,4 +46,8 @@ typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
 
 + (NSDictionary *)parseAuthHeader:(NSString *)authHeader;
 
+/*! Returns the number of seconds the server asked to wait in the Retry-After header, which
+    can either be a number of seconds or an HTTP date. Returns 0 if there is no usable value. */
++ (NSTimeInterval)retryAfterFromResponse:(ADWebResponse *)webResponse;
+
 @end
@@ -29,15 +29,31 @@
 #import "ADWorkplaceJoinConstants.h"
 #import "ADPKeyAuthHelper.h"
 #import "ADClientMetrics.h"
+#import "ADAuthenticationSettings.h"
+#import "ADCancellationToken.h"
 
 @implementation ADWebAuthResponse
 
 + (void)processError:(NSError *)error
-       correlationId:(NSUUID *)correlationId
+             request:(ADWebAuthRequest *)request
           completion:(ADWebResponseCallback)completionBlock
 {
     ADWebAuthResponse* response = [ADWebAuthResponse new];
-    response->_correlationId = correlationId;
+    response->_request = request;
+    response->_correlationId = request.correlationId;
+    
+    // Report a request cancelled through its token as such, rather than as a network error
+    ADAuthenticationError* cancelError = [request.cancellationToken errorWithCorrelationId:request.correlationId];
+    if (cancelError)
+    {
+        [response handleADError:cancelError completionBlock:completionBlock];
+        return;
+    }
+    
+    if ([ADWebAuthResponse isRetryableError:error request:request] && [response retryWithResponse:nil])
+    {
+        return;
+    }
     
     [response handleNSError:error completionBlock:completionBlock];
 }
@@ -259,13 +275,8 @@
         {
             //retry if it is a server error
             //500, 503 and 504 are the ones we retry
-            if (_request.retryIfServerError)
+            if ([self retryWithResponse:webResponse])
             {
-                _request.retryIfServerError = NO;
-                //retry once after half second
-                dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.5 * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-                    [_request resend];
-                });
                 return;
             }
             //no "break;" here
@@ -274,9 +285,12 @@
         default:
         {
             // Request failure
-            NSString* body = [[NSString alloc] initWithData:webResponse.body encoding:NSUTF8StringEncoding];
-            NSString* errorData = [NSString stringWithFormat:@"Full response: %@", body];
-            AD_LOG_WARN(([NSString stringWithFormat:@"HTTP Error %ld", (long)webResponse.statusCode]), _correlationId, errorData);
+            if ([ADLogger isLevelEnabled:ADAL_LOG_LEVEL_WARN])
+            {
+                NSString* body = [[NSString alloc] initWithData:webResponse.body encoding:NSUTF8StringEncoding];
+                NSString* errorData = [NSString stringWithFormat:@"Full response: %@", body];
+                AD_LOG_WARN(([NSString stringWithFormat:@"HTTP Error %ld", (long)webResponse.statusCode]), _correlationId, errorData);
+            }
             
             ADAuthenticationError* adError = [ADAuthenticationError HTTPErrorCode:webResponse.statusCode
                                                                              body:[NSString stringWithFormat:@"(%lu bytes)", (unsigned long)webResponse.body.length]
@@ -288,6 +302,133 @@
     }
 }
 
+#pragma mark -
+#pragma mark Retries
+
+// Token requests are POSTs that redeem codes and refresh tokens, which the server might have
+// acted on even if we never saw the response, so they are only retried when the request never
+// left the device. The GETs (instance discovery, DRS and WebFinger) are safe to send again.
++ (BOOL)isRetryableError:(NSError *)error
+                 request:(ADWebAuthRequest *)request
+{
+    if (![[error domain] isEqualToString:NSURLErrorDomain])
+    {
+        return NO;
+    }
+    
+    switch ([error code])
+    {
+        case NSURLErrorCannotFindHost:
+        case NSURLErrorCannotConnectToHost:
+        case NSURLErrorDNSLookupFailed:
+            return YES;
+        case NSURLErrorTimedOut:
+        case NSURLErrorNetworkConnectionLost:
+            return request.isGetRequest;
+        default:
+            return NO;
+    }
+}
+
++ (NSTimeInterval)retryAfterFromResponse:(ADWebResponse *)webResponse
+{
+    NSString* retryAfter = [webResponse.headers objectForKey:@"Retry-After"];
+    if ([NSString adIsStringNilOrBlank:retryAfter])
+    {
+        return 0;
+    }
+    
+    retryAfter = [retryAfter adTrimmedString];
+    NSScanner* scanner = [NSScanner scannerWithString:retryAfter];
+    NSInteger seconds = 0;
+    if ([scanner scanInteger:&seconds] && [scanner isAtEnd])
+    {
+        return seconds > 0 ? seconds : 0;
+    }
+    
+    static NSDateFormatter* s_httpDateFormatter = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        s_httpDateFormatter = [NSDateFormatter new];
+        s_httpDateFormatter.locale = [NSLocale localeWithLocaleIdentifier:@"en_US_POSIX"];
+        s_httpDateFormatter.timeZone = [NSTimeZone timeZoneWithAbbreviation:@"GMT"];
+        s_httpDateFormatter.dateFormat = @"EEE',' dd MMM yyyy HH':'mm':'ss zzz";
+    });
+    
+    NSDate* date = nil;
+    // NSDateFormatter is only thread safe for reads on recent OS versions
+    @synchronized(s_httpDateFormatter)
+    {
+        date = [s_httpDateFormatter dateFromString:retryAfter];
+    }
+    
+    NSTimeInterval interval = [date timeIntervalSinceNow];
+    return interval > 0 ? interval : 0;
+}
+
+/*! Resends the request after a backoff if the retry policy in ADAuthenticationSettings allows
+    it. Returns NO if the request is not going to be retried and the failure should be handled. */
+- (BOOL)retryWithResponse:(ADWebResponse *)webResponse
+{
+    if (!_request.retryIfServerError)
+    {
+        return NO;
+    }
+    
+    ADAuthenticationSettings* settings = [ADAuthenticationSettings sharedInstance];
+    NSUInteger retryCount = _request.retryCount;
+    if (retryCount + 1 >= settings.maxRequestAttempts)
+    {
+        return NO;
+    }
+    
+    // A server error on a token request could mean the grant was already redeemed, so those
+    // only get the single retry ADAL has always done.
+    if (webResponse && !_request.isGetRequest && retryCount > 0)
+    {
+        return NO;
+    }
+    
+    // Exponential backoff with full jitter, so that clients failing at the same time don't all
+    // come back at the same time
+    NSTimeInterval backoff = settings.retryBaseDelay * pow(2, retryCount);
+    if (backoff > settings.retryMaxDelay)
+    {
+        backoff = settings.retryMaxDelay;
+    }
+    NSTimeInterval delay = backoff * ((double)arc4random_uniform(1001) / 1000.0);
+    
+    NSTimeInterval retryAfter = [ADWebAuthResponse retryAfterFromResponse:webResponse];
+    if (retryAfter > delay)
+    {
+        delay = retryAfter;
+    }
+    
+    NSTimeInterval elapsed = -[_request.startTime timeIntervalSinceNow];
+    if (settings.retryDeadline > 0 && elapsed + delay > settings.retryDeadline)
+    {
+        AD_LOG_WARN_F(@"Not retrying request, it would go past the retry deadline.", _correlationId, @"elapsed: %.2fs delay: %.2fs", elapsed, delay);
+        return NO;
+    }
+    
+    ADCancellationToken* cancellationToken = _request.cancellationToken;
+    if (cancellationToken && delay >= [cancellationToken remainingTime])
+    {
+        AD_LOG_WARN_F(@"Not retrying request, it would go past the request deadline.", _correlationId, @"delay: %.2fs", delay);
+        return NO;
+    }
+    
+    _request.retryCount = retryCount + 1;
+    AD_LOG_INFO_F(@"Retrying request", _correlationId, @"retry: %lu delay: %.2fs", (unsigned long)(retryCount + 1), delay);
+    
+    ADWebAuthRequest* request = _request;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [request resend];
+    });
+    
+    return YES;
+}
+
 - (void)handleJSONResponse:(ADWebResponse*)webResponse
            completionBlock:(ADWebResponseCallback)completionBlock
 {
@@ -375,7 +516,7 @@
     {
         AD_LOG_ERROR(@"Empty body received, expected JSON response.", jsonError.code, _correlationId, nil);
     }
-    else
+    else if ([ADLogger isLevelEnabled:ADAL_LOG_LEVEL_ERROR])
     {
         if ([body length] < 1024)
         {
@@ -23,6 +23,7 @@
 
 @class ADWebRequest;
 @class ADWebResponse;
+@class ADCancellationToken;
 
 typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
 
@@ -46,8 +47,14 @@ typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
     
     BOOL _isGetRequest;
     
+    // 1 for the first send, incremented on every resend
+    NSUInteger _attempt;
+    
     NSString* _telemetryRequestId;
     
+    ADCancellationToken* _cancellationToken;
+    id _cancellationHandle;
+    
     void (^_completionHandler)( NSError *, ADWebResponse *);
 }
 
@@ -57,6 +64,7 @@ typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
 @property (nonatomic)                   NSUInteger           timeout;
 @property BOOL isGetRequest;
 @property (readonly) NSUUID* correlationId;
+@property (readonly) ADCancellationToken* cancellationToken;
 
 @property (atomic, copy,   readonly) NSURLSessionConfiguration* configuration;
 @property (atomic, strong, readonly) NSURLSession *session;
@@ -73,5 +81,11 @@ typedef void (^ADWebResponseCallback)(NSMutableDictionary *);
  */
 - (void)resend;
 
+/*!
+    Cancels the request if it is in flight. The completionHandler set in -send: will still be
+    called, with a cancellation error.
+ */
+- (void)cancel;
+
 @end
 
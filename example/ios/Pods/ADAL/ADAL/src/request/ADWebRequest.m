@@ -32,11 +32,17 @@
 #import "ADHelpers.h"
 #import "ADLogger+Internal.h"
 #import "ADURLProtocol.h"
+#import "ADURLSessionDemux.h"
+#import "ADCancellationToken.h"
 #import "ADTelemetry.h"
 #import "ADTelemetry+Internal.h"
 #import "ADTelemetryHttpEvent.h"
 #import "ADTelemetryEventStrings.h"
 
+// Responses claiming to be bigger than this don't get their buffer allocated up front, the
+// buffer grows as data comes in instead.
+#define MAX_PRESIZED_RESPONSE_LENGTH (1024 * 1024)
+
 @interface ADWebRequest ()
 
 - (void)completeWithError:(NSError *)error andResponse:(ADWebResponse *)response;
@@ -53,6 +59,7 @@
 @synthesize timeout  = _timeout;
 @synthesize isGetRequest = _isGetRequest;
 @synthesize correlationId = _correlationId;
+@synthesize cancellationToken = _cancellationToken;
 @synthesize session = _session;
 @synthesize configuration = _configuration;
 
@@ -80,6 +87,21 @@
 
 #pragma mark - Initialization
 
+/*! All web requests share a single session so that connections (and their TLS sessions) to
+    the same host are reused across requests. Callbacks are forwarded to the request that owns
+    each task. */
++ (ADURLSessionDemux *)sharedDemux
+{
+    static dispatch_once_t sOnceToken;
+    static ADURLSessionDemux * sDemux;
+    dispatch_once(&sOnceToken, ^{
+        NSURLSessionConfiguration *config = [NSURLSessionConfiguration defaultSessionConfiguration];
+        
+        sDemux = [[ADURLSessionDemux alloc] initWithConfiguration:config delegateQueue:nil];
+    });
+    return sDemux;
+}
+
 - (id)initWithURL:(NSURL *)requestURL
           context:(id<ADRequestContext>)context
 {
@@ -98,8 +120,14 @@
     
     _telemetryRequestId = context.telemetryRequestId;
     
-    _configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
-    _session = [NSURLSession sessionWithConfiguration:_configuration delegate:self delegateQueue:nil];
+    if ([context respondsToSelector:@selector(cancellationToken)])
+    {
+        _cancellationToken = [context cancellationToken];
+    }
+    
+    ADURLSessionDemux* demux = [[self class] sharedDemux];
+    _configuration = demux.configuration;
+    _session = demux.session;
     
     return self;
 }
@@ -113,6 +141,9 @@
 
     _task           = nil;
     
+    [_cancellationToken removeCancellationHandler:_cancellationHandle];
+    _cancellationHandle = nil;
+    
     [self stopTelemetryEvent:error response:response];
     _completionHandler(error, response);
 }
@@ -121,7 +152,8 @@
 {
     _completionHandler = [completionHandler copy];
     _response          = nil;
-    _responseData      = [[NSMutableData alloc] init];
+    _responseData      = nil;
+    _attempt           = 1;
     
     [self send];
 }
@@ -129,11 +161,17 @@
 - (void)resend
 {
     _response          = nil;
-    _responseData      = [[NSMutableData alloc] init];
+    _responseData      = nil;
+    ++_attempt;
 
     [self send];
 }
 
+- (void)cancel
+{
+    [_task cancel];
+}
+
 - (void)send
 {
     [[ADTelemetry sharedInstance] startEvent:_telemetryRequestId eventName:AD_TELEMETRY_EVENT_HTTP_REQUEST];
@@ -155,9 +193,28 @@
     
     NSURL* requestURL = [ADHelpers addClientVersionToURL:_requestURL];
     
+    // Don't let a single request wait past the deadline of the whole operation
+    NSTimeInterval timeout = _timeout;
+    if (_cancellationToken)
+    {
+        // Cancelled tokens have no time left either. The deadline can also pass right as the
+        // token is checked, so go by the time that is left rather than by isCancelled, a request
+        // can't be sent with a timeout that is already up. ADWebAuthResponse reports this as the
+        // token's cancelled or deadline exceeded error.
+        NSTimeInterval remainingTime = [_cancellationToken remainingTime];
+        if (remainingTime <= 0)
+        {
+            NSError* error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil];
+            [self dispatchCompletionWithError:error response:nil];
+            return;
+        }
+        
+        timeout = MIN(timeout, remainingTime);
+    }
+    
     NSMutableURLRequest *request = [[NSMutableURLRequest alloc] initWithURL:requestURL
                                                                 cachePolicy:NSURLRequestReloadIgnoringCacheData
-                                                            timeoutInterval:_timeout];
+                                                            timeoutInterval:timeout];
     
     request.HTTPMethod          = _isGetRequest ? @"GET" : @"POST";
     request.allHTTPHeaderFields = _requestHeaders;
@@ -165,7 +222,16 @@
     
     [ADURLProtocol addCorrelationId:_correlationId toRequest:request];
     
-    _task = [_session dataTaskWithRequest:request];
+    _task = [[[self class] sharedDemux] dataTaskWithRequest:request sessionQueueDelegate:self];
+    
+    if (_cancellationToken)
+    {
+        NSURLSessionDataTask* task = _task;
+        _cancellationHandle = [_cancellationToken addCancellationHandler:^{
+            [task cancel];
+        }];
+    }
+    
     [_task resume];
 }
 
@@ -192,15 +258,26 @@
         //
         NSAssert( _response != nil, @"No HTTP Response available" );
         
-        ADWebResponse* response = [[ADWebResponse alloc] initWithResponse:_response data:_responseData];
-        [self completeWithError:nil andResponse:response];
+        ADWebResponse* response = [[ADWebResponse alloc] initWithResponse:_response data:_responseData ? _responseData : [NSData data]];
+        [self dispatchCompletionWithError:nil response:response];
     }
     else
     {
-        [self completeWithError:error andResponse:nil];
+        [self dispatchCompletionWithError:error response:nil];
     }
 }
 
+// The shared session delivers the callbacks of every request on one serial queue, so the
+// completion handler (which can go on to hit the cache or send further requests) is moved
+// off of it to keep it from holding up other requests.
+- (void)dispatchCompletionWithError:(NSError *)error
+                           response:(ADWebResponse *)response
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [self completeWithError:error andResponse:response];
+    });
+}
+
 #pragma mark - NSURLSessionDataDelegate
 - (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveResponse:(NSURLResponse *)response completionHandler:(void (^)(NSURLSessionResponseDisposition))completionHandler
 {
@@ -208,6 +285,14 @@
     (void)dataTask;
   
     _response = (NSHTTPURLResponse *)response;
+    
+    // Size the buffer from Content-Length so the body doesn't get copied around as it grows
+    long long expectedLength = [response expectedContentLength];
+    if (expectedLength > 0 && expectedLength <= MAX_PRESIZED_RESPONSE_LENGTH)
+    {
+        _responseData = [[NSMutableData alloc] initWithCapacity:(NSUInteger)expectedLength];
+    }
+    
     completionHandler(NSURLSessionResponseAllow);
 }
 
@@ -216,6 +301,10 @@
     (void)session;
     (void)dataTask;
     
+    if (!_responseData)
+    {
+        _responseData = [[NSMutableData alloc] initWithCapacity:data.length];
+    }
     [_responseData appendData:data];
 }
 
@@ -262,6 +351,7 @@
     [event setOAuthErrorCode:response];
     
     [event setHttpRequestQueryParams:_requestURL.query];
+    [event setHttpAttempt:_attempt];
     
     [[ADTelemetry sharedInstance] stopEvent:_telemetryRequestId event:event];
 }
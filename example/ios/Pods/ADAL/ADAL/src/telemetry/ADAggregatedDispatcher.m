@@ -168,6 +168,8 @@ static NSDictionary *s_eventPropertiesDictionary;
                                               AD_TELEMETRY_KEY_RT_STATUS,
                                               AD_TELEMETRY_KEY_FRT_STATUS,
                                               AD_TELEMETRY_KEY_MRRT_STATUS,
+                                              AD_TELEMETRY_KEY_MEMORY_CACHE_HIT_COUNT,
+                                              AD_TELEMETRY_KEY_MEMORY_CACHE_MISS_COUNT,
                                               AD_TELEMETRY_KEY_CACHE_EVENT_COUNT
                                               ],
                                       NSStringFromClass([ADTelemetryBrokerEvent class]): @[
@@ -33,5 +33,7 @@
 - (void)setRTStatus:(NSString*)status;
 - (void)setMRRTStatus:(NSString*)status;
 - (void)setFRTStatus:(NSString*)status;
+- (void)setMemoryCacheHitCount:(NSUInteger)hitCount
+                     missCount:(NSUInteger)missCount;
 
 @end
\ No newline at end of file
@@ -83,4 +83,11 @@
     [self setProperty:AD_TELEMETRY_KEY_FRT_STATUS value:status];
 }
 
+- (void)setMemoryCacheHitCount:(NSUInteger)hitCount
+                     missCount:(NSUInteger)missCount
+{
+    [self setProperty:AD_TELEMETRY_KEY_MEMORY_CACHE_HIT_COUNT value:[NSString stringWithFormat:@"%lu", (unsigned long)hitCount]];
+    [self setProperty:AD_TELEMETRY_KEY_MEMORY_CACHE_MISS_COUNT value:[NSString stringWithFormat:@"%lu", (unsigned long)missCount]];
+}
+
 @end
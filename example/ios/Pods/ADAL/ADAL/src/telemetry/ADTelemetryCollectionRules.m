@@ -57,6 +57,8 @@ static NSDictionary *_telemetryEventRules;
                              AD_TELEMETRY_KEY_RT_STATUS: @(CollectOnly),
                              AD_TELEMETRY_KEY_MRRT_STATUS: @(CollectOnly),
                              AD_TELEMETRY_KEY_FRT_STATUS: @(CollectOnly),
+                             AD_TELEMETRY_KEY_MEMORY_CACHE_HIT_COUNT: @(CollectOnly),
+                             AD_TELEMETRY_KEY_MEMORY_CACHE_MISS_COUNT: @(CollectOnly),
                              AD_TELEMETRY_KEY_IS_SUCCESSFUL: @(CollectOnly),
                              AD_TELEMETRY_KEY_CORRELATION_ID: @(CollectOnly),
                              AD_TELEMETRY_KEY_IS_EXTENED_LIFE_TIME_TOKEN: @(CollectOnly),
@@ -70,6 +72,7 @@ static NSDictionary *_telemetryEventRules;
                              AD_TELEMETRY_KEY_REQUEST_QUERY_PARAMS: @(CollectOnly),
                              AD_TELEMETRY_KEY_USER_AGENT: @(CollectOnly),
                              AD_TELEMETRY_KEY_HTTP_ERROR_DOMAIN: @(CollectOnly),
+                             AD_TELEMETRY_KEY_HTTP_ATTEMPT: @(CollectOnly),
                              AD_TELEMETRY_KEY_AUTHORITY: @(CollectOnly),
                              AD_TELEMETRY_KEY_GRANT_TYPE: @(CollectOnly),
                              AD_TELEMETRY_KEY_API_STATUS: @(CollectOnly),
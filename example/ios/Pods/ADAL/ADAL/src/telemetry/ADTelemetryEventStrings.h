@@ -69,6 +69,8 @@ extern NSString *const AD_TELEMETRY_KEY_IS_FRT;
 extern NSString *const AD_TELEMETRY_KEY_RT_STATUS;
 extern NSString *const AD_TELEMETRY_KEY_MRRT_STATUS;
 extern NSString *const AD_TELEMETRY_KEY_FRT_STATUS;
+extern NSString *const AD_TELEMETRY_KEY_MEMORY_CACHE_HIT_COUNT;
+extern NSString *const AD_TELEMETRY_KEY_MEMORY_CACHE_MISS_COUNT;
 extern NSString *const AD_TELEMETRY_KEY_IS_SUCCESSFUL;
 extern NSString *const AD_TELEMETRY_KEY_USER_CANCEL;
 extern NSString *const AD_TELEMETRY_KEY_CORRELATION_ID;
@@ -86,6 +88,7 @@ extern NSString *const AD_TELEMETRY_KEY_HTTP_RESPONSE_METHOD;
 extern NSString *const AD_TELEMETRY_KEY_REQUEST_QUERY_PARAMS;
 extern NSString *const AD_TELEMETRY_KEY_USER_AGENT;
 extern NSString *const AD_TELEMETRY_KEY_HTTP_ERROR_DOMAIN;
+extern NSString *const AD_TELEMETRY_KEY_HTTP_ATTEMPT;
 extern NSString *const AD_TELEMETRY_KEY_AUTHORITY;
 extern NSString *const AD_TELEMETRY_KEY_GRANT_TYPE;
 extern NSString *const AD_TELEMETRY_KEY_API_STATUS;
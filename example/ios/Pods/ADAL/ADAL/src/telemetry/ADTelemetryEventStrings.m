@@ -72,6 +72,8 @@ NSString *const AD_TELEMETRY_KEY_IS_FRT                       = @"Microsoft.ADAL
 NSString *const AD_TELEMETRY_KEY_RT_STATUS                    = @"Microsoft.ADAL.token_rt_status";
 NSString *const AD_TELEMETRY_KEY_MRRT_STATUS                  = @"Microsoft.ADAL.token_mrrt_status";
 NSString *const AD_TELEMETRY_KEY_FRT_STATUS                    = @"Microsoft.ADAL.token_frt_status";
+NSString *const AD_TELEMETRY_KEY_MEMORY_CACHE_HIT_COUNT       = @"Microsoft.ADAL.memory_cache_hit_count";
+NSString *const AD_TELEMETRY_KEY_MEMORY_CACHE_MISS_COUNT      = @"Microsoft.ADAL.memory_cache_miss_count";
 NSString *const AD_TELEMETRY_KEY_IS_SUCCESSFUL                = @"Microsoft.ADAL.is_successfull";
 NSString *const AD_TELEMETRY_KEY_CORRELATION_ID               = @"Microsoft.ADAL.correlation_id";
 NSString *const AD_TELEMETRY_KEY_IS_EXTENED_LIFE_TIME_TOKEN   = @"Microsoft.ADAL.is_extended_life_time_token";
@@ -88,6 +90,7 @@ NSString *const AD_TELEMETRY_KEY_HTTP_RESPONSE_METHOD         = @"Microsoft.ADAL
 NSString *const AD_TELEMETRY_KEY_REQUEST_QUERY_PARAMS         = @"Microsoft.ADAL.query_params";
 NSString *const AD_TELEMETRY_KEY_USER_AGENT                   = @"Microsoft.ADAL.user_agent";
 NSString *const AD_TELEMETRY_KEY_HTTP_ERROR_DOMAIN            = @"Microsoft.ADAL.http_error_domain";
+NSString *const AD_TELEMETRY_KEY_HTTP_ATTEMPT                 = @"Microsoft.ADAL.http_attempt";
 NSString *const AD_TELEMETRY_KEY_AUTHORITY                    = @"Microsoft.ADAL.authority";
 NSString *const AD_TELEMETRY_KEY_GRANT_TYPE                   = @"Microsoft.ADAL.grant_type";
 NSString *const AD_TELEMETRY_KEY_API_STATUS                   = @"Microsoft.ADAL.api_status";
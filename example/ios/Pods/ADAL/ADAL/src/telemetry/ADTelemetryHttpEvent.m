@@ -78,6 +78,24 @@
         return;
     }
     
+    // Successful responses don't carry an OAuth error, and parsing every token response a second
+    // time just to find that out isn't worth it. Only parse bodies that mention the error key.
+    if ([response statusCode] < 400)
+    {
+        return;
+    }
+    
+    static NSData* s_errorKey = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        s_errorKey = [[NSString stringWithFormat:@"\"%@\"", OAUTH2_ERROR] dataUsingEncoding:NSUTF8StringEncoding];
+    });
+    
+    if ([response.body rangeOfData:s_errorKey options:0 range:NSMakeRange(0, response.body.length)].location == NSNotFound)
+    {
+        return;
+    }
+    
     NSError* jsonError  = nil;
     id jsonObject = [NSJSONSerialization JSONObjectWithData:response.body options:0 error:&jsonError];
     
@@ -116,6 +134,11 @@
     [self setProperty:AD_TELEMETRY_KEY_HTTP_ERROR_DOMAIN value:errorDomain];
 }
 
+- (void)setHttpAttempt:(NSUInteger)attempt
+{
+    [self setProperty:AD_TELEMETRY_KEY_HTTP_ATTEMPT value:[NSString stringWithFormat:@"%lu", (unsigned long)attempt]];
+}
+
 - (NSString*)scrubTenantFromUrl:(NSString*)url
 {
     //Scrub the tenant domain from the url
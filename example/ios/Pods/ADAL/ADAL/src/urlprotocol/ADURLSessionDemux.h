@@ -29,6 +29,13 @@
 
 - (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)request delegate:(id<NSURLSessionDataDelegate>)delegate;
 
+/*!
+    Creates a data task whose delegate callbacks are forwarded directly on the session's
+    delegate queue, instead of being bounced to the thread that created the task. Use this
+    for callers that create tasks from threads without a run loop (e.g. GCD queues).
+ */
+- (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)request sessionQueueDelegate:(id<NSURLSessionDataDelegate>)delegate;
+
 @property (atomic, copy,   readonly) NSURLSessionConfiguration* configuration;
 @property (atomic, strong, readonly) NSURLSession *session;
 
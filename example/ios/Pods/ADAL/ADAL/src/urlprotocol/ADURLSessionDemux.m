@@ -27,6 +27,7 @@
 @interface ADURLSessionDemuxTaskInfo : NSObject
 
 - (instancetype)initWithTask:(NSURLSessionDataTask *)task delegate:(id<NSURLSessionDataDelegate>)delegate;
+- (instancetype)initWithTask:(NSURLSessionDataTask *)task delegate:(id<NSURLSessionDataDelegate>)delegate onClientThread:(BOOL)onClientThread;
 
 @property (atomic, strong) NSURLSessionDataTask *task;
 @property (atomic, strong) id<NSURLSessionDataDelegate> delegate;
@@ -41,19 +42,31 @@
 @implementation ADURLSessionDemuxTaskInfo
 
 - (instancetype)initWithTask:(NSURLSessionDataTask *)task delegate:(id<NSURLSessionDataDelegate>)delegate
+{
+    return [self initWithTask:task delegate:delegate onClientThread:YES];
+}
+
+- (instancetype)initWithTask:(NSURLSessionDataTask *)task delegate:(id<NSURLSessionDataDelegate>)delegate onClientThread:(BOOL)onClientThread
 {
     self = [super init];
     if (self != nil)
     {
         self->_task = task;
         self->_delegate = delegate;
-        self->_thread = [NSThread currentThread];
+        self->_thread = onClientThread ? [NSThread currentThread] : nil;
     }
     return self;
 }
 
 - (void)performBlock:(dispatch_block_t)block
 {
+    // Without a client thread the callback is delivered straight on the session's delegate queue
+    if (!self.thread)
+    {
+        block();
+        return;
+    }
+    
     [self performSelector:@selector(performBlockOnClientThread:)
                  onThread:self.thread
                withObject:[block copy]
@@ -97,13 +110,26 @@ static const void *s_taskKey = &s_taskKey;
 }
 
 - (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)request delegate:(id<NSURLSessionDataDelegate>)delegate
+{
+    return [self dataTaskWithRequest:request delegate:delegate onClientThread:YES];
+}
+
+- (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)request sessionQueueDelegate:(id<NSURLSessionDataDelegate>)delegate
+{
+    return [self dataTaskWithRequest:request delegate:delegate onClientThread:NO];
+}
+
+- (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)request
+                                     delegate:(id<NSURLSessionDataDelegate>)delegate
+                               onClientThread:(BOOL)onClientThread
 {
     NSURLSessionDataTask *task;
     ADURLSessionDemuxTaskInfo *taskInfo;
     
     task = [self.session dataTaskWithRequest:request];
     taskInfo = [[ADURLSessionDemuxTaskInfo alloc] initWithTask:task
-                                                      delegate:delegate];
+                                                      delegate:delegate
+                                                onClientThread:onClientThread];
     
     objc_setAssociatedObject(task, s_taskKey, taskInfo, OBJC_ASSOCIATION_RETAIN);
     
@@ -38,10 +38,15 @@
                                         context:(NSString *)context
                                    symmetricKey:(NSData *)symmetricKey;
 
-+ (NSString *)JSONFromDictionary:(NSDictionary *)dictionary;
+/*! Returns base64url(JSON(header)) "." base64url(JSON(payload)), the bytes a JWT signature is
+    computed over, or nil if either can't be written as JSON. */
++ (NSMutableData *)JWTSigningInputForHeader:(NSDictionary *)header
+                                    payload:(NSDictionary *)payload;
 
-+ (NSData*)computeKDFInCounterMode:(NSData *)key
-                           context:(NSData *)ctx;
+/*! Appends "." and the base64url encoded signature to the signing input and returns the JWT. */
++ (NSString *)JWTWithSigningInput:(NSMutableData *)signingInput
+                   signatureBytes:(const void *)signature
+                           length:(NSUInteger)length;
 
 + (void)removeNullStringFrom:(NSDictionary *)dict;
 
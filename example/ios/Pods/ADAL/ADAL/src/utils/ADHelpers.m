@@ -28,10 +28,203 @@
 #import <CommonCrypto/CommonCryptor.h>
 #import <CommonCrypto/CommonHMAC.h>
 #import <CommonCrypto/CommonDigest.h>
+// memset_s is only declared if __STDC_WANT_LIB_EXT1__ is set before <string.h> is first
+// included, which the prefix header has already done by the time this file is compiled.
+#include <sys/_types/_rsize_t.h>
+#include <sys/_types/_errno_t.h>
+extern errno_t memset_s(void *s, rsize_t smax, int c, rsize_t n);
 
 #import "ADOauth2Constants.h"
 #import "ADAL_Internal.h"
 
+#define KDF_DERIVED_KEY_LENGTH CC_SHA256_DIGEST_LENGTH
+
+// SP 800-108 KDF in counter mode with HMAC-SHA256 as the PRF. The fixed input is
+// label || 0x00 || context || L, each round's input is that prefixed with the 32 bit counter.
+static void DeriveKeyInCounterMode(const void* key, size_t keyLength,
+                                   const void* ctx, size_t ctxLength,
+                                   uint8_t derivedKey[KDF_DERIVED_KEY_LENGTH])
+{
+    static const uint8_t separator = 0x00;
+    const uint32_t outputSizeBits = CFSwapInt32HostToBig(KDF_DERIVED_KEY_LENGTH * 8);
+    const char* label = [AAD_SECURECONVERSATION_LABEL UTF8String];
+    
+    // The derived key is exactly one HMAC-SHA256 output long, so a single round with the counter
+    // at 1 produces all of it. The input is fed to HMAC in pieces rather than copied together.
+    const uint32_t ctr = CFSwapInt32HostToBig(1);
+    CCHmacContext hmac;
+    CCHmacInit(&hmac, kCCHmacAlgSHA256, key, keyLength);
+    CCHmacUpdate(&hmac, &ctr, sizeof(ctr));
+    CCHmacUpdate(&hmac, label, strlen(label));
+    CCHmacUpdate(&hmac, &separator, sizeof(separator));
+    CCHmacUpdate(&hmac, ctx, ctxLength);
+    CCHmacUpdate(&hmac, &outputSizeBits, sizeof(outputSizeBits));
+    CCHmacFinal(&hmac, derivedKey);
+    // The context holds the key, padded
+    memset_s(&hmac, sizeof(hmac), 0, sizeof(hmac));
+}
+
+static void AppendJSONString(NSMutableData* data, NSString* string)
+{
+    static const char s_kHexDigits[] = "0123456789abcdef";
+    
+    const char* utf8 = [string UTF8String];
+    const char* runStart = utf8;
+    
+    [data appendBytes:"\"" length:1];
+    for (const char* p = utf8; p && *p; ++p)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        
+        // Copy the run of characters that don't need escaping in one go
+        [data appendBytes:runStart length:p - runStart];
+        runStart = p + 1;
+        
+        char escape[6] = { '\\', (char)c, 0, 0, 0, 0 };
+        size_t escapeLength = 2;
+        switch (c)
+        {
+            case '"': case '\\': break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            case '\n': escape[1] = 'n'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\t': escape[1] = 't'; break;
+            default:
+                escape[1] = 'u';
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = s_kHexDigits[c >> 4];
+                escape[5] = s_kHexDigits[c & 0xF];
+                escapeLength = 6;
+                break;
+        }
+        [data appendBytes:escape length:escapeLength];
+    }
+    if (utf8)
+    {
+        [data appendBytes:runStart length:strlen(runStart)];
+    }
+    [data appendBytes:"\"" length:1];
+}
+
+// Writes the object as compact JSON with the dictionary keys sorted, so the same object always
+// produces the same bytes. Handles the types JWT headers and payloads are made of, returns NO for
+// anything else.
+static BOOL AppendJSON(NSMutableData* data, id object)
+{
+    if ([object isKindOfClass:[NSString class]])
+    {
+        AppendJSONString(data, object);
+        return YES;
+    }
+    
+    if ([object isKindOfClass:[NSNumber class]])
+    {
+        NSNumber* number = object;
+        if (CFGetTypeID((__bridge CFTypeRef)number) == CFBooleanGetTypeID())
+        {
+            const char* literal = [number boolValue] ? "true" : "false";
+            [data appendBytes:literal length:strlen(literal)];
+            return YES;
+        }
+        
+        char buffer[32];
+        int length = 0;
+        const char* type = [number objCType];
+        if (strcmp(type, @encode(float)) == 0 || strcmp(type, @encode(double)) == 0)
+        {
+            double value = [number doubleValue];
+            if (isnan(value) || isinf(value))
+            {
+                return NO;
+            }
+            // Use the shortest form that reads back as the same double, "%.17g" alone turns
+            // 0.1 into 0.10000000000000001.
+            for (int precision = 1; precision <= 17; precision++)
+            {
+                length = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+                if (strtod(buffer, NULL) == value)
+                {
+                    break;
+                }
+            }
+        }
+        else if (strcmp(type, @encode(unsigned long long)) == 0)
+        {
+            length = snprintf(buffer, sizeof(buffer), "%llu", [number unsignedLongLongValue]);
+        }
+        else
+        {
+            length = snprintf(buffer, sizeof(buffer), "%lld", [number longLongValue]);
+        }
+        [data appendBytes:buffer length:length];
+        return YES;
+    }
+    
+    if ([object isKindOfClass:[NSDictionary class]])
+    {
+        NSDictionary* dictionary = object;
+        NSArray* keys = [[dictionary allKeys] sortedArrayUsingSelector:@selector(compare:)];
+        [data appendBytes:"{" length:1];
+        BOOL first = YES;
+        for (id key in keys)
+        {
+            if (![key isKindOfClass:[NSString class]])
+            {
+                return NO;
+            }
+            if (!first)
+            {
+                [data appendBytes:"," length:1];
+            }
+            first = NO;
+            
+            AppendJSONString(data, key);
+            [data appendBytes:":" length:1];
+            if (!AppendJSON(data, [dictionary objectForKey:key]))
+            {
+                return NO;
+            }
+        }
+        [data appendBytes:"}" length:1];
+        return YES;
+    }
+    
+    if ([object isKindOfClass:[NSArray class]])
+    {
+        [data appendBytes:"[" length:1];
+        BOOL first = YES;
+        for (id element in object)
+        {
+            if (!first)
+            {
+                [data appendBytes:"," length:1];
+            }
+            first = NO;
+            
+            if (!AppendJSON(data, element))
+            {
+                return NO;
+            }
+        }
+        [data appendBytes:"]" length:1];
+        return YES;
+    }
+    
+    if ([object isKindOfClass:[NSNull class]])
+    {
+        [data appendBytes:"null" length:4];
+        return YES;
+    }
+    
+    return NO;
+}
+
 @implementation ADHelpers
 
 
@@ -119,142 +312,60 @@
                                         context:(NSString *)context
                                    symmetricKey:(NSData *)symmetricKey
 {
-    NSString* signingInput = [NSString stringWithFormat:@"%@.%@",
-                              [[ADHelpers JSONFromDictionary:header] adBase64UrlEncode],
-                              [[ADHelpers JSONFromDictionary:payload] adBase64UrlEncode]];
+    NSMutableData* jwt = [ADHelpers JWTSigningInputForHeader:header payload:payload];
+    if (!jwt)
+    {
+        return nil;
+    }
     
-    NSData* derivedKey = [ADHelpers computeKDFInCounterMode:symmetricKey
-                                                    context:[context dataUsingEncoding:NSUTF8StringEncoding]];
+    const char* ctx = [context UTF8String];
+    uint8_t derivedKey[KDF_DERIVED_KEY_LENGTH];
+    DeriveKeyInCounterMode(symmetricKey.bytes, symmetricKey.length, ctx, ctx ? strlen(ctx) : 0, derivedKey);
     
-    NSData* data = [signingInput dataUsingEncoding:NSUTF8StringEncoding];
     unsigned char cHMAC[CC_SHA256_DIGEST_LENGTH];
     CCHmac(kCCHmacAlgSHA256,
-           derivedKey.bytes,
-           derivedKey.length,
-           [data bytes],
-           [data length],
+           derivedKey,
+           sizeof(derivedKey),
+           [jwt bytes],
+           [jwt length],
            cHMAC);
-    NSData* signedData = [[NSData alloc] initWithBytes:cHMAC length:sizeof(cHMAC)];
-    NSString* signedEncodedDataString = [NSString adBase64EncodeData:signedData];
-    return [NSString stringWithFormat:@"%@.%@",
-            signingInput,
-            signedEncodedDataString];
+    // Don't leave the derived key behind on the stack
+    memset_s(derivedKey, sizeof(derivedKey), 0, sizeof(derivedKey));
+    return [ADHelpers JWTWithSigningInput:jwt signatureBytes:cHMAC length:sizeof(cHMAC)];
 }
 
-
-+ (NSString *)JSONFromDictionary:(NSDictionary *)dictionary
++ (NSMutableData *)JWTSigningInputForHeader:(NSDictionary *)header
+                                    payload:(NSDictionary *)payload
 {
+    NSMutableData* json = [NSMutableData dataWithCapacity:512];
+    NSMutableData* signingInput = [NSMutableData dataWithCapacity:1024];
     
-    NSError *error = nil;
-    NSData *jsonData = [NSJSONSerialization dataWithJSONObject:dictionary
-                                                       options:NSJSONWritingPrettyPrinted
-                                                         error:&error];
-    if (!jsonData)
+    if (!AppendJSON(json, header))
     {
+        AD_LOG_ERROR(@"Failed to write the JWT header as JSON", AD_ERROR_UNEXPECTED, nil, nil);
         return nil;
     }
+    [NSString adAppendBase64UrlEncodedBytes:json.bytes length:json.length toData:signingInput];
+    [signingInput appendBytes:"." length:1];
     
-    NSString* json = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-    return json;
-}
-
-+ (NSData*)computeKDFInCounterMode:(NSData *)key
-                           context:(NSData *)ctx
-{
-    NSData* labelData = [AAD_SECURECONVERSATION_LABEL dataUsingEncoding:NSUTF8StringEncoding];
-    NSMutableData* mutData = [NSMutableData new];
-    [mutData appendBytes:labelData.bytes length:labelData.length];
-    Byte bytes[] = {0x00};
-    [mutData appendBytes:bytes length:1];
-    [mutData appendBytes:ctx.bytes length:ctx.length];
-    int32_t size = CFSwapInt32HostToBig(256); //make big-endian
-    [mutData appendBytes:&size length:sizeof(size)];
-    
-    uint8_t* pbDerivedKey = [ADHelpers KDFCounterMode:(uint8_t*)key.bytes
-                                     keyDerivationKeyLength:key.length
-                                                 fixedInput:(uint8_t*)mutData.bytes
-                                           fixedInputLength:mutData.length];
-    mutData = nil;
-    NSData* returnedData = [NSData dataWithBytes:(const void *)pbDerivedKey length:32];
-    free(pbDerivedKey);
-    return returnedData;
-}
-
-
-
-+ (uint8_t*) KDFCounterMode:(uint8_t*) keyDerivationKey
-     keyDerivationKeyLength:(size_t) keyDerivationKeyLength
-                 fixedInput:(uint8_t*) fixedInput
-           fixedInputLength:(size_t) fixedInputLength
-{
-    uint8_t ctr;
-    unsigned char cHMAC[CC_SHA256_DIGEST_LENGTH];
-    uint8_t* keyDerivated;
-    uint8_t* dataInput;
-    int len;
-    int numCurrentElements;
-    int numCurrentElements_bytes;
-    int outputSizeBit = 256;
-    
-    numCurrentElements = 0;
-    ctr = 1;
-    keyDerivated = (uint8_t*)malloc(outputSizeBit/8); //output is 32 bytes
-    
-    do{
-        //update data using "ctr"
-        dataInput =  [ADHelpers updateDataInput:ctr
-                                     fixedInput:fixedInput
-                              fixedInput_length: fixedInputLength];
-        
-        CCHmac(kCCHmacAlgSHA256,
-               keyDerivationKey,
-               keyDerivationKeyLength,
-               dataInput,
-               (fixedInputLength+4), //+4 to account for ctr
-               cHMAC);
-        
-        //decide how many bytes (so the "length") copy for currently keyDerivated?
-        if (256 >= outputSizeBit) {
-            len = outputSizeBit;
-        } else {
-            len = MIN(256, outputSizeBit - numCurrentElements);
-        }
-        
-        //convert bits in byte
-        numCurrentElements_bytes = numCurrentElements/8;
-        
-        //copy KI in part of keyDerivated
-        memcpy((keyDerivated + numCurrentElements_bytes), cHMAC, 32);
-        
-        //increment ctr and numCurrentElements copied in keyDerivated
-        numCurrentElements = numCurrentElements + len;
-        ctr++;
-        
-        //deallock space in memory
-        free(dataInput);
-        
-    } while (numCurrentElements < outputSizeBit);
+    [json setLength:0];
+    if (!AppendJSON(json, payload))
+    {
+        AD_LOG_ERROR(@"Failed to write the JWT payload as JSON", AD_ERROR_UNEXPECTED, nil, nil);
+        return nil;
+    }
+    [NSString adAppendBase64UrlEncodedBytes:json.bytes length:json.length toData:signingInput];
     
-    return keyDerivated;
+    return signingInput;
 }
 
-
-/*
- * Function used to shift data of 1 byte. This byte is the "ctr".
- */
-+(uint8_t*) updateDataInput:(uint8_t) ctr
-                 fixedInput:(uint8_t*) fixedInput
-          fixedInput_length:(size_t) fixedInput_length
++ (NSString *)JWTWithSigningInput:(NSMutableData *)signingInput
+                   signatureBytes:(const void *)signature
+                           length:(NSUInteger)length
 {
-    uint8_t* tmpFixedInput = (uint8_t *)malloc(fixedInput_length + 4); //+4 is caused from the ctr
-    
-    tmpFixedInput[0] = (ctr >> 24);
-    tmpFixedInput[1] = (ctr >> 16);
-    tmpFixedInput[2] = (ctr >> 8);
-    tmpFixedInput[3] = ctr;
-    
-    memcpy(tmpFixedInput + 4, fixedInput, fixedInput_length * sizeof(uint8_t));
-    return tmpFixedInput;
+    [signingInput appendBytes:"." length:1];
+    [NSString adAppendBase64UrlEncodedBytes:signature length:length toData:signingInput];
+    return [[NSString alloc] initWithData:signingInput encoding:NSASCIIStringEncoding];
 }
 
 + (NSURL*)addClientVersionToURL:(NSURL*)url
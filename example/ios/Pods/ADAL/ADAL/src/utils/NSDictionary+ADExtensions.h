@@ -27,5 +27,7 @@
 
 + (NSDictionary *)adURLFormDecode:(NSString *)string;
 - (NSString *)adURLFormEncode;
+/*! The UTF-8 bytes of adURLFormEncode, without going through an NSString. */
+- (NSData *)adURLFormEncodedData;
 
 @end
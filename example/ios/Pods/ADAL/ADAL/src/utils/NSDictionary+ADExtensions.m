@@ -26,6 +26,170 @@
 #import "NSDictionary+ADExtensions.h"
 #import "NSString+ADHelperMethods.h"
 
+static const char s_kHexDigits[] = "0123456789ABCDEF";
+
+// Bytes that adUrlFormEncode percent-escapes. Everything else, including the bytes of non-ASCII
+// UTF-8 sequences, is written as is, and space becomes '+'.
+static const char s_kFormEscapedChars[] = "!#$&'()*+,/:;=?@[]%|^";
+
+static BOOL s_formEscaped[256];
+static signed char s_hexValue[256];
+
+static void InitFormTables(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        for (const char* c = s_kFormEscapedChars; *c; ++c)
+        {
+            s_formEscaped[(unsigned char)*c] = YES;
+        }
+        
+        memset(s_hexValue, -1, sizeof(s_hexValue));
+        for (int i = 0; i < 16; ++i)
+        {
+            s_hexValue[(unsigned char)s_kHexDigits[i]] = i;
+            s_hexValue[(unsigned char)tolower(s_kHexDigits[i])] = i;
+        }
+    });
+}
+
+// The ASCII members of [NSCharacterSet whitespaceAndNewlineCharacterSet]
+static inline BOOL IsFormWhitespace(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Returns the string adTrimmedString would, without creating a new one in the common case where
+// there is nothing to trim.
+static NSString* TrimmedString(NSString* string)
+{
+    NSUInteger length = string.length;
+    if (length == 0)
+    {
+        return string;
+    }
+    
+    NSCharacterSet* set = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    if (![set characterIsMember:[string characterAtIndex:0]] &&
+        ![set characterIsMember:[string characterAtIndex:length - 1]])
+    {
+        return string;
+    }
+    
+    return [string adTrimmedString];
+}
+
+static size_t FormEncodedLength(const unsigned char* bytes, size_t length)
+{
+    size_t encodedLength = length;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (s_formEscaped[bytes[i]])
+        {
+            encodedLength += 2;
+        }
+    }
+    return encodedLength;
+}
+
+static char* FormEncode(const unsigned char* bytes, size_t length, char* out)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char c = bytes[i];
+        if (s_formEscaped[c])
+        {
+            *out++ = '%';
+            *out++ = s_kHexDigits[c >> 4];
+            *out++ = s_kHexDigits[c & 0xF];
+        }
+        else
+        {
+            *out++ = c == ' ' ? '+' : c;
+        }
+    }
+    return out;
+}
+
+// Percent-decodes a form value, turning '+' into space, and returns the string or nil if it has a
+// malformed escape or isn't valid UTF-8. scratch must have room for length bytes.
+static NSString* FormDecode(const unsigned char* bytes, size_t length, unsigned char* scratch)
+{
+    unsigned char* out = scratch;
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char c = bytes[i];
+        if (c == '%')
+        {
+            if (i + 2 >= length)
+            {
+                return nil;
+            }
+            signed char high = s_hexValue[bytes[i + 1]];
+            signed char low = s_hexValue[bytes[i + 2]];
+            if (high < 0 || low < 0)
+            {
+                return nil;
+            }
+            *out++ = (unsigned char)((high << 4) | low);
+            i += 2;
+        }
+        else
+        {
+            *out++ = c == '+' ? ' ' : c;
+        }
+    }
+    
+    return [[NSString alloc] initWithBytes:scratch length:out - scratch encoding:NSUTF8StringEncoding];
+}
+
+// Encodes the dictionary into a malloc'd buffer the caller has to free, sized in a first pass so
+// it is allocated only once. Returns NULL if the dictionary is empty.
+static char* FormEncodeDictionary(NSDictionary* dictionary, size_t* outLength)
+{
+    NSUInteger count = dictionary.count;
+    if (count == 0)
+    {
+        return NULL;
+    }
+    
+    InitFormTables();
+    
+    // Hold on to the UTF-8 bytes of every key and value until the second pass is done, the
+    // buffers behind -UTF8String only live as long as their (possibly temporary) string.
+    NSMutableArray<NSData*>* strings = [[NSMutableArray alloc] initWithCapacity:count * 2];
+    __block size_t totalLength = count * 2 - 1; // '=' and '&' separators
+    [dictionary enumerateKeysAndObjectsUsingBlock: ^(id key, id value, BOOL *stop)
+    {
+        (void)stop;
+        NSData* utf8Key = [TrimmedString(key) dataUsingEncoding:NSUTF8StringEncoding];
+        NSData* utf8Value = [TrimmedString(value) dataUsingEncoding:NSUTF8StringEncoding];
+        [strings addObject:utf8Key ? utf8Key : [NSData data]];
+        [strings addObject:utf8Value ? utf8Value : [NSData data]];
+        totalLength += FormEncodedLength(utf8Key.bytes, utf8Key.length);
+        totalLength += FormEncodedLength(utf8Value.bytes, utf8Value.length);
+    }];
+    
+    char* buffer = malloc(totalLength);
+    if (buffer)
+    {
+        char* out = buffer;
+        for (NSUInteger i = 0; i < strings.count; i += 2)
+        {
+            if (i != 0)
+            {
+                *out++ = '&';
+            }
+            out = FormEncode(strings[i].bytes, strings[i].length, out);
+            *out++ = '=';
+            out = FormEncode(strings[i + 1].bytes, strings[i + 1].length, out);
+        }
+        *outLength = out - buffer;
+    }
+    
+    return buffer;
+}
+
 @implementation NSDictionary ( ADAL )
 
 // Decodes a www-form-urlencoded string into a dictionary of key/value pairs.
@@ -39,23 +203,81 @@
     
     NSMutableDictionary *parameters = [[NSMutableDictionary alloc] init];
     
-    if ( nil != string && string.length != 0 )
+    const unsigned char* bytes = (const unsigned char*)[string UTF8String];
+    size_t length = bytes ? strlen((const char*)bytes) : 0;
+    if (length == 0)
+    {
+        return parameters;
+    }
+    
+    InitFormTables();
+    
+    // Decoded keys and values are never longer than the input
+    unsigned char* scratch = malloc(length);
+    if (!scratch)
+    {
+        return parameters;
+    }
+    
+    size_t pairStart = 0;
+    while (pairStart <= length)
     {
-        NSArray *pairs = [string componentsSeparatedByString:@"&"];
+        const unsigned char* pairEnd = memchr(bytes + pairStart, '&', length - pairStart);
+        size_t pairLength = (pairEnd ? (size_t)(pairEnd - bytes) : length) - pairStart;
+        const unsigned char* pair = bytes + pairStart;
+        pairStart += pairLength + 1;
         
-        for ( NSString *pair in pairs )
+        // Pairs need exactly one '='
+        const unsigned char* separator = memchr(pair, '=', pairLength);
+        if (!separator || memchr(separator + 1, '=', pair + pairLength - separator - 1))
         {
-            NSArray *elements = [pair componentsSeparatedByString:@"="];
-            
-            if ( elements != nil && elements.count == 2 )
+            continue;
+        }
+        
+        const unsigned char* key = pair;
+        size_t keyLength = separator - pair;
+        const unsigned char* value = separator + 1;
+        size_t valueLength = pair + pairLength - value;
+        
+        // Non-ASCII characters at either end may be Unicode whitespace, leave those to NSString
+        if ((keyLength && (key[0] >= 0x80 || key[keyLength - 1] >= 0x80)) ||
+            (valueLength && (value[0] >= 0x80 || value[valueLength - 1] >= 0x80)))
+        {
+            NSString* keyString = [[NSString alloc] initWithBytes:key length:keyLength encoding:NSUTF8StringEncoding];
+            NSString* valueString = [[NSString alloc] initWithBytes:value length:valueLength encoding:NSUTF8StringEncoding];
+            NSString* decodedKey = [[keyString adTrimmedString] adUrlFormDecode];
+            NSString* decodedValue = [[valueString adTrimmedString] adUrlFormDecode];
+            if (decodedKey.length != 0 && decodedValue)
             {
-                NSString *key     = [[[elements objectAtIndex:0] adTrimmedString] adUrlFormDecode];
-                NSString *value   = [[[elements objectAtIndex:1] adTrimmedString] adUrlFormDecode];
-                if ( nil != key && key.length != 0 )
-                    [parameters setObject:value forKey:key];
+                [parameters setObject:decodedValue forKey:decodedKey];
             }
+            continue;
+        }
+        
+        while (keyLength && IsFormWhitespace(key[0])) { ++key; --keyLength; }
+        while (keyLength && IsFormWhitespace(key[keyLength - 1])) { --keyLength; }
+        while (valueLength && IsFormWhitespace(value[0])) { ++value; --valueLength; }
+        while (valueLength && IsFormWhitespace(value[valueLength - 1])) { --valueLength; }
+        
+        if (keyLength == 0)
+        {
+            continue;
+        }
+        
+        NSString* decodedKey = FormDecode(key, keyLength, scratch);
+        if (decodedKey.length == 0)
+        {
+            continue;
+        }
+        
+        NSString* decodedValue = FormDecode(value, valueLength, scratch);
+        if (decodedValue)
+        {
+            [parameters setObject:decodedValue forKey:decodedKey];
         }
     }
+    
+    free(scratch);
     return parameters;
 }
 
@@ -63,25 +285,26 @@
 // Returns nil if the dictionary is empty, otherwise the encoded value
 - (NSString *)adURLFormEncode
 {
-    __block NSMutableString *parameters = nil;
+    size_t length = 0;
+    char* bytes = FormEncodeDictionary(self, &length);
+    if (!bytes)
+    {
+        return nil;
+    }
     
-    [self enumerateKeysAndObjectsUsingBlock: ^(id key, id value, BOOL *stop)
+    return [[NSString alloc] initWithBytesNoCopy:bytes length:length encoding:NSUTF8StringEncoding freeWhenDone:YES];
+}
+
+- (NSData *)adURLFormEncodedData
+{
+    size_t length = 0;
+    char* bytes = FormEncodeDictionary(self, &length);
+    if (!bytes)
     {
-        (void)stop;
-        NSString* encodedKey = [[((NSString *)key) adTrimmedString] adUrlFormEncode];
-        NSString* encodedValue = [[((NSString *)value) adTrimmedString] adUrlFormEncode];
-        
-        if ( parameters == nil )
-        {
-            parameters = [NSMutableString new];
-            [parameters appendFormat:@"%@=%@", encodedKey, encodedValue];
-        }
-        else
-        {
-            [parameters appendFormat:@"&%@=%@", encodedKey, encodedValue];
-        }
-    }];
-    return parameters;
+        return nil;
+    }
+    
+    return [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:YES];
 }
 
 @end
@@ -48,6 +48,11 @@
 /*! Converts NSData to base64 String */
 + (NSString *)adBase64EncodeData:(NSData *)data;
 
+/*! Appends the base64url encoding of the bytes to data, without creating a string. */
++ (void)adAppendBase64UrlEncodedBytes:(const void *)bytes
+                               length:(NSUInteger)length
+                               toData:(NSMutableData *)data;
+
 - (NSString*)adComputeSHA256;
 
 @end
@@ -35,7 +35,9 @@ static char base64UrlEncodeTable[64] =
 
 #define NA (255)
 
-static byte rgbDecodeTable[128] = {                         // character code
+// Covers every byte value so the decode loop needs no range check. Valid characters map to their
+// 6 bit values and everything else to NA, which has the top bits set.
+static const byte rgbDecodeTable[256] = {                   // character code
     NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 0-15
     NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 16-31
     NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, 62, NA, NA,  // 32-47
@@ -44,20 +46,17 @@ static byte rgbDecodeTable[128] = {                         // character code
     15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, NA, NA, NA, NA, 63,  // 80-95
     NA, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,  // 96-111
     41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, NA, NA, NA, NA, NA,  // 112-127
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 128-143
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 144-159
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 160-175
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 176-191
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 192-207
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 208-223
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 224-239
+    NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA, NA,  // 240-255
 };
 
-//Checks that all bytes inside the format are valid base64 characters:
-BOOL validBase64Characters(const byte* data, const int size)    
-{
-    for (int i = 0; i < size; ++i)
-    {
-        if (data[i] >= sizeof(rgbDecodeTable) || rgbDecodeTable[data[i]] == NA)
-        {
-            return false;
-        }
-    }
-    return true;
-}
+#define INVALID_BASE64_BITS (0xC0)
 
 @implementation NSString (ADHelperMethods)
 
@@ -75,18 +74,8 @@ BOOL validBase64Characters(const byte* data, const int size)
         return nil;
     }
     
-    NSData      *encodedBytes = [encodedString dataUsingEncoding:NSUTF8StringEncoding];
-    const byte  *pbEncoded    = [encodedBytes bytes];
-    const int    cbEncoded    = (int)[encodedBytes length];
-    if (!validBase64Characters(pbEncoded, cbEncoded))
-    {
-        return nil;
-    }
-    
-    int   cbDecodedSize;
-    int   ich;
-    int   ib;
-    byte  b0, b1, b2, b3;
+    // Valid input is all ASCII, so its UTF-16 length is its byte length.
+    NSUInteger cbEncoded = encodedString.length;
     
     // The input string lacks the usual '=' padding at the end, so the valid end sequences
     // are:
@@ -102,64 +91,70 @@ BOOL validBase64Characters(const byte* data, const int size)
         return nil;
     }
     
-    // 'virtual padding' is how many trailing '=' characters we would have
-    // had under 'normal' base-64 encoding
-    int virtualPadding = ( ( cbEncoded % 4 ) == 2 ) ? 2 : ( ( cbEncoded % 4 ) == 3 ) ? 1 : 0;
-    
-    // Calculate decoded buffer size.
-    cbDecodedSize = (cbEncoded + virtualPadding + 3) / 4 * 3;
-    cbDecodedSize -= virtualPadding;
-    
-    byte *pbDecoded = (byte *)calloc( cbDecodedSize, sizeof(byte) );
-    
-    if(!pbDecoded) {
+    // Copy the characters into the buffer that becomes the result, and decode them in place. Each
+    // group of four characters is read before its three bytes are written over them. Strings with
+    // non-ASCII characters can't be base64 and stop the copy early.
+    NSMutableData *result = [NSMutableData dataWithLength:cbEncoded];
+    byte *buffer = [result mutableBytes];
+    NSUInteger cbCopied = 0;
+    if (!buffer ||
+        ![encodedString getBytes:buffer
+                       maxLength:cbEncoded
+                      usedLength:&cbCopied
+                        encoding:NSASCIIStringEncoding
+                         options:0
+                           range:NSMakeRange(0, cbEncoded)
+                  remainingRange:NULL] ||
+        cbCopied != cbEncoded)
+    {
         return nil;
     }
     
-    // Decode each four-byte cluster into the corresponding three data bytes,
-    // allowing for the fact that the last cluster may be less than four bytes
-    // (virtual padding).
-    ich = ib = 0;
+    NSUInteger ich = 0;
+    NSUInteger ib = 0;
+    byte  b0, b1, b2, b3;
     
-    int end4 = (cbEncoded/4)*4;
+    // Decode each four-byte cluster into the corresponding three data bytes, checking the
+    // characters along the way rather than in a separate pass.
+    NSUInteger end4 = (cbEncoded/4)*4;
     //Quick loop, no boundary checks:
-    for(; ich < end4; )
+    for(; ich < end4; ich += 4)
     {
-        b0 = rgbDecodeTable[pbEncoded[ich++]];
-        b1 = rgbDecodeTable[pbEncoded[ich++]];
-        b2 = rgbDecodeTable[pbEncoded[ich++]];
-        b3 = rgbDecodeTable[pbEncoded[ich++]];
+        b0 = rgbDecodeTable[buffer[ich]];
+        b1 = rgbDecodeTable[buffer[ich + 1]];
+        b2 = rgbDecodeTable[buffer[ich + 2]];
+        b3 = rgbDecodeTable[buffer[ich + 3]];
         
-        pbDecoded[ib++] = (b0 << 2) | (b1 >> 4);
-        pbDecoded[ib++] = (b1 << 4) | (b2 >> 2);
-        pbDecoded[ib++] = (b2 << 6) | b3;
+        if ((b0 | b1 | b2 | b3) & INVALID_BASE64_BITS)
+        {
+            return nil;
+        }
+        
+        buffer[ib++] = (b0 << 2) | (b1 >> 4);
+        buffer[ib++] = (b1 << 4) | (b2 >> 2);
+        buffer[ib++] = (b2 << 6) | b3;
     }
     
-    //Beyond the padding to 4. Requires boundary checks,
-    //but the inner side shouldn't be executed more than 3 times:
-    while ( ich < cbEncoded )
+    // The last two or three characters hold one or two bytes ('virtual padding').
+    if (ich < cbEncoded)
     {
-        b0 = rgbDecodeTable[pbEncoded[ich++]];
-        b1 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
-        b2 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
-        b3 = (ich < cbEncoded) ? rgbDecodeTable[pbEncoded[ich++]] : 0;
+        b0 = rgbDecodeTable[buffer[ich]];
+        b1 = rgbDecodeTable[buffer[ich + 1]];
+        b2 = (ich + 2 < cbEncoded) ? rgbDecodeTable[buffer[ich + 2]] : 0;
         
-        pbDecoded[ib++] = (b0 << 2) | (b1 >> 4);
+        if ((b0 | b1 | b2) & INVALID_BASE64_BITS)
+        {
+            return nil;
+        }
         
-        if (ib < cbDecodedSize) {
-            pbDecoded[ib++] = (b1 << 4) | (b2 >> 2);
-            
-            if (ib < cbDecodedSize) {
-                pbDecoded[ib++] = (b2 << 6) | b3;
-            }
+        buffer[ib++] = (b0 << 2) | (b1 >> 4);
+        if (ich + 2 < cbEncoded)
+        {
+            buffer[ib++] = (b1 << 4) | (b2 >> 2);
         }
     }
     
-    // Place the result in a NSData object and then free it.
-    NSData *result = [NSData dataWithBytes:pbDecoded length:cbDecodedSize];
-    
-    free( pbDecoded );
-    
+    [result setLength:ib];
     return result;
 }
 
@@ -187,79 +182,71 @@ static inline void Encode3bytesTo4bytes(char* output, int b0, int b1, int b2)
 /// See RFC 4648, Section 5 plus switch characters 62 and 63 and no padding.
 /// For a good overview of Base64 encoding, see http://en.wikipedia.org/wiki/Base64
 /// </remarks>
-+ (NSString *)adBase64EncodeData:(NSData *)data
+// Unpadded, so the trailing one or two bytes take two or three characters instead of four.
+static inline NSUInteger Base64UrlEncodedSize(NSUInteger cbBytes)
 {
-    if ( nil == data )
-        return nil;
-    
-    const byte *pbBytes = [data bytes];
-    int         cbBytes = (int)[data length];
-    
-    // Calculate encoded string size including padding. This may be more than is actually
-    // required since we will not pad and instead will terminate with null. The computation
-    // is the number of byte triples times 4 radix64 characters plus 1 for null termination.
-    int   encodedSize = 1 + ( cbBytes + 2 ) / 3 * 4;
-    char *pbEncoded = (char *)calloc( encodedSize, sizeof(char) );
-    
-    if(!pbEncoded){
-        return nil;
-    }
+    NSUInteger remainder = cbBytes % 3;
+    return cbBytes / 3 * 4 + (remainder ? remainder + 1 : 0);
+}
+
+// Writes Base64UrlEncodedSize(cbBytes) characters to pbEncoded.
+static void Base64UrlEncode(const byte *pbBytes, NSUInteger cbBytes, char *pbEncoded)
+{
+    NSUInteger remainder = cbBytes % 3;
     
     // Encode data byte triplets into four-byte clusters.
-    int   iBytes;      // raw byte index
-    int   iEncoded;    // encoded byte index
-    byte  b0, b1, b2;  // individual bytes for triplet
+    NSUInteger iBytes = 0;      // raw byte index
+    NSUInteger iEncoded = 0;    // encoded byte index
     
-    iBytes = iEncoded = 0;
-    
-    int end3 = (cbBytes/3)*3;
+    NSUInteger end3 = cbBytes - remainder;
     //Fast loop, no bounderies check:
-    for ( ; iBytes < end3; )
+    for ( ; iBytes < end3; iBytes += 3, iEncoded += 4)
     {
-        b0 = pbBytes[iBytes++];
-        b1 = pbBytes[iBytes++];
-        b2 = pbBytes[iBytes++];
-        
-        Encode3bytesTo4bytes(pbEncoded + iEncoded, b0, b1, b2);
-        iEncoded += 4;
+        Encode3bytesTo4bytes(pbEncoded + iEncoded, pbBytes[iBytes], pbBytes[iBytes + 1], pbBytes[iBytes + 2]);
     }
     
-    //Slower loop should execute no more than 3 times:
-    while ( iBytes < cbBytes )
+    // Where we would have padded it, we instead truncate the string
+    if (remainder)
     {
-        b0 = pbBytes[iBytes++];
-        b1 = (iBytes < cbBytes) ? pbBytes[iBytes++] : 0;                                        // Add extra zero byte if needed
-        b2 = (iBytes < cbBytes) ? pbBytes[iBytes++] : 0;                                        // Add extra zero byte if needed
-        
-        Encode3bytesTo4bytes(pbEncoded + iEncoded, b0, b1, b2);
-        iEncoded += 4;
+        char last[4];
+        Encode3bytesTo4bytes(last, pbBytes[iBytes], (remainder == 2) ? pbBytes[iBytes + 1] : 0, 0);
+        memcpy(pbEncoded + iEncoded, last, remainder + 1);
     }
+}
+
++ (NSString *)adBase64EncodeData:(NSData *)data
+{
+    if ( nil == data )
+        return nil;
     
-    // Where we would have padded it, we instead truncate the string
-    switch ( cbBytes % 3 )
+    NSUInteger encodedSize = Base64UrlEncodedSize([data length]);
+    if (encodedSize == 0)
     {
-        case 0:
-            // No left overs, nothing to pad
-            break;
-            
-        case 1:
-            // One left over, normally pad 2
-            pbEncoded[iEncoded - 2] = '\0';
-            // fall through
-            
-        case 2:
-            pbEncoded[iEncoded - 1] = '\0';
-            break;
+        return @"";
     }
     
-    // Null terminate, convert to NSString and free the buffer
-    pbEncoded[iEncoded++] = '\0';
+    // Written straight into the buffer the string takes ownership of
+    char *pbEncoded = (char *)malloc( encodedSize );
     
-    NSString *result = [NSString stringWithCString:pbEncoded encoding:NSUTF8StringEncoding];
+    if(!pbEncoded){
+        return nil;
+    }
     
-    free(pbEncoded);
+    Base64UrlEncode([data bytes], [data length], pbEncoded);
     
-    return result;
+    return [[NSString alloc] initWithBytesNoCopy:pbEncoded
+                                          length:encodedSize
+                                        encoding:NSASCIIStringEncoding
+                                    freeWhenDone:YES];
+}
+
++ (void)adAppendBase64UrlEncodedBytes:(const void *)bytes
+                               length:(NSUInteger)length
+                               toData:(NSMutableData *)data
+{
+    NSUInteger offset = [data length];
+    [data increaseLengthBy:Base64UrlEncodedSize(length)];
+    Base64UrlEncode(bytes, length, (char *)[data mutableBytes] + offset);
 }
 
 // Base64 URL encodes a string
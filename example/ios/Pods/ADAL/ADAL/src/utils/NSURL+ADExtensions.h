@@ -29,6 +29,10 @@
 
 - (BOOL)isEquivalentAuthority:(NSURL *)aURL;
 
+/*! A lowercased "scheme://host[:port]" string that is equal for any two URLs that are
+    equivalent authorities, suitable as a dictionary key. nil if there is no scheme or host. */
+- (NSString *)adAuthorityKey;
+
 - (NSDictionary *)adQueryParameters;
 
 @end
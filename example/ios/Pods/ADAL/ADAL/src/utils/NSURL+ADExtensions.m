@@ -80,4 +80,19 @@ const unichar queryStringSeparator = '?';
     return YES;
 }
 
+- (NSString *)adAuthorityKey
+{
+    if (!self.scheme || !self.host)
+    {
+        return nil;
+    }
+    
+    if (self.port)
+    {
+        return [[NSString stringWithFormat:@"%@://%@:%@", self.scheme, self.host, self.port] lowercaseString];
+    }
+    
+    return [[NSString stringWithFormat:@"%@://%@", self.scheme, self.host] lowercaseString];
+}
+
 @end
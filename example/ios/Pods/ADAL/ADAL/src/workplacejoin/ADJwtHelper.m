@@ -24,6 +24,7 @@
 #import "ADJwtHelper.h"
 #import "ADLogger+Internal.h"
 #import "ADErrorCodes.h"
+#import "ADHelpers.h"
 #import "NSString+ADHelperMethods.h"
 #import <CommonCrypto/CommonDigest.h>
 #import <Security/Security.h>
@@ -36,14 +37,20 @@
                               payload:(NSDictionary *)payload
                            signingKey:(SecKeyRef)signingKey
 {
-    NSString* headerJSON = [ADJwtHelper JSONFromDictionary:header];
-    NSString* payloadJSON = [ADJwtHelper JSONFromDictionary:payload];
-    NSString* signingInput = [NSString stringWithFormat:@"%@.%@", [headerJSON adBase64UrlEncode], [payloadJSON adBase64UrlEncode]];
+    NSMutableData* signingInput = [ADHelpers JWTSigningInputForHeader:header payload:payload];
+    if (!signingInput)
+    {
+        return nil;
+    }
+    
     NSData* signedData = [ADJwtHelper sign:signingKey
-                                      data:[signingInput dataUsingEncoding:NSUTF8StringEncoding]];
-    NSString* signedEncodedDataString = [NSString adBase64EncodeData: signedData];
+                                      data:signingInput];
+    if (!signedData)
+    {
+        return nil;
+    }
     
-    return [NSString stringWithFormat:@"%@.%@", signingInput, signedEncodedDataString];
+    return [ADHelpers JWTWithSigningInput:signingInput signatureBytes:signedData.bytes length:signedData.length];
 }
 
 
@@ -134,22 +141,4 @@
     return signedHash;
 }
 
-
-+ (NSString *)JSONFromDictionary:(NSDictionary *)dictionary
-{
-    
-    NSError *error = nil;
-    NSData *jsonData = [NSJSONSerialization dataWithJSONObject:dictionary
-                                                       options:NSJSONWritingPrettyPrinted
-                                                         error:&error];
-    if (!jsonData)
-    {
-        AD_LOG_ERROR(([NSString stringWithFormat:@"Got an error: %@", error]), error.code, nil, nil);
-        return nil;
-    }
-
-    NSString* json = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
-    return json;
-}
-
 @end
@@ -0,0 +1 @@
+../../../../ADAL/ADAL/src/ADCancellationToken.h
\ No newline at end of file
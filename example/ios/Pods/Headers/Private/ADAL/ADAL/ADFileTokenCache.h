@@ -0,0 +1 @@
+../../../../ADAL/ADAL/src/cache/ADFileTokenCache.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../ADAL/ADAL/src/request/ADTokenRefreshScheduler.h
\ No newline at end of file
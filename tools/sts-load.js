@@ -0,0 +1,327 @@
+#!/usr/bin/env node
+//
+// Load driver for the STS stub (tools/sts-stub.js). Replays the traffic the ADAL request stack
+// generates, from a number of concurrent workers, and reports throughput and latency.
+//
+// Each worker picks its next request at random, weighted by --mix:
+//   token       POST /<tenant>/oauth2/token, password grant
+//   refresh     POST /<tenant>/oauth2/token, refresh_token grant with the worker's refresh token
+//   discovery   GET  /common/discovery/instance
+//   drs         GET  /<domain>/enrollmentserver/contract
+//   webfinger   GET  /.well-known/webfinger
+//
+// Usage:
+//   npm run sts-load -- [--url http://127.0.0.1:8443] [--start-stub]
+//                       [--concurrency 16] [--duration 10 | --requests 10000]
+//                       [--mix token=1,refresh=4,discovery=1,drs=1,webfinger=1]
+//                       [--tenant common] [--client-id <id>] [--insecure]
+//
+// --start-stub runs a stub with its default settings in this process and points the driver at
+// it, anything else (latency, injected errors) needs a stub started on its own.
+// Non-2xx responses and connection errors are counted as errors, their latency is still recorded.
+
+'use strict';
+
+const crypto = require('crypto');
+const http = require('http');
+const https = require('https');
+const querystring = require('querystring');
+const url = require('url');
+const stub = require('./sts-stub');
+
+const defaults = {
+  url: 'http://127.0.0.1:8443',
+  startStub: false,
+  concurrency: 16,
+  duration: 10,
+  requests: 0,
+  mix: 'token=1,refresh=4,discovery=1,drs=1,webfinger=1',
+  tenant: 'common',
+  clientId: '04b07795-8ddb-461a-bbee-02f9e1bf7b46',
+  insecure: false,
+};
+
+const KINDS = ['token', 'refresh', 'discovery', 'drs', 'webfinger'];
+
+function parseSettings(argv) {
+  const settings = Object.assign({}, defaults);
+
+  for (let i = 0; i < argv.length; i++) {
+    const match = /^--([a-z-]+)$/.exec(argv[i]);
+    if (!match) {
+      throw new Error('Unexpected argument: ' + argv[i]);
+    }
+    const name = match[1].replace(/-([a-z])/g, (m, c) => c.toUpperCase());
+    if (!(name in defaults)) {
+      throw new Error('Unknown option: ' + argv[i]);
+    }
+    if (typeof defaults[name] === 'boolean') {
+      settings[name] = true;
+      continue;
+    }
+    const value = argv[++i];
+    if (value === undefined) {
+      throw new Error('Missing value for ' + argv[i - 1]);
+    }
+    if (typeof defaults[name] === 'number') {
+      if (isNaN(Number(value)) || Number(value) < 0) {
+        throw new Error('Expected a non-negative number for ' + argv[i - 1] + ', got ' + value);
+      }
+      settings[name] = Number(value);
+    } else {
+      settings[name] = value;
+    }
+  }
+
+  if (settings.concurrency < 1) {
+    throw new Error('--concurrency must be at least 1');
+  }
+  settings.weights = parseMix(settings.mix);
+  return settings;
+}
+
+// "token=1,refresh=4" -> [{ kind: 'token', upTo: 0.2 }, { kind: 'refresh', upTo: 1 }]
+function parseMix(mix) {
+  const weights = [];
+  let total = 0;
+  mix.split(',').filter(Boolean).forEach(part => {
+    const [kind, weight] = part.split('=');
+    if (KINDS.indexOf(kind) < 0) {
+      throw new Error('Unknown request kind in --mix: ' + kind);
+    }
+    const value = weight === undefined ? 1 : Number(weight);
+    if (isNaN(value) || value < 0) {
+      throw new Error('Bad weight in --mix: ' + part);
+    }
+    if (value > 0) {
+      total += value;
+      weights.push({ kind: kind, upTo: total });
+    }
+  });
+  if (!total) {
+    throw new Error('--mix must give at least one kind a weight');
+  }
+  weights.forEach(w => { w.upTo /= total; });
+  return weights;
+}
+
+function pickKind(weights) {
+  const r = Math.random();
+  for (const w of weights) {
+    if (r < w.upTo) {
+      return w.kind;
+    }
+  }
+  return weights[weights.length - 1].kind;
+}
+
+function percentile(sorted, p) {
+  if (!sorted.length) {
+    return 0;
+  }
+  return sorted[Math.min(sorted.length - 1, Math.floor(p * sorted.length))];
+}
+
+class Driver {
+  constructor(settings) {
+    this.settings = settings;
+    this.target = url.parse(settings.url);
+    this.transport = this.target.protocol === 'https:' ? https : http;
+    this.agent = new this.transport.Agent({ keepAlive: true, maxSockets: settings.concurrency });
+    this.issued = 0;
+    this.results = {};
+    KINDS.forEach(kind => { this.results[kind] = { latencies: [], errors: 0 }; });
+  }
+
+  send(method, path, form) {
+    const body = form ? querystring.stringify(form) : null;
+    const headers = { 'client-request-id': crypto.randomUUID() };
+    if (body) {
+      headers['Content-Type'] = 'application/x-www-form-urlencoded';
+      headers['Content-Length'] = Buffer.byteLength(body);
+    }
+
+    return new Promise(resolve => {
+      const req = this.transport.request({
+        hostname: this.target.hostname,
+        port: this.target.port,
+        method: method,
+        path: path,
+        headers: headers,
+        agent: this.agent,
+        rejectUnauthorized: !this.settings.insecure,
+      }, res => {
+        let data = '';
+        res.setEncoding('utf8');
+        res.on('data', chunk => { data += chunk; });
+        res.on('end', () => {
+          let json = null;
+          try {
+            json = JSON.parse(data);
+          } catch (e) {
+            // Counted as an error below if the status says so, the body doesn't matter otherwise
+          }
+          resolve({ status: res.statusCode, json: json });
+        });
+      });
+      req.on('error', () => resolve({ status: 0, json: null }));
+      if (body) {
+        req.write(body);
+      }
+      req.end();
+    });
+  }
+
+  passwordGrant(worker) {
+    return this.send('POST', '/' + this.settings.tenant + '/oauth2/token', {
+      grant_type: 'password',
+      client_id: this.settings.clientId,
+      resource: 'https://graph.windows.net',
+      username: 'load' + worker.id + '@contoso.com',
+      password: 'password',
+    });
+  }
+
+  request(kind, worker) {
+    const settings = this.settings;
+    const domain = 'contoso.com';
+    switch (kind) {
+      case 'token':
+        return this.passwordGrant(worker);
+      case 'refresh':
+        return this.send('POST', '/' + settings.tenant + '/oauth2/token', {
+          grant_type: 'refresh_token',
+          client_id: settings.clientId,
+          resource: 'https://graph.windows.net',
+          refresh_token: worker.refreshToken,
+        });
+      case 'discovery':
+        return this.send('GET', '/common/discovery/instance?' + querystring.stringify({
+          'api-version': '1.0',
+          authorization_endpoint: 'https://login.microsoftonline.com/' + settings.tenant + '/oauth2/authorize',
+        }));
+      case 'drs':
+        return this.send('GET', '/' + domain + '/enrollmentserver/contract?api-version=1.0');
+      case 'webfinger':
+        return this.send('GET', '/.well-known/webfinger?' + querystring.stringify({
+          resource: 'https://adfs.' + domain,
+          rel: 'http://schemas.microsoft.com/rel/trusted-realm',
+        }));
+    }
+    throw new Error('Unknown request kind ' + kind);
+  }
+
+  hasMoreWork(deadline) {
+    if (this.settings.requests) {
+      return this.issued < this.settings.requests;
+    }
+    return Date.now() < deadline;
+  }
+
+  async worker(id, deadline) {
+    const worker = { id: id, refreshToken: null };
+
+    while (this.hasMoreWork(deadline)) {
+      let kind = pickKind(this.settings.weights);
+      if (kind === 'refresh' && !worker.refreshToken) {
+        // Nothing to redeem until the worker's first token request went through
+        kind = 'token';
+      }
+      this.issued++;
+
+      const start = process.hrtime.bigint();
+      const response = await this.request(kind, worker);
+      const latency = Number(process.hrtime.bigint() - start) / 1e6;
+
+      const result = this.results[kind];
+      result.latencies.push(latency);
+      if (response.status < 200 || response.status >= 300) {
+        result.errors++;
+        if (kind === 'refresh' && response.json && response.json.error === 'invalid_grant') {
+          // Rotated away or revoked, get a fresh one
+          worker.refreshToken = null;
+        }
+      } else if (response.json && response.json.refresh_token) {
+        worker.refreshToken = response.json.refresh_token;
+      }
+    }
+  }
+
+  async run() {
+    const settings = this.settings;
+    const deadline = Date.now() + settings.duration * 1000;
+    const start = process.hrtime.bigint();
+    const workers = [];
+    for (let i = 0; i < settings.concurrency; i++) {
+      workers.push(this.worker(i, deadline));
+    }
+    await Promise.all(workers);
+    this.elapsed = Number(process.hrtime.bigint() - start) / 1e9;
+    this.agent.destroy();
+  }
+
+  report() {
+    const rows = [];
+    let all = [];
+    let errors = 0;
+    KINDS.forEach(kind => {
+      const result = this.results[kind];
+      if (!result.latencies.length) {
+        return;
+      }
+      const sorted = result.latencies.slice().sort((a, b) => a - b);
+      rows.push([kind, sorted.length, result.errors, sorted.length / this.elapsed, percentile(sorted, 0.5), percentile(sorted, 0.99)]);
+      all = all.concat(result.latencies);
+      errors += result.errors;
+    });
+    all.sort((a, b) => a - b);
+    rows.push(['total', all.length, errors, all.length / this.elapsed, percentile(all, 0.5), percentile(all, 0.99)]);
+
+    const lines = [];
+    lines.push('Ran ' + this.settings.concurrency + ' workers for ' + this.elapsed.toFixed(2) + 's against ' + this.settings.url);
+    lines.push(['kind', 'requests', 'errors', 'req/s', 'p50 ms', 'p99 ms'].map(pad).join(''));
+    rows.forEach(row => {
+      lines.push([row[0], row[1], row[2], row[3].toFixed(1), row[4].toFixed(2), row[5].toFixed(2)].map(pad).join(''));
+    });
+    return lines.join('\n');
+  }
+}
+
+function pad(value) {
+  return String(value).padStart(12);
+}
+
+async function main() {
+  let settings;
+  try {
+    settings = parseSettings(process.argv.slice(2));
+  } catch (e) {
+    console.error(e.message);
+    process.exit(2);
+  }
+
+  let server = null;
+  if (settings.startStub) {
+    const instance = new stub.Stub(stub.parseSettings([], {}));
+    server = http.createServer((req, res) => instance.handle(req, res));
+    await new Promise(resolve => server.listen(0, '127.0.0.1', resolve));
+    settings.url = 'http://127.0.0.1:' + server.address().port;
+  }
+
+  const driver = new Driver(settings);
+  await driver.run();
+  console.log(driver.report());
+
+  if (server) {
+    server.close();
+  }
+}
+
+if (require.main === module) {
+  main().catch(e => {
+    console.error(e.stack || e.message);
+    process.exit(1);
+  });
+}
+
+module.exports = { Driver: Driver, parseSettings: parseSettings };
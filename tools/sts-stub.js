@@ -0,0 +1,430 @@
+#!/usr/bin/env node
+//
+// Local stand-in for the Azure AD endpoints the ADAL request stack talks to, so token
+// requests, authority validation and retries can be exercised without a network.
+//
+// Serves:
+//   POST /<tenant>/oauth2/token                  authorization_code, password, refresh_token,
+//                                                client_credentials and SAML bearer grants
+//   GET  /common/discovery/instance              AAD instance discovery
+//   GET  /enrollmentserver/contract              DRS discovery (on-premises layout)
+//   GET  /<domain>/enrollmentserver/contract     DRS discovery (cloud layout)
+//   GET  /.well-known/webfinger                  ADFS WebFinger
+//   GET  /stub/stats, GET|POST /stub/config      counters, and the settings below at runtime
+//
+// Usage:
+//   npm run sts-stub -- [--port 8443] [--latency 50 | --latency 20-200]
+//                       [--error-rate 0.1] [--error-status 503] [--reset-rate 0.01]
+//                       [--token-lifetime 3600] [--ext-token-lifetime 7200]
+//                       [--rotate-refresh-tokens] [--family-id 1]
+//                       [--unknown-authorities evil.example.com,...]
+//                       [--cert cert.pem --key key.pem]
+//
+// Every setting can also be given as an environment variable, e.g. STS_STUB_ERROR_RATE=0.1.
+// Listens on 127.0.0.1 only. Without --cert and --key it serves plain HTTP.
+
+'use strict';
+
+const crypto = require('crypto');
+const fs = require('fs');
+const http = require('http');
+const https = require('https');
+const url = require('url');
+const querystring = require('querystring');
+
+const TRUSTED_REALM_REL = 'http://schemas.microsoft.com/rel/trusted-realm';
+
+const defaults = {
+  host: '127.0.0.1',
+  port: 8443,
+  latency: '0',
+  errorRate: 0,
+  errorStatus: 503,
+  resetRate: 0,
+  tokenLifetime: 3600,
+  extTokenLifetime: 0,
+  rotateRefreshTokens: false,
+  familyId: '',
+  unknownAuthorities: '',
+  cert: '',
+  key: '',
+};
+
+function parseSettings(argv, env) {
+  const settings = Object.assign({}, defaults);
+
+  Object.keys(defaults).forEach(name => {
+    const envName = 'STS_STUB_' + name.replace(/[A-Z]/g, c => '_' + c).toUpperCase();
+    if (env[envName] !== undefined) {
+      settings[name] = coerce(name, env[envName]);
+    }
+  });
+
+  for (let i = 0; i < argv.length; i++) {
+    const match = /^--([a-z-]+)$/.exec(argv[i]);
+    if (!match) {
+      throw new Error('Unexpected argument: ' + argv[i]);
+    }
+    const name = match[1].replace(/-([a-z])/g, (m, c) => c.toUpperCase());
+    if (!(name in defaults)) {
+      throw new Error('Unknown option: ' + argv[i]);
+    }
+    if (typeof defaults[name] === 'boolean') {
+      settings[name] = true;
+    } else {
+      settings[name] = coerce(name, argv[++i]);
+    }
+  }
+
+  return settings;
+}
+
+function coerce(name, value) {
+  if (value === undefined) {
+    throw new Error('Missing value for ' + name);
+  }
+  switch (typeof defaults[name]) {
+    case 'number':
+      if (isNaN(Number(value))) {
+        throw new Error('Expected a number for ' + name + ', got ' + value);
+      }
+      return Number(value);
+    case 'boolean':
+      return value === true || value === 'true' || value === '1';
+    default:
+      return String(value);
+  }
+}
+
+// "50" is a fixed delay, "20-200" is picked uniformly from the range, both in milliseconds.
+function latencyFor(settings) {
+  const parts = String(settings.latency).split('-').map(Number);
+  if (parts.length === 1) {
+    return parts[0];
+  }
+  return parts[0] + Math.random() * (parts[1] - parts[0]);
+}
+
+function base64url(value) {
+  return Buffer.from(value).toString('base64').replace(/=+$/, '').replace(/\+/g, '-').replace(/\//g, '_');
+}
+
+function randomToken(prefix) {
+  return prefix + '.' + crypto.randomBytes(24).toString('hex');
+}
+
+class Stub {
+  constructor(settings) {
+    this.settings = settings;
+    // refresh token -> { upn, clientId, tenant, familyId }
+    this.refreshTokens = new Map();
+    this.stats = {
+      requests: 0,
+      tokens: 0,
+      refreshes: 0,
+      invalidGrants: 0,
+      injectedErrors: 0,
+      injectedResets: 0,
+      discovery: 0,
+      drs: 0,
+      webfinger: 0,
+    };
+  }
+
+  handle(req, res) {
+    this.stats.requests++;
+
+    const parsed = url.parse(req.url, true);
+    if (parsed.pathname.startsWith('/stub/')) {
+      // The control endpoints are never delayed or failed
+      this.control(req, res, parsed);
+      return;
+    }
+
+    let body = '';
+    req.setEncoding('utf8');
+    req.on('data', chunk => { body += chunk; });
+    req.on('end', () => {
+      setTimeout(() => this.route(req, res, parsed, body), latencyFor(this.settings));
+    });
+  }
+
+  route(req, res, parsed, body) {
+    const settings = this.settings;
+
+    if (Math.random() < settings.resetRate) {
+      this.stats.injectedResets++;
+      req.socket.destroy();
+      return;
+    }
+
+    if (Math.random() < settings.errorRate) {
+      this.stats.injectedErrors++;
+      this.sendJSON(req, res, settings.errorStatus, {
+        error: settings.errorStatus >= 500 ? 'temporarily_unavailable' : 'invalid_request',
+        error_description: 'AADSTS90000: Error injected by the STS stub.',
+      });
+      return;
+    }
+
+    const path = parsed.pathname;
+    let match;
+    if (req.method === 'POST' && (match = /^\/([^/]+)\/oauth2\/token$/.exec(path))) {
+      this.token(req, res, match[1], querystring.parse(body));
+    } else if (req.method === 'GET' && path === '/common/discovery/instance') {
+      this.instanceDiscovery(req, res, parsed.query);
+    } else if (req.method === 'GET' && /^(\/[^/]+)?\/enrollmentserver\/contract$/.test(path)) {
+      this.drsDiscovery(req, res);
+    } else if (req.method === 'GET' && path === '/.well-known/webfinger') {
+      this.webFinger(req, res, parsed.query);
+    } else {
+      this.sendJSON(req, res, 404, { error: 'not_found', error_description: 'No stub for ' + req.method + ' ' + path });
+    }
+  }
+
+  baseUrl(req) {
+    return (req.socket.encrypted ? 'https' : 'http') + '://' + req.headers.host;
+  }
+
+  sendJSON(req, res, status, json) {
+    const headers = { 'Content-Type': 'application/json; charset=utf-8' };
+    const correlationId = req.headers['client-request-id'];
+    if (correlationId) {
+      headers['client-request-id'] = correlationId;
+      json = Object.assign({}, json, { correlation_id: correlationId });
+    }
+    res.writeHead(status, headers);
+    res.end(JSON.stringify(json));
+  }
+
+  invalidGrant(req, res, description) {
+    this.stats.invalidGrants++;
+    this.sendJSON(req, res, 400, { error: 'invalid_grant', error_description: description });
+  }
+
+  token(req, res, tenant, params) {
+    const settings = this.settings;
+    const clientId = params.client_id;
+    if (!clientId) {
+      this.sendJSON(req, res, 400, { error: 'invalid_request', error_description: "AADSTS90014: The request body must contain the following parameter: 'client_id'." });
+      return;
+    }
+
+    let upn = null;
+    let familyId = settings.familyId;
+    switch (params.grant_type) {
+      case 'authorization_code':
+        // Codes of the form "user:<upn>" pick the user, anything else gets the default one
+        upn = /^user:(.+)$/.test(params.code || '') ? params.code.slice(5) : 'user@contoso.com';
+        break;
+      case 'password':
+        upn = params.username || 'user@contoso.com';
+        break;
+      case 'urn:ietf:params:oauth:grant-type:saml1_1-bearer':
+      case 'urn:ietf:params:oauth:grant-type:saml2-bearer':
+        upn = 'user@contoso.com';
+        break;
+      case 'refresh_token': {
+        const grant = this.refreshTokens.get(params.refresh_token);
+        if (!grant) {
+          this.invalidGrant(req, res, 'AADSTS70002: The refresh token is invalid or has been revoked.');
+          return;
+        }
+        // A family refresh token can be redeemed by any client in the family
+        if (grant.clientId !== clientId && !grant.familyId) {
+          this.invalidGrant(req, res, 'AADSTS70000: The refresh token was issued to a different client.');
+          return;
+        }
+        upn = grant.upn;
+        familyId = grant.familyId;
+        this.stats.refreshes++;
+        if (settings.rotateRefreshTokens) {
+          this.refreshTokens.delete(params.refresh_token);
+        }
+        break;
+      }
+      case 'client_credentials':
+        break;
+      default:
+        this.sendJSON(req, res, 400, { error: 'unsupported_grant_type', error_description: 'AADSTS70003: The grant type ' + params.grant_type + ' is not supported.' });
+        return;
+    }
+
+    const now = Math.floor(Date.now() / 1000);
+    const json = {
+      token_type: 'Bearer',
+      access_token: randomToken('at'),
+      expires_in: String(settings.tokenLifetime),
+      expires_on: String(now + settings.tokenLifetime),
+      not_before: String(now),
+    };
+    if (params.resource) {
+      json.resource = params.resource;
+    }
+    if (settings.extTokenLifetime) {
+      json.ext_expires_in = String(settings.extTokenLifetime);
+    }
+
+    if (upn) {
+      let refreshToken = params.refresh_token;
+      if (!refreshToken || settings.rotateRefreshTokens) {
+        refreshToken = randomToken('rt');
+        this.refreshTokens.set(refreshToken, { upn: upn, clientId: clientId, tenant: tenant, familyId: familyId });
+      }
+      json.refresh_token = refreshToken;
+      json.id_token = this.idToken(tenant, clientId, upn, now);
+      if (familyId) {
+        json.foci = familyId;
+      }
+    }
+
+    this.stats.tokens++;
+    this.sendJSON(req, res, 200, json);
+  }
+
+  idToken(tenant, clientId, upn, now) {
+    const tenantId = /^[0-9a-f-]{36}$/.test(tenant) ? tenant : '72f988bf-86f1-41af-91ab-2d7cd011db47';
+    const oid = crypto.createHash('sha1').update(upn).digest('hex');
+    const name = upn.split('@')[0];
+    const payload = {
+      aud: clientId,
+      iss: 'https://sts.windows.net/' + tenantId + '/',
+      iat: now,
+      nbf: now,
+      exp: now + this.settings.tokenLifetime,
+      tid: tenantId,
+      oid: [oid.slice(0, 8), oid.slice(8, 12), oid.slice(12, 16), oid.slice(16, 20), oid.slice(20, 32)].join('-'),
+      sub: oid,
+      upn: upn,
+      unique_name: upn,
+      given_name: name,
+      family_name: 'Stub',
+      ver: '1.0',
+    };
+    return base64url(JSON.stringify({ typ: 'JWT', alg: 'none' })) + '.' + base64url(JSON.stringify(payload)) + '.';
+  }
+
+  isUnknownAuthority(authority) {
+    let host;
+    try {
+      host = url.parse(authority).hostname;
+    } catch (e) {
+      return true;
+    }
+    return !host || this.settings.unknownAuthorities.split(',').filter(Boolean).indexOf(host) >= 0;
+  }
+
+  instanceDiscovery(req, res, query) {
+    this.stats.discovery++;
+    const authorizationEndpoint = query.authorization_endpoint;
+    if (!authorizationEndpoint || this.isUnknownAuthority(authorizationEndpoint)) {
+      this.sendJSON(req, res, 400, {
+        error: 'invalid_instance',
+        error_description: 'AADSTS50049: Unknown or invalid instance.',
+      });
+      return;
+    }
+
+    const tenant = url.parse(authorizationEndpoint).pathname.split('/')[1] || 'common';
+    this.sendJSON(req, res, 200, {
+      tenant_discovery_endpoint: this.baseUrl(req) + '/' + tenant + '/.well-known/openid-configuration',
+    });
+  }
+
+  drsDiscovery(req, res) {
+    this.stats.drs++;
+    this.sendJSON(req, res, 200, {
+      DeviceRegistrationService: {
+        RegistrationEndpoint: this.baseUrl(req) + '/EnrollmentServer/DeviceEnrollmentWebService.svc',
+        RegistrationResourceId: 'urn:ms-drs:' + req.headers.host,
+        ServiceVersion: '1.0',
+      },
+      AuthenticationService: {
+        OAuth2: {
+          AuthCodeEndpoint: this.baseUrl(req) + '/adfs/oauth2/authorize',
+          TokenEndpoint: this.baseUrl(req) + '/adfs/oauth2/token',
+        },
+      },
+      IdentityProviderService: {
+        PassiveAuthEndpoint: this.baseUrl(req) + '/adfs/ls',
+      },
+    });
+  }
+
+  webFinger(req, res, query) {
+    this.stats.webfinger++;
+    const resource = query.resource;
+    if (!resource || this.isUnknownAuthority(resource)) {
+      this.sendJSON(req, res, 404, { error: 'not_found', error_description: 'Unknown resource' });
+      return;
+    }
+
+    const authority = url.parse(resource);
+    this.sendJSON(req, res, 200, {
+      subject: resource,
+      links: [{ rel: TRUSTED_REALM_REL, href: authority.protocol + '//' + authority.host }],
+    });
+  }
+
+  control(req, res, parsed) {
+    if (parsed.pathname === '/stub/stats') {
+      this.sendJSON(req, res, 200, Object.assign({ refreshTokensIssued: this.refreshTokens.size }, this.stats));
+      return;
+    }
+
+    if (parsed.pathname !== '/stub/config') {
+      this.sendJSON(req, res, 404, { error: 'not_found' });
+      return;
+    }
+
+    if (req.method === 'GET') {
+      this.sendJSON(req, res, 200, this.settings);
+      return;
+    }
+
+    let body = '';
+    req.setEncoding('utf8');
+    req.on('data', chunk => { body += chunk; });
+    req.on('end', () => {
+      try {
+        const changes = JSON.parse(body || '{}');
+        Object.keys(changes).forEach(name => {
+          if (!(name in defaults) || ['host', 'port', 'cert', 'key'].indexOf(name) >= 0) {
+            throw new Error('Setting ' + name + ' can not be changed at runtime');
+          }
+          this.settings[name] = coerce(name, changes[name]);
+        });
+        this.sendJSON(req, res, 200, this.settings);
+      } catch (e) {
+        this.sendJSON(req, res, 400, { error: 'invalid_request', error_description: e.message });
+      }
+    });
+  }
+}
+
+function main() {
+  let settings;
+  try {
+    settings = parseSettings(process.argv.slice(2), process.env);
+  } catch (e) {
+    console.error(e.message);
+    process.exit(2);
+  }
+
+  const stub = new Stub(settings);
+  const handler = (req, res) => stub.handle(req, res);
+  const server = settings.cert && settings.key
+    ? https.createServer({ cert: fs.readFileSync(settings.cert), key: fs.readFileSync(settings.key) }, handler)
+    : http.createServer(handler);
+
+  server.listen(settings.port, settings.host, () => {
+    const address = server.address();
+    console.log('STS stub listening on ' + (settings.cert ? 'https' : 'http') + '://' + address.address + ':' + address.port);
+  });
+}
+
+if (require.main === module) {
+  main();
+}
+
+module.exports = { Stub: Stub, parseSettings: parseSettings };